@@ -15,21 +15,40 @@
 #include <asm-generic/errno-base.h>
 #include <asm-generic/ioctls.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
@@ -44,6 +63,17 @@ int RELATIVE_LINE_NUMBERS = 1;
 int UNDO_STACK_SIZE = 100;
 int AUTO_COMPLETION = 1; // COmpletes (,{,<,",'
 int DUMB = 0;            // Only allow insert mode
+int SOFT_WRAP = 0;       // Wrap long lines instead of scrolling sideways
+int LONG_LINE_LENGTH = 65536; // Rows longer than this are rendered in chunks
+int SWAP_INTERVAL = 1000; // ms edits wait to be journaled, 0 for no swap file
+int FOLLOW_LINES = 100000; // Rows kept in follow mode, older ones are dropped
+// Files past either limit only render the rows on screen
+long long LARGE_FILE_SIZE = 64 << 20;
+int LARGE_LINE_LENGTH = 1 << 20;
+long long VIEW_FILE_SIZE = 512 << 20; // Larger files open read only, as -R
+// Yanks and deletes are copied to the system clipboard, 1 through the
+// terminal with OSC 52, 2 through wl-copy or xclip
+int SYSTEM_CLIPBOARD = 0;
 
 enum keys {
   BACKSPACE = 127,
@@ -68,10 +98,23 @@ enum Highlight {
   MULTICOMMENT,
   KEY1,
   KEY2,
-  MATCH
+  MATCH,
+  TYPE,
+  FUNCTION
 };
 
-typedef enum { EDITNONE, EDITINSERT, EDITDELETE } ActionType;
+typedef enum {
+  EDITNONE,
+  EDITINSERT,
+  EDITDELETE,
+  EDITROWS,
+  EDITSPAN,
+  EDITSORT
+} ActionType;
+
+// Long rows keep the render column of every chunk start instead of a full
+// render copy, and only render the chunks around the visible columns
+#define LONG_LINE_CHUNK 4096
 
 #define HL_NUMBERS (1 << 0)
 #define HL_STRINGS (1 << 1)
@@ -84,6 +127,23 @@ static struct {
   bool active;
 } coalesce_state = {.active = false};
 
+struct erow;
+
+// Compiled keywords of a syntax, an open addressed table whose slots point
+// into text
+struct kwslot {
+  uint32_t off; // 0 for an empty slot
+  uint8_t len;
+  uint8_t hl;
+};
+
+struct kwtable {
+  uint32_t mask;
+  struct kwslot *slot;
+  char *text;
+  uint32_t textlen;
+};
+
 struct syntax {
   char *singleCommentStart;
   char *multicommentstart;
@@ -94,6 +154,25 @@ struct syntax {
   char **fmatch;
   char **keywords;
   int flags;
+  // Replaces the keyword scanner if set, true if the state the row ends in
+  // changed
+  bool (*parse)(struct erow *row);
+  struct kwtable *kwtable; // built from keywords on first use
+};
+
+// A lexed token of a row, the unit the parser reuses between edits
+struct token {
+  int start;
+  int len;
+  unsigned char hl;
+  bool ident; // plain identifier, may name a typedef
+};
+
+// Brackets of each kind ( { [ < left unmatched by a run of rows: closes at
+// its start and opens at its end
+struct bracketsum {
+  int close[4];
+  int open[4];
 };
 
 struct erow {
@@ -104,6 +183,223 @@ struct erow {
   unsigned char *highlight;
   int idx;
   bool openComment;
+  int width;     // render columns of the whole line
+  int *colcx;    // line offsets of cells not one column and render byte wide
+  int *colrx;    // render column right after each of those cells
+  int *colrb;    // render byte right after each of those cells
+  int ncols;
+  int colcap;
+  bool windowed; // render only holds the chunks around the visible columns
+  int loff;      // windowed rows: line offsets the render window spans
+  int lend;
+  int roff;      // windowed rows: render column the render window starts at
+  int editfrom;  // cells before this line offset survived the last edit
+  int *brk;      // line offsets of brackets outside strings and comments
+  int nbrk;
+  int brkcap;
+  struct bracketsum brs;
+  struct token *tok; // rows lexed by a parser
+  int ntok;
+  int tokcap;
+  int lexout;   // parser state at the end of the row
+  int typegen;  // typedef name set the highlight was painted with
+  char **tdefs; // typedef names declared on the row
+  int ntdefs;
+  bool swapdirty; // content not journaled yet
+};
+
+// Visual line counts per row for soft wrap, kept as a Fenwick tree so that
+// visual line <-> buffer row lookups are O(log n)
+struct wrapindex {
+  int *tree; // 1-based Fenwick tree over cnt
+  int *cnt;  // visual lines taken by each row
+  int n;
+  int cap;
+  int width; // text columns the counts were computed for
+  bool valid;
+  int voff;   // visual line at the top of the screen
+  int toprow; // row at voff, used to notice rowoff changes made elsewhere
+};
+
+// Segment tree of bracketsum over the rows, rebuilt lazily after rows are
+// inserted or deleted and updated in place when a row changes
+struct bracketindex {
+  struct bracketsum *tree; // node 1 is the root, leaves start at size
+  int size;
+  int n;
+  bool valid;
+};
+
+// Folds are row ranges [lo, hi] whose header row lo stays visible when the
+// fold is closed. They nest, and live in a treap ordered by (lo, -hi) with a
+// lazy row shift so that inserting or deleting a row moves every fold below
+// it in O(log n)
+struct fold {
+  int lo, hi;
+  bool closed;
+  int prio;
+  int shift; // row shift still to be applied to both children
+  int maxc;  // largest hi of a closed fold in the subtree, -1 if none
+  int maxo;  // largest hi of an open fold in the subtree, -1 if none
+  struct fold *l, *r;
+};
+
+// A position that stays on its row as rows above it come and go. Marks sit
+// in a treap ordered by row with the shift still owed to a subtree kept in
+// its root, so an edit moves every mark below it in one split and merge
+struct mark {
+  int row, col;
+  int prio;
+  int shift; // row shift still to be applied to both children
+  struct mark *l, *r, *up;
+};
+
+#define JUMPS_MAX 100
+#define CHANGES_MAX 100
+
+// m{a-z} marks and the jump and change lists, oldest first, all kept in the
+// one treap
+struct marks {
+  struct mark *root;
+  struct mark *named[26];
+  struct mark *jump[JUMPS_MAX];
+  int njump;
+  int jumpat; // entry Ctrl-o and Ctrl-i are on, njump until they are used
+  struct mark *change[CHANGES_MAX];
+  int nchange;
+  int changeat;
+};
+
+// Journal of the edits since the file was opened or saved. Records wait in
+// buf, changed rows only as an index, until they are written out together
+#define SWAP_DIRTY_MAX 64
+
+struct swapjournal {
+  bool on; // off while a file is loaded or replayed
+  int fd;  // -1 until the first write
+  char *buf;
+  int len;
+  int cap;
+  int dirty[SWAP_DIRTY_MAX]; // rows whose content is journaled on the flush
+  int ndirty;
+  long long stamp; // ms of the oldest record not written yet
+  long long size;  // the file the journal applies to
+  long long sec;
+  long long nsec;
+};
+
+// The file as last read or written, to tell an append from a rewrite
+struct diskfile {
+  int watch; // inotify descriptor on the file's directory, -1 if none
+  long long size;
+  long long sec;
+  long long nsec;
+  long long ino;
+  char tail[64]; // last bytes, checked before only the growth is loaded
+  int ntail;
+  bool behind; // more was appended than one read takes
+};
+
+// Bytes of appended data loaded at a time, the rest waits for the next tick
+#define DISK_READ_CHUNK (16 << 20)
+
+enum codec { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+
+// A compressed file being decoded on its own thread. Only the fields from
+// lock on are shared with it
+struct decoder {
+  enum codec codec; // the file is saved compressed with it as well
+  pthread_t thread;
+  int fd;
+  bool running; // the thread has not been joined yet
+  bool partial; // the last row waits for the rest of its line
+  char *taken;  // decoded bytes handed over, loaded a slice at a time
+  size_t ntaken;
+  size_t used;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  char *buf; // decoded bytes the rows do not have yet
+  size_t len;
+  size_t cap;
+  long long total; // bytes decoded
+  bool cut;        // stopped at VIEW_FILE_SIZE
+  bool done;
+  const char *error;
+};
+
+// Compressed bytes read at a time, decoded bytes to wait for before the
+// first screen is drawn, and decoded bytes loaded between checks for input
+#define DECODE_CHUNK (64 << 10)
+#define DECODE_FIRST (256 << 10)
+#define DECODE_SLICE (1 << 20)
+
+// -R views a file through a window of rows loaded around the cursor. The
+// file is read through a sliding mmap and the start of every PAGER_STEP-th
+// line is kept, as far as the file has been scanned
+#define PAGER_STEP 1024
+#define PAGER_MAP (16 << 20)      // bytes mapped at a time
+#define PAGER_LINE_MAX (1 << 20) // longer lines are cut
+
+struct pager {
+  int fd; // -1 unless viewing
+  long long size;
+  char *map;
+  long long mapoff;
+  long long maplen;
+  long long *index; // index[k] is where line k * PAGER_STEP starts
+  int nindex;
+  int indexcap;
+  long long scanned;   // bytes counted so far
+  long long lines;     // newlines in them
+  long long linestart; // where the line after the last of them starts
+  long long base;      // line of row 0, 0 when not viewing
+  long long end;       // where the line after the last row starts
+  char *query;         // last search, repeated by n and N
+};
+
+// Large files keep render and highlight only for the rows drawn, dropping
+// them again once the rows leave the screen
+struct largefile {
+  bool on;
+  int *shown; // rows rendered since the last draw
+  int nshown;
+  int cap;
+};
+
+// Bytes shown per line of the hex view
+#define HEX_WIDTH 16
+
+// A byte edited in the hex view, off is -1 in an empty slot
+struct hexbyte {
+  long long off;
+  unsigned char val;
+};
+
+struct hexview {
+  bool on;
+  int fd;
+  bool readonly;
+  unsigned char *map; // the whole file, shared so saved pages show up in it
+  long long size;
+  struct hexbyte *edits; // open addressed on off
+  int nedits;
+  unsigned mask;
+  struct hexbyte *undo; // offsets edited and the byte they had before
+  int nundo;
+  int undocap;
+  long long cur;  // byte under the cursor
+  bool low;       // on its low nibble
+  bool ascii;     // editing the text column instead of the hex one
+  bool replacing; // typed digits or text overwrite bytes
+  long long top;  // line at the top of the screen
+  char *query;
+};
+
+// A line as it was before an edit made at several cursors
+struct rowsnap {
+  int at;
+  char *line;
+  int size;
 };
 
 // For Undo and Redo
@@ -111,6 +407,92 @@ struct action {
   struct erow oldrow;
   int at;
   ActionType type;
+  struct rowsnap *rows; // EDITROWS keeps every row it touched instead
+  int nrows;
+  int span; // EDITSPAN: rows holds the lines the span rows from at replaced
+  // EDITSORT: row at + i is the one that was at + perm[i] of the span rows
+  // from at, and rows holds the ones dropped while sorted is set
+  int *perm;
+  int nperm;
+  bool sorted;
+};
+
+struct cursor {
+  int x, y;
+};
+
+// Cursors edited together, sorted by row then column. E.cx, E.cy follow the
+// main one
+struct cursors {
+  struct cursor *at;
+  int n;
+  int cap;
+  int main;
+  bool coalesce; // typing goes on into the same undo action
+  bool block;    // made for a block insert, Esc goes back to one cursor
+  int right;     // render column a block edit ends on
+};
+
+// Keys as read, for macros and for repeating the last change
+struct keylist {
+  int *k;
+  int n;
+  int cap;
+};
+
+struct input {
+  struct keylist queue; // read before the terminal, from pos on
+  int pos;
+  bool defer; // rows are rendered once the queue has been read
+  struct keylist reg[26];
+  int recording; // register keys are recorded into, -1 if none
+  int lastreg;
+  struct keylist cur;  // keys of the command being run
+  struct keylist last; // and of the last one that changed the text
+  bool change;
+};
+
+// Yanked and deleted text lives in chunks of an arena, a register being a
+// slice of one. Chunks are freed once no register holds a slice of them
+struct chunk {
+  int refs; // registers holding a slice, and the arena while it fills it
+  size_t len;
+  size_t cap;
+  char text[];
+};
+
+struct reg {
+  struct chunk *chunk; // NULL while empty
+  size_t off;
+  size_t len;
+  bool linewise; // whole rows, put below the cursor's row
+};
+
+// Bytes of text OSC 52 sends, terminals drop longer sequences
+#define OSC52_MAX (1 << 20)
+
+// A text being handed to wl-copy or xclip by a thread of its own, so a
+// large one never waits on the helper
+struct clipcopy {
+  bool running;
+  pthread_t thread;
+  struct reg text;
+  int fd; // the helper's stdin
+  pid_t pid;
+  int status;
+  const char *helper;
+};
+
+struct registers {
+  struct reg unnamed; // the text last yanked or deleted
+  struct reg yanked;  // "0
+  struct reg named[26];
+  struct reg deleted[9]; // "1 to "9, a ring where deleted[ring] is "1
+  int ring;
+  struct clipcopy clip;
+  struct chunk *fill; // text is written at its end
+  size_t start;       // of the text being written
+  int pending;        // register named with " for the next command, or 0
 };
 
 struct editor {
@@ -121,6 +503,7 @@ struct editor {
   int rows;
   int cols;
   int numrows;
+  int rowcap;
   struct erow *row;
   char *filename;
   char status[80];
@@ -136,10 +519,25 @@ struct editor {
   int sel_x;
   int sel_y;
   bool yankNewline;
+  bool block; // the visual selection is a block of columns
+  struct wrapindex wrap;
+  struct fold *folds;
+  struct marks marks;
+  struct bracketindex brackets;
+  struct swapjournal swap;
+  struct diskfile disk;
+  bool follow; // read only, appends are loaded and the cursor kept at the end
+  struct pager pager;
+  struct decoder decode;
+  struct largefile large;
+  struct hexview hex;
+  struct cursors multi;
 };
 
 struct editor E;
-char *clipboard = NULL;
+struct registers regs;
+char *searchquery = NULL;
+struct input input = {.recording = -1, .lastreg = -1};
 
 char *C_EXTENSIONS[] = {".c", ".h", ".cpp", NULL};
 char *C_KEYWORDS[] = {"switch",    "if",      "while",   "for",      "break",
@@ -147,6 +545,8 @@ char *C_KEYWORDS[] = {"switch",    "if",      "while",   "for",      "break",
                       "typedef",   "static",  "enum",    "class",    "case",
                       "int|",      "long|",   "double|", "float|",   "char|",
                       "unsigned|", "signed|", "void|",   "include|", "define|",
+                      "do",        "goto",    "default", "sizeof",   "const",
+                      "extern",    "inline",  "volatile", "short|",  "bool|",
                       NULL};
 
 char *PYTHON_EXTENSIONS[] = {".py", "ipynb", NULL};
@@ -205,47 +605,93 @@ char *HS_KEYWORDS[] = {
     "String|", "Bool|",   "True|",    "False|",  "Nothing|",  "Just|",
     "Maybe|",  "Either|", "Left|",    "Right|",  NULL};
 
+bool cparse(struct erow *row);
+
 struct syntax HLDB[] = {
     // C/C++
     {"//", "/*", "*/", "{", "}", "c", C_EXTENSIONS, C_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, cparse, NULL},
 
     // Python
     {"#", NULL, NULL, ":", NULL, "python", PYTHON_EXTENSIONS, PYTHON_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS},
+     HL_NUMBERS | HL_STRINGS, NULL, NULL},
 
     // Rust
     {"//", "/*", "*/", "{", "}", "rust", RUST_EXTENSIONS, RUST_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, NULL, NULL},
 
     // JavaScript
     {"//", "/*", "*/", "{", "}", "javascript", JS_EXTENSIONS, JS_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, NULL, NULL},
 
     // TypeScript
     {"//", "/*", "*/", "{", "}", "typescript", TS_EXTENSIONS, TS_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, NULL, NULL},
 
     // Lua
     {"--", "--[[", "]]", NULL, NULL, "lua", LUA_EXTENSIONS, LUA_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS},
+     HL_NUMBERS | HL_STRINGS, NULL, NULL},
 
     // Go
     {"//", "/*", "*/", "{", "}", "go", GO_EXTENSIONS, GO_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, NULL, NULL},
     // Haskell
     {"--", "{-", "-}", "{", "}", "Haskell", HS_EXTENSIONS, HS_KEYWORDS,
-     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS},
+     HL_NUMBERS | HL_STRINGS | HL_SEPARATORS, NULL, NULL},
 };
 
 #define HLDB_SIZE (sizeof(HLDB) / sizeof(HLDB[0]))
+
+// Every known syntax, HLDB first and then the ones loaded from syntax files,
+// and the file extensions and name patterns that select them
+struct {
+  struct syntax **all;
+  int n;
+  struct extslot {
+    const char *ext;
+    struct syntax *syntax;
+  } *ext;
+  unsigned extmask;
+  int next;
+  struct extslot *patterns; // matched anywhere in the file name
+  int npatterns;
+} langs;
 void setstatus(const char *format, ...);
 void clearscreen();
 char *editorprompt(char *prompt, void (*callback)(char *, int));
+void swaptick();
+void watchtick();
+void decodetick();
+void cliptick();
 void handlemouse(int btn, int x, int y, char type);
 bool matchingParen(char match, int x, int y, int *outx, int *outy);
-
-void kill(const char *s) {
+void wrapUpdate(int at);
+void updatebrackets(struct erow *row, int from);
+int cxtorb(struct erow *row, int cx);
+void rowrestored(struct erow *row);
+void updaterow(struct erow *row);
+long long pagerlines();
+void pagerfit();
+void processmotion(int key);
+void countedmotion(int motion, int count);
+void NormalDelete(int count, char lmao);
+void NormalYank(int count, char lmao);
+bool pagerkey(int c);
+void exreplace(int at, int n, struct rowsnap *lines, int m);
+void rowsplice(int from, int to, const char *s, int len);
+void exdelete(int from, int to);
+void markshift(int at, int d);
+void markapply(struct mark *m, int d);
+void markroot(struct mark *t);
+void changepush(int row, int col);
+void jumppush(int row, int col);
+void jumpgo(int n);
+void changego(int n);
+void incrementOrDecrement(long long delta);
+void toggleCase(int count);
+void editorquit();
+
+void die(const char *s) {
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
 
@@ -258,13 +704,13 @@ void disable_raw() {
   write(STDOUT_FILENO, "\x1b[?10001", 8);
   write(STDOUT_FILENO, "\x1b[?10061", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.og) == -1) {
-    kill("tcsetattr");
+    die("tcsetattr");
   }
 }
 
 void rawmode() {
   if (tcgetattr(STDIN_FILENO, &E.og) == -1) {
-    kill("tcgetattr");
+    die("tcgetattr");
   }
   atexit(disable_raw);
   struct termios raw = E.og;
@@ -276,7 +722,7 @@ void rawmode() {
   raw.c_cc[VMIN] = 0;
   raw.c_cc[VTIME] = 1;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-    kill("tcsetattr");
+    die("tcsetattr");
   }
 }
 
@@ -290,12 +736,82 @@ void disableMouse() {
   write(STDOUT_FILENO, "\x1b[?10061", 8);
 }
 
+// Replays are cut off past this many keys waiting, which also stops a macro
+// that runs itself
+#define QUEUE_MAX (1 << 24)
+
+void keyadd(struct keylist *k, int c) {
+  if (k->n == k->cap) {
+    k->cap = MAX(64, k->cap * 2);
+    k->k = realloc(k->k, sizeof(int) * k->cap);
+  }
+  k->k[k->n++] = c;
+}
+
+// Queues keys to be read before those already waiting, count times over
+bool queuekeys(const int *keys, int n, int count) {
+  struct input *I = &input;
+  long long total = (long long)n * count;
+  if (total + I->queue.n - I->pos > QUEUE_MAX) {
+    setstatus("Replay too long, stopped");
+    I->queue.n = I->pos = 0;
+    return false;
+  }
+  if (I->pos < total) {
+    int waiting = I->queue.n - I->pos;
+    while (I->queue.cap < total + waiting) {
+      I->queue.cap = MAX(64, I->queue.cap * 2);
+      I->queue.k = realloc(I->queue.k, sizeof(int) * I->queue.cap);
+    }
+    memmove(&I->queue.k[total], &I->queue.k[I->pos], sizeof(int) * waiting);
+    I->queue.n = total + waiting;
+    I->pos = total;
+  }
+  I->pos -= total;
+  for (int i = 0; i < count; i++)
+    memcpy(&I->queue.k[I->pos + i * n], keys, sizeof(int) * n);
+  return true;
+}
+
+// A key given back to be read again by whatever handles it next
+void unreadkey(int c) {
+  queuekeys(&c, 1, 1);
+  input.cur.n = MAX(input.cur.n - 1, 0);
+}
+
+bool replaying() { return input.pos < input.queue.n; }
+
+int termkey();
+
+// Keys come from a replay first, then the terminal. Terminal keys go into
+// the register being recorded, and all of them into the current command
 int readkey() {
+  struct input *I = &input;
+  int c;
+  if (replaying()) {
+    c = I->queue.k[I->pos++];
+  } else {
+    c = termkey();
+    if (I->recording != -1)
+      keyadd(&I->reg[I->recording], c);
+  }
+  keyadd(&I->cur, c);
+  return c;
+}
+
+int termkey() {
   int n;
   char c;
+  swaptick();
   while ((n = read(STDIN_FILENO, &c, 1)) != 1) {
     if (n == -1 && errno == EAGAIN)
-      kill("read");
+      die("read");
+    if (n == 0) {
+      swaptick();
+      watchtick();
+      decodetick();
+      cliptick();
+    }
   }
 
   if (c == '\x1b') {
@@ -415,19 +931,339 @@ int windowsize(int *rows, int *cols) {
   }
 }
 
-int isSepator(int c) {
-  return isspace(c) || c == '\0' ||
-         strchr(",.()+=/*=~%<>[];<>#-_\n\r", c) != NULL;
+// Byte classes for word motions, the highlighter and Ctrl-a, one lookup
+// per byte. Bytes of UTF-8 characters are word bytes
+#define CC_BLANK 1 // space and tab, the only bytes between W words
+#define CC_SEP 2   // bytes between w words: blanks, punctuation, NUL
+#define CC_DIGIT 4
+
+static const unsigned char CHARCLASS[256] = {
+    ['\0'] = CC_SEP,          ['\t'] = CC_BLANK | CC_SEP,
+    [' '] = CC_BLANK | CC_SEP, ['\n'] = CC_SEP,
+    ['\v'] = CC_SEP,          ['\f'] = CC_SEP,
+    ['\r'] = CC_SEP,          [','] = CC_SEP,
+    ['.'] = CC_SEP,           ['('] = CC_SEP,
+    [')'] = CC_SEP,           ['+'] = CC_SEP,
+    ['='] = CC_SEP,           ['/'] = CC_SEP,
+    ['*'] = CC_SEP,           ['~'] = CC_SEP,
+    ['%'] = CC_SEP,           ['<'] = CC_SEP,
+    ['>'] = CC_SEP,           ['['] = CC_SEP,
+    [']'] = CC_SEP,           [';'] = CC_SEP,
+    ['#'] = CC_SEP,           ['-'] = CC_SEP,
+    ['_'] = CC_SEP,           ['0'] = CC_DIGIT,
+    ['1'] = CC_DIGIT,         ['2'] = CC_DIGIT,
+    ['3'] = CC_DIGIT,         ['4'] = CC_DIGIT,
+    ['5'] = CC_DIGIT,         ['6'] = CC_DIGIT,
+    ['7'] = CC_DIGIT,         ['8'] = CC_DIGIT,
+    ['9'] = CC_DIGIT,
+};
+
+#define CHARIS(c, class) (CHARCLASS[(unsigned char)(c)] & (class))
+
+int isSepator(int c) { return CHARIS(c, CC_SEP); }
+
+int isWhitespace(int c) { return CHARIS(c, CC_BLANK); }
+
+// UTF-8
+
+// Sorted codepoint ranges rendered with zero and double width
+static const int ZERO_WIDTH[][2] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0711, 0x0711},
+    {0x0730, 0x074A},   {0x0900, 0x0902},   {0x093A, 0x093A},
+    {0x093C, 0x093C},   {0x0941, 0x0948},   {0x094D, 0x094D},
+    {0x0951, 0x0957},   {0x0962, 0x0963},   {0x0981, 0x0981},
+    {0x09BC, 0x09BC},   {0x09C1, 0x09C4},   {0x09CD, 0x09CD},
+    {0x0A01, 0x0A02},   {0x0A3C, 0x0A3C},   {0x0A41, 0x0A51},
+    {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},
+    {0x0EB1, 0x0EB1},   {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},
+    {0x1AB0, 0x1AFF},   {0x1DC0, 0x1DFF},   {0x200B, 0x200F},
+    {0x202A, 0x202E},   {0x2060, 0x2064},   {0x20D0, 0x20FF},
+    {0xFE00, 0xFE0F},   {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},
+    {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+static const int WIDE[][2] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x3FFFD},
+};
+
+bool inranges(int cp, const int (*ranges)[2], int n) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid][0])
+      hi = mid - 1;
+    else if (cp > ranges[mid][1])
+      lo = mid + 1;
+    else
+      return true;
+  }
+  return false;
+}
+
+// Widths of the BMP are looked up once and cached, stored as width + 1
+static signed char widthcache[0x10000];
+
+int cpwidth(int cp) {
+  if (cp < 0x300)
+    return 1;
+  if (cp < 0x10000 && widthcache[cp])
+    return widthcache[cp] - 1;
+  int w = 1;
+  if (inranges(cp, ZERO_WIDTH, sizeof(ZERO_WIDTH) / sizeof(ZERO_WIDTH[0])))
+    w = 0;
+  else if (inranges(cp, WIDE, sizeof(WIDE) / sizeof(WIDE[0])))
+    w = 2;
+  if (cp < 0x10000)
+    widthcache[cp] = w + 1;
+  return w;
+}
+
+bool iscont(char c) { return ((unsigned char)c & 0xC0) == 0x80; }
+
+// Decodes the sequence at s, returns its length or 0 when it is malformed
+int utf8decode(const char *s, int n, int *cp) {
+  unsigned char c = s[0];
+  int len, min;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    len = 2, min = 0x80, *cp = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    len = 3, min = 0x800, *cp = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    len = 4, min = 0x10000, *cp = c & 0x07;
+  } else {
+    return 0;
+  }
+  if (len > n)
+    return 0;
+  for (int i = 1; i < len; i++) {
+    if (!iscont(s[i]))
+      return 0;
+    *cp = (*cp << 6) | (s[i] & 0x3F);
+  }
+  if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF))
+    return 0;
+  return len;
+}
+
+int utf8encode(int cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+// First tab or non-ASCII byte in [p, end), the only bytes whose cell is not
+// exactly one column and one render byte wide
+const char *nextspecial(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(v) |
+               _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#else
+  while (end - p >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    uint64_t t = w ^ 0x0909090909090909ULL;
+    if ((((t - 0x0101010101010101ULL) & ~t) | w) & 0x8080808080808080ULL)
+      break;
+    p += 8;
+  }
+#endif
+  while (p < end && *p != '\t' && (unsigned char)*p < 0x80)
+    p++;
+  return p;
+}
+
+// Width of the cell starting a line[at], with its byte length in *len.
+// Malformed bytes are shown one column wide each
+int cellwidth(const char *line, int at, int size, int *len) {
+  int cp;
+  *len = utf8decode(&line[at], size - at, &cp);
+  if (*len == 0) {
+    *len = 1;
+    return 1;
+  }
+  return cpwidth(cp);
+}
+
+// Start of the character under line offset cx, combining marks included
+int cellstart(struct erow *row, int cx) {
+  if (cx >= row->size)
+    return row->size;
+  while (cx > 0) {
+    while (cx > 0 && iscont(row->line[cx]))
+      cx--;
+    int len;
+    if (cx == 0 || (unsigned char)row->line[cx] < 0x80 ||
+        cellwidth(row->line, cx, row->size, &len) != 0)
+      break;
+    cx--;
+  }
+  return cx;
+}
+
+int nextcell(struct erow *row, int cx) {
+  if (cx >= row->size)
+    return row->size;
+  int len;
+  cellwidth(row->line, cx, row->size, &len);
+  cx += len;
+  while (cx < row->size && (unsigned char)row->line[cx] >= 0x80 &&
+         cellwidth(row->line, cx, row->size, &len) == 0)
+    cx += len;
+  return cx;
+}
+
+int prevcell(struct erow *row, int cx) {
+  if (cx <= 0)
+    return 0;
+  return cellstart(row, cx - 1);
+}
+
+// Keyword tables
+
+unsigned strhash(const char *s, int len) {
+  unsigned h = 5381;
+  for (int i = 0; i < len; i++)
+    h = h * 33 + (unsigned char)s[i];
+  return h;
+}
+
+// KEY1, KEY2 or NORMAL for the word s
+int kwlookup(struct kwtable *t, const char *s, int len) {
+  if (len == 0 || len > 255)
+    return NORMAL;
+  for (uint32_t h = strhash(s, len) & t->mask; t->slot[h].off;
+       h = (h + 1) & t->mask) {
+    struct kwslot *k = &t->slot[h];
+    if (k->len == len && !memcmp(&t->text[k->off], s, len))
+      return k->hl;
+  }
+  return NORMAL;
+}
+
+// Compiles a NULL terminated keyword list, where a trailing | marks a KEY2.
+// The first of repeated words wins
+struct kwtable *kwcompile(char **words) {
+  int n = 0;
+  uint32_t textlen = 1;
+  for (; words && words[n]; n++)
+    textlen += strlen(words[n]) + 1;
+  struct kwtable *t = malloc(sizeof(*t));
+  if (!t)
+    die("malloc");
+  t->mask = 7;
+  while (t->mask + 1 < (uint32_t)n * 2)
+    t->mask = t->mask * 2 + 1;
+  t->slot = calloc(t->mask + 1, sizeof(struct kwslot));
+  t->text = malloc(textlen);
+  if (!t->slot || !t->text)
+    die("malloc");
+  t->text[0] = '\0'; // offset 0 is left for empty slots
+  t->textlen = 1;
+  for (int i = 0; i < n; i++) {
+    int len = strlen(words[i]);
+    bool kw2 = len && words[i][len - 1] == '|';
+    if (kw2)
+      len--;
+    if (len == 0 || len > 255 || kwlookup(t, words[i], len) != NORMAL)
+      continue;
+    uint32_t h = strhash(words[i], len) & t->mask;
+    while (t->slot[h].off)
+      h = (h + 1) & t->mask;
+    t->slot[h] = (struct kwslot){t->textlen, len, kw2 ? KEY2 : KEY1};
+    memcpy(&t->text[t->textlen], words[i], len);
+    t->text[t->textlen + len] = '\0';
+    t->textlen += len + 1;
+  }
+  return t;
 }
 
-int isWhitespace(int c) { return c == ' ' || c == '\t'; }
+// Keywords of the current syntax
+struct kwtable *keywords() {
+  if (!E.syntax->kwtable)
+    E.syntax->kwtable = kwcompile(E.syntax->keywords);
+  return E.syntax->kwtable;
+}
 
 void updateSyntax(struct erow *row) {
+  // Rows of a large file not on screen are highlighted once they are drawn
+  if (!row->render)
+    return;
   row->highlight = realloc(row->highlight, row->rsize);
   memset(row->highlight, NORMAL, row->rsize);
   if (E.syntax == NULL)
     return;
-  char **keys = E.syntax->keywords;
+  if (E.syntax->parse) {
+    if (!row->windowed) {
+      // Relex the rows below while the state they start in keeps changing
+      bool changed = E.syntax->parse(row);
+      for (int y = row->idx + 1; changed && y < E.numrows; y++) {
+        struct erow *next = &E.row[y];
+        if (!next->render)
+          break;
+        if (next->windowed) {
+          updateSyntax(next);
+          updatebrackets(next, 0);
+          break;
+        }
+        next->highlight = realloc(next->highlight, next->rsize);
+        changed = E.syntax->parse(next);
+        updatebrackets(next, 0);
+      }
+      return;
+    }
+    // Long rows only get the keyword scanner over their window
+    row->lexout = row->idx > 0 ? E.row[row->idx - 1].lexout : 0;
+  }
+  struct kwtable *keys = keywords();
 
   char *sc = E.syntax->singleCommentStart; // single Comment Start
   char *mcs = E.syntax->multicommentstart;
@@ -447,7 +1283,7 @@ void updateSyntax(struct erow *row) {
 
     if (scLen && !inString && !inComment) {
       if (!strncmp(&row->render[i], sc, scLen)) {
-        memset(&row->highlight[i], COMMENT, row->size - i);
+        memset(&row->highlight[i], COMMENT, row->rsize - i);
         break;
       }
     }
@@ -507,21 +1343,14 @@ void updateSyntax(struct erow *row) {
     }
 
     if (prevSep) {
-      int j;
-      for (j = 0; keys[j]; j++) {
-        int klen = strlen(keys[j]);
-        bool kw2 = keys[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keys[j], klen) &&
-            isSepator(row->render[i + klen])) {
-          memset(&row->highlight[i], kw2 ? KEY2 : KEY1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keys[j] != NULL) {
+      int len = 0;
+      while (i + len < row->rsize &&
+             !isSepator((unsigned char)row->render[i + len]))
+        len++;
+      int hl = kwlookup(keys, &row->render[i], len);
+      if (hl != NORMAL) {
+        memset(&row->highlight[i], hl, len);
+        i += len;
         prevSep = 0;
         continue;
       }
@@ -539,10 +1368,310 @@ void updateSyntax(struct erow *row) {
     prevSep = isSepator(c);
     i++;
   }
+  // A long row's window may end before the line does
+  if (row->windowed && row->lend < row->size)
+    inComment = row->openComment;
   bool diff = (row->openComment != inComment);
   row->openComment = inComment;
-  if (diff && row->idx + 1 < E.numrows)
+  if (diff && row->idx + 1 < E.numrows) {
     updateSyntax(&E.row[row->idx + 1]);
+    updatebrackets(&E.row[row->idx + 1], 0);
+  }
+}
+
+// C parser
+// Rows are lexed into tokens, starting from the state the previous row ended
+// in. An edit re-lexes its row, and the rows below only while the state at
+// their start keeps changing. Tokens also drive w/b and repaint cheaply when
+// the set of typedef names changes
+
+#define LEX_COMMENT 1     // inside /* */
+#define LEX_STRING 2      // string continued by a trailing backslash
+#define LEX_LINECOMMENT 4 // // comment continued by a trailing backslash
+#define LEX_TYPEDEF 8     // typedef brace depth + 1 is kept from this bit up
+
+// Typedef names with the number of rows defining them
+struct typename {
+  char *name;
+  int refs;
+  struct typename *next;
+};
+
+static struct {
+  struct typename *bucket[256];
+  int gen; // bumped whenever a name comes or goes
+} typenames;
+
+unsigned typehash(const char *s, int len) { return strhash(s, len) & 255; }
+
+struct typename *typefind(const char *s, int len) {
+  struct typename *t = typenames.bucket[typehash(s, len)];
+  for (; t; t = t->next)
+    if ((int)strlen(t->name) == len && !strncmp(t->name, s, len))
+      return t;
+  return NULL;
+}
+
+void typeref(const char *name, int delta) {
+  int len = strlen(name);
+  struct typename *t = typefind(name, len);
+  if (!t) {
+    if (delta < 0)
+      return;
+    t = malloc(sizeof(struct typename));
+    if (!t)
+      die("malloc");
+    t->name = strdup(name);
+    t->refs = 0;
+    t->next = typenames.bucket[typehash(name, len)];
+    typenames.bucket[typehash(name, len)] = t;
+  }
+  if (t->refs == 0 || t->refs + delta == 0)
+    typenames.gen++;
+  t->refs += delta;
+}
+
+// Drops the typedef names a row defined
+void rowtypedefs(struct erow *row, char **names, int n) {
+  for (int i = 0; i < row->ntdefs; i++) {
+    typeref(row->tdefs[i], -1);
+    free(row->tdefs[i]);
+  }
+  free(row->tdefs);
+  row->tdefs = names;
+  row->ntdefs = n;
+  for (int i = 0; i < n; i++)
+    typeref(names[i], 1);
+}
+
+void addtoken(struct erow *row, int start, int len, int hl, bool ident) {
+  if (row->ntok == row->tokcap) {
+    row->tokcap = row->tokcap ? row->tokcap * 2 : 16;
+    row->tok = realloc(row->tok, sizeof(struct token) * row->tokcap);
+    if (!row->tok)
+      die("realloc");
+  }
+  struct token *t = &row->tok[row->ntok++];
+  t->start = start;
+  t->len = len;
+  t->hl = hl;
+  t->ident = ident;
+}
+
+// Splits comments and strings into words so that w and b stop inside them
+void addwords(struct erow *row, int from, int to, int hl) {
+  int i = from;
+  while (i < to) {
+    if (isspace((unsigned char)row->line[i])) {
+      i++;
+      continue;
+    }
+    int start = i;
+    bool sep = isSepator(row->line[i]);
+    while (i < to && !isspace((unsigned char)row->line[i]) &&
+           (bool)isSepator(row->line[i]) == sep)
+      i++;
+    addtoken(row, start, i - start, hl, false);
+  }
+}
+
+bool isword(const char *s, int len, const char *word) {
+  return (int)strlen(word) == len && !strncmp(s, word, len);
+}
+
+// KEY1, KEY2 or NORMAL for an identifier
+int keywordclass(const char *s, int len) {
+  return kwlookup(keywords(), s, len);
+}
+
+// Fills the highlight of a row from its tokens
+void paintrow(struct erow *row) {
+  memset(row->highlight, NORMAL, row->rsize);
+  for (int i = 0; i < row->ntok; i++) {
+    struct token *t = &row->tok[i];
+    int hl = t->hl;
+    if (t->ident && hl == NORMAL) {
+      struct typename *name = typefind(&row->line[t->start], t->len);
+      if (name && name->refs > 0)
+        hl = TYPE;
+    }
+    if (hl == NORMAL)
+      continue;
+    int from = cxtorb(row, t->start);
+    memset(&row->highlight[from], hl, cxtorb(row, t->start + t->len) - from);
+  }
+  row->typegen = typenames.gen;
+}
+
+// Operators longest first, anything else is a one character token
+static const char *OPERATORS[] = {
+    "<<=", ">>=", "...", "->", "++", "--", "<<", ">>", "<=", ">=", "==",
+    "!=",  "&&",  "||",  "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+    "##",  NULL};
+
+bool cparse(struct erow *row) {
+  // A row above that was never lexed has the -1 of rowinit
+  int state = row->idx > 0 ? MAX(E.row[row->idx - 1].lexout, 0) : 0;
+  int tdepth = state / LEX_TYPEDEF;
+  char *s = row->line;
+  int n = row->size;
+  int i = 0;
+  row->ntok = 0;
+
+  // Typedef names completed on this row
+  char **names = NULL;
+  int nnames = 0;
+  int cand = -1;        // token of the name the typedef currently ends with
+  bool pointer = false; // saw "(*", the name comes next
+  bool named = false;   // the name after "(*" is taken
+  bool tagnext = false; // previous token was struct, union or enum
+  bool include = false; // <file> after #include is a string
+
+  if (state & (LEX_COMMENT | LEX_LINECOMMENT)) {
+    bool block = state & LEX_COMMENT;
+    char *end = block ? strstr(s, "*/") : NULL;
+    int to = end ? end - s + 2 : n;
+    addwords(row, 0, to, block ? MULTICOMMENT : COMMENT);
+    i = to;
+    state &= ~(LEX_COMMENT | LEX_LINECOMMENT);
+    if (!end && block)
+      state |= LEX_COMMENT;
+    else if (!block && n > 0 && s[n - 1] == '\\')
+      state |= LEX_LINECOMMENT;
+  } else if (state & LEX_STRING) {
+    int j = 0;
+    while (j < n && s[j] != '"')
+      j += (s[j] == '\\') ? 2 : 1;
+    int to = MIN(j + 1, n);
+    addwords(row, 0, to, STRING);
+    i = to;
+    state &= ~LEX_STRING;
+    if (j >= n && n > 0 && s[n - 1] == '\\')
+      state |= LEX_STRING;
+  }
+
+  while (i < n) {
+    char c = s[i];
+    int start = i;
+    if (isspace((unsigned char)c)) {
+      i++;
+      continue;
+    }
+    if (c == '/' && i + 1 < n && s[i + 1] == '/') {
+      addwords(row, i, n, COMMENT);
+      if (s[n - 1] == '\\')
+        state |= LEX_LINECOMMENT;
+      break;
+    }
+    if (c == '/' && i + 1 < n && s[i + 1] == '*') {
+      char *end = strstr(&s[i + 2], "*/");
+      int to = end ? end - s + 2 : n;
+      addwords(row, i, to, MULTICOMMENT);
+      if (!end)
+        state |= LEX_COMMENT;
+      i = to;
+      continue;
+    }
+    if (c == '"' || c == '\'' || (include && c == '<')) {
+      char close = (c == '<') ? '>' : c;
+      i++;
+      while (i < n && s[i] != close)
+        i += (s[i] == '\\') ? 2 : 1;
+      if (i >= n && c == '"' && s[n - 1] == '\\')
+        state |= LEX_STRING;
+      i = MIN(i + 1, n);
+      addwords(row, start, i, STRING);
+      continue;
+    }
+    if (c == '#' && row->ntok == 0) {
+      i++;
+      while (i < n && isWhitespace(s[i]))
+        i++;
+      while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_'))
+        i++;
+      addtoken(row, start, i - start, KEY2, false);
+      include = strstr(s, "include") != NULL || strstr(s, "import") != NULL;
+      continue;
+    }
+    if (isdigit((unsigned char)c) ||
+        (c == '.' && i + 1 < n && isdigit((unsigned char)s[i + 1]))) {
+      while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '.' ||
+                       s[i] == '_' ||
+                       ((s[i] == '+' || s[i] == '-') &&
+                        strchr("eEpP", s[i - 1]))))
+        i++;
+      addtoken(row, start, i - start, NUMBER, false);
+      continue;
+    }
+    if (isalpha((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80) {
+      while (i < n && (isalnum((unsigned char)s[i]) || s[i] == '_' ||
+                       (unsigned char)s[i] >= 0x80))
+        i++;
+      int len = i - start;
+      int hl = keywordclass(&s[start], len);
+      if (tagnext && hl == NORMAL)
+        hl = TYPE;
+      tagnext = isword(&s[start], len, "struct") ||
+                isword(&s[start], len, "union") ||
+                isword(&s[start], len, "enum");
+      if (isword(&s[start], len, "typedef") && tdepth == 0) {
+        tdepth = 1;
+        cand = -1;
+        pointer = named = false;
+      } else if (hl != KEY1 && hl != KEY2 && tdepth == 1 && !named) {
+        cand = row->ntok;
+        named = pointer;
+      }
+      addtoken(row, start, len, hl, hl == NORMAL);
+      continue;
+    }
+
+    int len = 1;
+    for (int j = 0; OPERATORS[j]; j++) {
+      int olen = strlen(OPERATORS[j]);
+      if (!strncmp(&s[i], OPERATORS[j], olen)) {
+        len = olen;
+        break;
+      }
+    }
+    i += len;
+    tagnext = false;
+    if (tdepth > 0 && c == '{')
+      tdepth++;
+    else if (tdepth > 1 && c == '}')
+      tdepth--;
+    else if (tdepth == 1 && c == '*' && row->ntok > 0 &&
+             s[row->tok[row->ntok - 1].start] == '(')
+      pointer = true;
+    else if (tdepth == 1 && (c == ';' || c == ',') && cand >= 0) {
+      struct token *t = &row->tok[cand];
+      names = realloc(names, sizeof(char *) * (nnames + 1));
+      names[nnames++] = strndup(&s[t->start], t->len);
+      t->hl = TYPE;
+      cand = -1;
+      pointer = named = false;
+      if (c == ';')
+        tdepth = 0;
+    }
+    addtoken(row, start, len, isSepator(c) ? SEPARATOR : NORMAL, false);
+  }
+
+  // Identifiers called like functions
+  for (int t = 0; t + 1 < row->ntok; t++) {
+    struct token *tk = &row->tok[t];
+    if (tk->ident && tk->hl == NORMAL && row->tok[t + 1].len == 1 &&
+        s[row->tok[t + 1].start] == '(')
+      tk->hl = FUNCTION;
+  }
+
+  rowtypedefs(row, names, nnames);
+  paintrow(row);
+
+  state = (state & (LEX_TYPEDEF - 1)) | MIN(tdepth, 255) * LEX_TYPEDEF;
+  row->openComment = state & LEX_COMMENT;
+  bool diff = row->lexout != state;
+  row->lexout = state;
+  return diff;
 }
 
 int syntocolour(int hl) {
@@ -562,72 +1691,227 @@ int syntocolour(int hl) {
     return 94;
   case KEY2:
     return 35;
+  case TYPE:
+    return 33;
+  case FUNCTION:
+    return 96;
   default:
     return 37;
   }
 }
 
+// Slot of ext in the extension map, or the empty one it would go in
+struct extslot *extslot(const char *ext) {
+  unsigned h = strhash(ext, strlen(ext)) & langs.extmask;
+  while (langs.ext[h].ext && strcmp(langs.ext[h].ext, ext))
+    h = (h + 1) & langs.extmask;
+  return &langs.ext[h];
+}
+
+// Registers a syntax, its extensions take over from earlier ones
+void addsyntax(struct syntax *s) {
+  langs.all = realloc(langs.all, sizeof(*langs.all) * (langs.n + 1));
+  if (!langs.all)
+    die("realloc");
+  langs.all[langs.n++] = s;
+  for (int i = 0; s->fmatch && s->fmatch[i]; i++) {
+    const char *m = s->fmatch[i];
+    if (m[0] != '.') {
+      langs.patterns = realloc(langs.patterns, sizeof(*langs.patterns) *
+                                                   (langs.npatterns + 1));
+      if (!langs.patterns)
+        die("realloc");
+      langs.patterns[langs.npatterns++] = (struct extslot){m, s};
+      continue;
+    }
+    if ((langs.next + 1) * 2 > (int)langs.extmask + 1) {
+      struct extslot *old = langs.ext;
+      unsigned oldmask = langs.extmask;
+      langs.extmask = old ? oldmask * 2 + 1 : 15;
+      langs.ext = calloc(langs.extmask + 1, sizeof(*langs.ext));
+      if (!langs.ext)
+        die("calloc");
+      for (unsigned j = 0; old && j <= oldmask; j++)
+        if (old[j].ext)
+          *extslot(old[j].ext) = old[j];
+      free(old);
+    }
+    struct extslot *e = extslot(m);
+    if (!e->ext)
+      langs.next++;
+    *e = (struct extslot){m, s};
+  }
+}
+
 void selectHL() {
   E.syntax = NULL;
   if (E.filename == NULL)
     return;
+  if (!langs.n)
+    for (int j = 0; (unsigned long int)j < HLDB_SIZE; j++)
+      addsyntax(&HLDB[j]);
 
   char *ex = strrchr(E.filename, '.');
-  for (int j = 0; (unsigned long int)j < (HLDB_SIZE); j++) {
-    struct syntax *s = &HLDB[j];
-    int i = 0;
-    if (!s->fmatch)
-      continue;
-    while (s->fmatch[i]) {
-      bool verified = (s->fmatch[i][0] == '.');
-      if ((verified && ex && !strcmp(ex, s->fmatch[i])) ||
-          (!verified && strstr(E.filename, s->fmatch[i]))) {
-        E.syntax = s;
-        for (int row = 0; row < E.numrows; row++)
-          updateSyntax(&E.row[row]);
-        return;
-      }
-      i++;
-    }
+  if (ex && langs.ext && extslot(ex)->ext)
+    E.syntax = extslot(ex)->syntax;
+  for (int j = langs.npatterns - 1; !E.syntax && j >= 0; j--)
+    if (strstr(E.filename, langs.patterns[j].ext))
+      E.syntax = langs.patterns[j].syntax;
+  if (!E.syntax)
+    return;
+  for (int row = 0; row < E.numrows; row++) {
+    updateSyntax(&E.row[row]);
+    updatebrackets(&E.row[row], 0);
   }
 }
 
-void pushUndo(ActionType type, int rowidx, int col) {
-  E.redotop = 0;
-  if (rowidx < 0 || rowidx >= E.numrows)
-    return;
+void actionfree(struct action *a) {
+  free(a->oldrow.line);
+  free(a->oldrow.render);
+  free(a->oldrow.highlight);
+  for (int i = 0; i < a->nrows; i++)
+    free(a->rows[i].line);
+  free(a->rows);
+  free(a->perm);
+}
 
-  bool coalesce = coalesce_state.active && coalesce_state.type == type &&
-                  coalesce_state.row == rowidx &&
-                  ((type == EDITINSERT && col == coalesce_state.lastcol + 1) ||
-                   (type == EDITDELETE && col == coalesce_state.lastcol - 1));
+// Drops every undo and redo step, for when the rows they name are gone
+void historyfree() {
+  while (E.undotop)
+    actionfree(&E.UndoStack[--E.undotop]);
+  while (E.redotop)
+    actionfree(&E.RedoStack[--E.redotop]);
+  coalesce_state.active = false;
+}
 
-  if (coalesce) {
-    coalesce_state.lastcol = col;
-    return;
+void mcclamp();
+void mcclear();
+
+void stackpush(struct action *stack, int *top, struct action a) {
+  if (*top == UNDO_STACK_SIZE) {
+    actionfree(&stack[0]);
+    memmove(&stack[0], &stack[1], sizeof(struct action) * (*top - 1));
+    (*top)--;
   }
+  stack[(*top)++] = a;
+}
 
-  struct erow *src = &E.row[rowidx];
-  struct action edit;
-  edit.at = rowidx;
+// Saves an action that changed more than one row, as a new undo step
+void pushrows(struct action a) {
+  while (E.redotop)
+    actionfree(&E.RedoStack[--E.redotop]);
+  changepush(a.type == EDITROWS && a.nrows ? a.rows[0].at : a.at, 0);
+  stackpush(E.UndoStack, &E.undotop, a);
+  coalesce_state.active = false;
+}
+
+void rowsreplace(int at, int n, struct rowsnap *lines, int m,
+                 struct rowsnap *out);
+void rowspermute(int at, int n, int *perm, int m, struct rowsnap *dropped);
+void rowsunpermute(int at, int n, int *perm, int m, struct rowsnap *dropped);
+
+// Swaps the rows of the EDITROWS or EDITSPAN action on top of one stack with
+// the lines they hold now, so the same action undoes what it redid, and
+// moves it onto the other stack
+void applyrows(struct action *from, int *fromtop, struct action *stack,
+               int *top) {
+  struct action a = from[--*fromtop];
+  if (a.type == EDITSORT) {
+    if (a.sorted) {
+      rowsunpermute(a.at, a.span, a.perm, a.nperm, a.rows);
+      free(a.rows);
+      a.rows = NULL;
+      a.nrows = 0;
+    } else {
+      a.nrows = a.span - a.nperm;
+      a.rows = malloc(sizeof(struct rowsnap) * MAX(a.nrows, 1));
+      rowspermute(a.at, a.span, a.perm, a.nperm, a.rows);
+    }
+    a.sorted = !a.sorted;
+    stackpush(stack, top, a);
+    E.cy = MIN(a.at, E.numrows - 1);
+    E.cx = 0;
+    mcclear();
+    coalesce_state.active = false;
+    return;
+  }
+  if (a.type == EDITSPAN) {
+    struct rowsnap *out = malloc(sizeof(struct rowsnap) * MAX(a.span, 1));
+    rowsreplace(a.at, a.span, a.rows, a.nrows, out);
+    free(a.rows);
+    a.rows = out;
+    int n = a.nrows;
+    a.nrows = a.span;
+    a.span = n;
+    stackpush(stack, top, a);
+    E.cy = MIN(a.at, E.numrows - 1);
+    E.cx = 0;
+    mcclear();
+    coalesce_state.active = false;
+    return;
+  }
+  for (int i = 0; i < a.nrows; i++) {
+    struct rowsnap *r = &a.rows[i];
+    if (r->at >= E.numrows)
+      continue;
+    struct erow *row = &E.row[r->at];
+    char *line = row->line;
+    int size = row->size;
+    row->line = r->line;
+    row->size = r->size;
+    row->editfrom = 0;
+    updaterow(row);
+    r->line = line;
+    r->size = size;
+  }
+  stackpush(stack, top, a);
+  if (a.nrows && a.rows[0].at < E.numrows)
+    E.cy = a.rows[0].at;
+  mcclamp();
+  E.dirty = true;
+  coalesce_state.active = false;
+}
+
+void pushUndo(ActionType type, int rowidx, int col) {
+  while (E.redotop)
+    actionfree(&E.RedoStack[--E.redotop]);
+  if (rowidx < 0 || rowidx >= E.numrows)
+    return;
+  changepush(rowidx, col);
+
+  bool coalesce = coalesce_state.active && coalesce_state.type == type &&
+                  coalesce_state.row == rowidx &&
+                  ((type == EDITINSERT && col == coalesce_state.lastcol + 1) ||
+                   (type == EDITDELETE && col == coalesce_state.lastcol - 1));
+
+  if (coalesce) {
+    coalesce_state.lastcol = col;
+    return;
+  }
+
+  struct erow *src = &E.row[rowidx];
+  struct action edit;
+  edit.at = rowidx;
   edit.type = type;
+  edit.rows = NULL;
+  edit.nrows = 0;
+  edit.perm = NULL;
   edit.oldrow.size = src->size;
   edit.oldrow.rsize = src->rsize;
   edit.oldrow.openComment = src->openComment;
   edit.oldrow.line = strdup(src->line);
   edit.oldrow.idx = src->idx;
-  edit.oldrow.render = strdup(src->render);
-  edit.oldrow.highlight = malloc(sizeof(unsigned char) * src->size);
+  edit.oldrow.render = src->render ? strdup(src->render) : NULL;
+  edit.oldrow.highlight =
+      src->highlight ? malloc(sizeof(unsigned char) * src->rsize) : NULL;
   if (edit.oldrow.highlight)
     memcpy(edit.oldrow.highlight, src->highlight,
-           sizeof(unsigned char) * src->size);
+           sizeof(unsigned char) * src->rsize);
   else
     edit.oldrow.highlight = NULL;
 
   if (E.undotop == UNDO_STACK_SIZE - 1) {
-    free(E.UndoStack[0].oldrow.line);
-    free(E.UndoStack[0].oldrow.render);
-    free(E.UndoStack[0].oldrow.highlight);
+    actionfree(&E.UndoStack[0]);
     memmove(&E.UndoStack[0], &E.UndoStack[1],
             sizeof(struct action) * (UNDO_STACK_SIZE - 1));
     E.undotop--;
@@ -644,6 +1928,10 @@ void pushUndo(ActionType type, int rowidx, int col) {
 void applyUndo() {
   if (E.undotop == 0)
     return;
+  if (E.UndoStack[E.undotop - 1].type >= EDITROWS) {
+    applyrows(E.UndoStack, &E.undotop, E.RedoStack, &E.redotop);
+    return;
+  }
 
   struct action *edit = &E.UndoStack[--E.undotop];
   int row = edit->at;
@@ -655,21 +1943,23 @@ void applyUndo() {
   struct action redo;
   redo.at = row;
   redo.type = edit->type;
+  redo.rows = NULL;
+  redo.nrows = 0;
+  redo.perm = NULL;
   redo.oldrow.size = cur->size;
   redo.oldrow.rsize = cur->rsize;
   redo.oldrow.idx = cur->idx;
   redo.oldrow.openComment = cur->openComment;
   redo.oldrow.line = strdup(cur->line);
-  redo.oldrow.render = strdup(cur->render);
-  redo.oldrow.highlight = malloc(sizeof(unsigned char) * cur->size);
+  redo.oldrow.render = cur->render ? strdup(cur->render) : NULL;
+  redo.oldrow.highlight =
+      cur->highlight ? malloc(sizeof(unsigned char) * cur->rsize) : NULL;
   if (redo.oldrow.highlight)
     memcpy(redo.oldrow.highlight, cur->highlight,
-           sizeof(unsigned char) * cur->size);
+           sizeof(unsigned char) * cur->rsize);
 
   if (E.redotop == UNDO_STACK_SIZE) {
-    free(E.RedoStack[0].oldrow.line);
-    free(E.RedoStack[0].oldrow.render);
-    free(E.RedoStack[0].oldrow.highlight);
+    actionfree(&E.RedoStack[0]);
     memmove(&E.RedoStack[0], &E.RedoStack[1],
             sizeof(struct action) * UNDO_STACK_SIZE - 1);
     E.redotop--;
@@ -687,15 +1977,16 @@ void applyUndo() {
   cur->openComment = edit->oldrow.openComment;
 
   cur->line = strdup(edit->oldrow.line);
-  cur->render = strdup(edit->oldrow.render);
+  cur->render = edit->oldrow.render ? strdup(edit->oldrow.render) : NULL;
 
-  if (edit->oldrow.highlight && cur->size > 0) {
-    cur->highlight = malloc(sizeof(unsigned char) * cur->size);
+  if (edit->oldrow.highlight && cur->rsize > 0) {
+    cur->highlight = malloc(sizeof(unsigned char) * cur->rsize);
     memcpy(cur->highlight, edit->oldrow.highlight,
-           sizeof(unsigned char) * cur->size);
+           sizeof(unsigned char) * cur->rsize);
   } else
     cur->highlight = NULL;
 
+  rowrestored(cur);
   E.cy = row;
   if (E.cx > cur->size)
     E.cx = cur->size;
@@ -711,6 +2002,10 @@ void applyUndo() {
 void applyRedo() {
   if (E.redotop == 0)
     return;
+  if (E.RedoStack[E.redotop - 1].type >= EDITROWS) {
+    applyrows(E.RedoStack, &E.redotop, E.UndoStack, &E.undotop);
+    return;
+  }
 
   struct action *act = &E.RedoStack[--E.redotop];
   int row = act->at;
@@ -722,21 +2017,23 @@ void applyRedo() {
   struct action undo;
   undo.at = row;
   undo.type = act->type;
+  undo.rows = NULL;
+  undo.nrows = 0;
+  undo.perm = NULL;
   undo.oldrow.size = dst->size;
   undo.oldrow.rsize = dst->rsize;
   undo.oldrow.idx = dst->idx;
   undo.oldrow.openComment = dst->openComment;
   undo.oldrow.line = strdup(dst->line);
-  undo.oldrow.render = strdup(dst->render);
-  undo.oldrow.highlight = malloc(sizeof(unsigned char) * dst->size);
+  undo.oldrow.render = dst->render ? strdup(dst->render) : NULL;
+  undo.oldrow.highlight =
+      dst->highlight ? malloc(sizeof(unsigned char) * dst->rsize) : NULL;
   if (undo.oldrow.highlight)
     memcpy(undo.oldrow.highlight, dst->highlight,
-           sizeof(unsigned char) * dst->size);
+           sizeof(unsigned char) * dst->rsize);
 
   if (E.undotop == UNDO_STACK_SIZE) {
-    free(E.UndoStack[0].oldrow.line);
-    free(E.UndoStack[0].oldrow.render);
-    free(E.UndoStack[0].oldrow.highlight);
+    actionfree(&E.UndoStack[0]);
     memmove(&E.UndoStack[0], &E.UndoStack[1],
             sizeof(struct action) * (UNDO_STACK_SIZE - 1));
     E.undotop--;
@@ -753,12 +2050,15 @@ void applyRedo() {
   dst->idx = act->oldrow.idx;
   dst->openComment = act->oldrow.openComment;
   dst->line = strdup(act->oldrow.line);
-  dst->render = strdup(act->oldrow.render);
-  dst->highlight = malloc(sizeof(unsigned char) * dst->size);
+  dst->render = act->oldrow.render ? strdup(act->oldrow.render) : NULL;
+  dst->highlight = act->oldrow.highlight
+                       ? malloc(sizeof(unsigned char) * dst->rsize)
+                       : NULL;
   if (dst->highlight)
     memcpy(dst->highlight, act->oldrow.highlight,
-           sizeof(unsigned char) * dst->size);
+           sizeof(unsigned char) * dst->rsize);
 
+  rowrestored(dst);
   E.cy = row;
   if (E.cx > dst->size)
     E.cx = dst->size;
@@ -771,224 +2071,1543 @@ void applyRedo() {
   free(act->oldrow.highlight);
 }
 
-int cxtorx(struct erow *row, int cx) {
-  int rx = 0;
-  for (int i = 0; i < cx; i++) {
-    if (row->line[i] == '\t')
-      rx += (TAB_LENGTH - 1) - (rx % TAB_LENGTH);
-    rx++;
+// Last irregular cell starting before line offset cx, -1 if there is none
+int colbefore(struct erow *row, int cx) {
+  int lo = 0, hi = row->ncols;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->colcx[mid] < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  return rx;
+  return lo - 1;
+}
+
+int cxtorx(struct erow *row, int cx) {
+  int i = colbefore(row, cx);
+  if (i < 0)
+    return cx;
+  return row->colrx[i] + (cx - row->colcx[i] - 1);
+}
+
+// Offset of line offset cx in a full render of the row
+int cxtorb(struct erow *row, int cx) {
+  int i = colbefore(row, cx);
+  if (i < 0)
+    return cx;
+  return row->colrb[i] + (cx - row->colcx[i] - 1);
 }
 
 int rxtocx(struct erow *row, int rx) {
-  int cx = 0, cur = 0;
-  for (; cx < row->size; cx++) {
-    if (row->line[cx] == '\t')
-      cur += (TAB_LENGTH - 1) - (cur % TAB_LENGTH);
-    cur++;
-    if (cur > rx)
-      return cx;
+  // First irregular cell that ends past rx
+  int lo = 0, hi = row->ncols;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->colrx[mid] <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  return cx;
+  // Cells between the previous irregular one and this are one column wide
+  int cx = (lo > 0) ? row->colcx[lo - 1] + 1 : 0;
+  int cur = (lo > 0) ? row->colrx[lo - 1] : 0;
+  cx += rx - cur;
+  if (lo < row->ncols && cx >= row->colcx[lo])
+    return row->colcx[lo];
+  return MIN(cx, row->size);
 }
 
-void updaterow(struct erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->line[j] == '\t')
-      tabs++;
-
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TAB_LENGTH - 1) + 1);
+void addcol(struct erow *row, int cx, int rx, int rb) {
+  if (row->ncols == row->colcap) {
+    row->colcap = row->colcap ? row->colcap * 2 : 8;
+    row->colcx = realloc(row->colcx, sizeof(int) * row->colcap);
+    row->colrx = realloc(row->colrx, sizeof(int) * row->colcap);
+    row->colrb = realloc(row->colrb, sizeof(int) * row->colcap);
+    if (!row->colcx || !row->colrx || !row->colrb)
+      die("realloc");
+  }
+  row->colcx[row->ncols] = cx;
+  row->colrx[row->ncols] = rx;
+  row->colrb[row->ncols] = rb;
+  row->ncols++;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->line[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % TAB_LENGTH != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->line[j];
+// Rebuilds the cell index from line offset `from`, keeping the cells before
+// it, and recomputes the row's width
+void updatecols(struct erow *row, int from) {
+  from = MIN(from, row->size);
+  while (from > 0 && iscont(row->line[from]))
+    from--;
+  row->ncols = colbefore(row, from) + 1;
+  int rx = cxtorx(row, from);
+  int rb = cxtorb(row, from);
+  const char *p = row->line + from;
+  const char *end = row->line + row->size;
+  while (p < end) {
+    // Plain ASCII runs are skipped without looking at every byte
+    const char *q = nextspecial(p, end);
+    rx += q - p;
+    rb += q - p;
+    if (q == end)
+      break;
+    int at = q - row->line;
+    if (*q == '\t') {
+      int w = TAB_LENGTH - rx % TAB_LENGTH;
+      rx += w;
+      rb += w;
+      addcol(row, at, rx, rb);
+      p = q + 1;
+      continue;
     }
+    int len;
+    int w = cellwidth(row->line, at, row->size, &len);
+    rx += w;
+    rb++;
+    if (w != 1)
+      addcol(row, at, rx, rb);
+    for (int i = 1; i < len; i++)
+      addcol(row, at + i, rx, ++rb);
+    p = q + len;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  updateSyntax(row);
+  row->width = rx;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+// Folds
+
+void foldapply(struct fold *f, int d) {
+  if (!f)
     return;
-  struct erow *new = realloc(E.row, sizeof(struct erow) * (E.numrows + 1));
-  if (!new)
-    kill("realloc");
-  E.row = new;
-  memmove(&E.row[at + 1], &E.row[at], sizeof(struct erow) * (E.numrows - at));
-  for (int i = at + 1; i <= E.numrows; i++)
-    E.row[i].idx++;
+  f->lo += d;
+  f->hi += d;
+  f->shift += d;
+  if (f->maxc >= 0)
+    f->maxc += d;
+  if (f->maxo >= 0)
+    f->maxo += d;
+}
 
-  E.row[at].idx = at;
+void foldpush(struct fold *f) {
+  if (f->shift) {
+    foldapply(f->l, f->shift);
+    foldapply(f->r, f->shift);
+    f->shift = 0;
+  }
+}
 
-  E.row[at].size = len;
-  E.row[at].line = malloc(len + 1);
-  memcpy(E.row[at].line, s, len);
-  E.row[at].line[len] = '\0';
+void foldpull(struct fold *f) {
+  f->maxc = f->closed ? f->hi : -1;
+  f->maxo = f->closed ? -1 : f->hi;
+  struct fold *kids[2] = {f->l, f->r};
+  for (int i = 0; i < 2; i++) {
+    if (!kids[i])
+      continue;
+    f->maxc = MAX(f->maxc, kids[i]->maxc);
+    f->maxo = MAX(f->maxo, kids[i]->maxo);
+  }
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].highlight = NULL;
-  E.row[at].openComment = false;
-  updaterow(&E.row[at]);
-  E.numrows++;
-  E.dirty = true;
+// Splits t into the folds ordered before (lo, hi) and the rest, so a hi of
+// INT_MAX splits off every fold starting above row lo
+void foldsplit(struct fold *t, int lo, int hi, struct fold **a,
+               struct fold **b) {
+  if (!t) {
+    *a = *b = NULL;
+    return;
+  }
+  foldpush(t);
+  if (t->lo < lo || (t->lo == lo && t->hi > hi)) {
+    foldsplit(t->r, lo, hi, &t->r, b);
+    *a = t;
+  } else {
+    foldsplit(t->l, lo, hi, a, &t->l);
+    *b = t;
+  }
+  foldpull(t);
 }
 
-void editorFreeRow(struct erow *row) {
-  free(row->render);
-  free(row->line);
-  free(row->highlight);
+struct fold *foldmerge(struct fold *a, struct fold *b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (a->prio > b->prio) {
+    foldpush(a);
+    a->r = foldmerge(a->r, b);
+    foldpull(a);
+    return a;
+  }
+  foldpush(b);
+  b->l = foldmerge(a, b->l);
+  foldpull(b);
+  return b;
 }
 
-void editorDelRow(int at) {
-  pushUndo(EDITDELETE, at, 0);
-  if (at < 0 || at >= E.numrows)
+void foldinsert(struct fold *f) {
+  struct fold *a, *b;
+  foldsplit(E.folds, f->lo, f->hi, &a, &b);
+  E.folds = foldmerge(foldmerge(a, f), b);
+}
+
+// Moves the end of every fold in t that reaches row at
+void foldgrow(struct fold *t, int at, int d) {
+  if (!t || MAX(t->maxc, t->maxo) < at)
     return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1],
-          sizeof(struct erow) * (E.numrows - at - 1));
-  for (int i = at; i < E.numrows - 1; i++)
-    E.row[i].idx--;
-  E.numrows--;
-  E.dirty = true;
+  foldpush(t);
+  if (t->hi >= at)
+    t->hi += d;
+  foldgrow(t->l, at, d);
+  foldgrow(t->r, at, d);
+  foldpull(t);
 }
 
-void rowinsertchar(struct erow *row, int at, int c) {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->line = realloc(row->line, row->size + 2);
-  memmove(&row->line[at + 1], &row->line[at], row->size - at + 1);
-  row->size++;
-  row->line[at] = c;
-  updaterow(row);
-  E.dirty = true;
-  if (!coalesce_state.active)
-    pushUndo(EDITINSERT, E.cy, E.cx);
+// Puts back the folds of t one by one, dropping those left without rows
+void foldreinsert(struct fold *t) {
+  if (!t)
+    return;
+  foldpush(t);
+  struct fold *l = t->l, *r = t->r;
+  t->l = t->r = NULL;
+  foldreinsert(l);
+  foldreinsert(r);
+  if (t->hi > t->lo) {
+    foldpull(t);
+    foldinsert(t);
+  } else
+    free(t);
 }
 
-void rowdeletechar(struct erow *row, int at) {
-  if (at < 0 || at >= row->size)
+// Puts back the folds of t that still lie within the rows, freeing the rest
+void foldclip(struct fold *t) {
+  if (!t)
     return;
-  memmove(&row->line[at], &row->line[at + 1], row->size - at);
-  row->size--;
-  updaterow(row);
-  E.dirty = true;
-  if (!coalesce_state.active) {
-    if (E.cx > 0)
-      pushUndo(EDITDELETE, E.cy, E.cx - 1);
+  foldpush(t);
+  struct fold *l = t->l, *r = t->r;
+  t->l = t->r = NULL;
+  foldclip(l);
+  foldclip(r);
+  if (t->lo >= 0 && t->hi < E.numrows && t->hi > t->lo) {
+    foldpull(t);
+    foldinsert(t);
+  } else
+    free(t);
+}
+
+// Keeps folds on the same rows after a row is inserted (d = 1) or deleted
+// (d = -1) at row at
+void foldshift(int at, int d) {
+  if (!E.folds)
+    return;
+  struct fold *a, *b, *m, *h;
+  foldsplit(E.folds, at, INT_MAX, &a, &b);
+  if (d > 0) {
+    foldapply(b, 1);
+    foldgrow(a, at, 1);
+    E.folds = foldmerge(a, b);
+    return;
+  }
+  foldsplit(b, at + 1, INT_MAX, &m, &b);
+  foldapply(b, -1);
+  foldgrow(a, at, -1);
+  foldgrow(m, at, -1);
+  // Folds headed by the deleted row or the one above it may now be empty,
+  // and the former can land anywhere among the folds that moved up
+  foldsplit(a, at - 1, INT_MAX, &a, &h);
+  E.folds = foldmerge(a, b);
+  foldreinsert(h);
+  foldreinsert(m);
+}
+
+// Leftmost closed fold that ends at or after row s
+struct fold *foldfirstclosed(int s) {
+  struct fold *t = E.folds;
+  if (!t || t->maxc < s)
+    return NULL;
+  while (1) {
+    foldpush(t);
+    if (t->l && t->l->maxc >= s)
+      t = t->l;
+    else if (t->closed && t->hi >= s)
+      return t;
     else
-      pushUndo(EDITDELETE, E.cy - 1, E.row[E.cy - 1].size);
+      t = t->r;
   }
 }
 
-void insertchar(int c) {
-  if (!coalesce_state.active)
-    pushUndo(EDITINSERT, E.cy, E.cx);
+// The row drawn in place of row r, the header of the closed fold hiding it
+int foldheader(int r) {
+  struct fold *f = foldfirstclosed(r);
+  return (f && f->lo < r) ? f->lo : r;
+}
 
-  if (E.cy == E.numrows)
-    editorInsertRow(E.numrows, "", 0);
+// Next row shown after the visible row r
+int foldnext(int r) {
+  struct fold *f = foldfirstclosed(r + 1);
+  return (f && f->lo <= r) ? f->hi + 1 : r + 1;
+}
 
-  if (c == ')' || c == ']' || c == '}' || c == '"' || c == '\'') {
-    struct erow *row = &E.row[E.cy];
-    if (E.cx < row->size && row->line[E.cx] == c) {
-      E.cx++;
-      return;
+int foldprev(int r) { return r > 0 ? foldheader(r - 1) : 0; }
+
+// The visible row n visible rows below r, or above for a negative n, going
+// no further than numrows. Downwards the rows between closed folds are
+// skipped in one step, and without closed folds it is a plain sum
+int foldmove(int r, int n) {
+  if (!E.folds || E.folds->maxc < 0)
+    return MAX(MIN(r + n, E.numrows), 0);
+  while (n > 0 && r < E.numrows) {
+    struct fold *f = foldfirstclosed(r + 1);
+    if (!f)
+      return MIN(r + n, E.numrows);
+    if (f->lo > r) {
+      int d = MIN(n, f->lo - r);
+      r += d;
+      n -= d;
+    } else {
+      r = f->hi + 1;
+      n--;
     }
   }
+  for (; n < 0 && r > 0; n++)
+    r = foldprev(r);
+  return r;
+}
 
-  rowinsertchar(&E.row[E.cy], E.cx, c);
-  E.cx++;
-  struct erow *row = &E.row[E.cy];
+// Rows hidden below r if it heads a closed fold
+int foldclosedlines(int r) {
+  struct fold *f = foldfirstclosed(r + 1);
+  return (f && f->lo == r) ? f->hi - f->lo : 0;
+}
 
-  if (AUTO_COMPLETION) {
-    switch (c) {
-    case '(':
-      rowinsertchar(row, E.cx, ')');
-      break;
-    case '[':
-      rowinsertchar(row, E.cx, ']');
-      break;
-    case '{':
-      rowinsertchar(row, E.cx, '}');
-      break;
-    case '"':
-      rowinsertchar(row, E.cx, '"');
-      break;
-    case '\'':
-      rowinsertchar(row, E.cx, '\'');
-      break;
-    default:
-      return;
-    }
+// Visible rows in [from, to), counting no further than limit
+int foldcount(int from, int to, int limit) {
+  int n = 0;
+  for (int r = from; r < to && n < limit; r = foldnext(r))
+    n++;
+  return n;
+}
+
+int foldreach(struct fold *t, bool open) {
+  return open ? t->maxo : MAX(t->maxc, t->maxo);
+}
+
+// Last fold of t in tree order still going at row r
+struct fold *foldlast(struct fold *t, int r, bool open) {
+  if (!t || foldreach(t, open) < r)
+    return NULL;
+  while (1) {
+    foldpush(t);
+    if (t->r && foldreach(t->r, open) >= r)
+      t = t->r;
+    else if (t->hi >= r && (!open || !t->closed))
+      return t;
+    else
+      t = t->l;
   }
-  // E.cx--;
 }
 
-void insertnewline() {
-  if (E.numrows == 0) {
-    editorInsertRow(0, "", 0);
-    updaterow(&E.row[0]);
-    E.cy = 0;
-    E.cx = 0;
-    return;
+// Innermost fold holding row r, only looking at open folds if `open`
+bool foldinner(int r, bool open, int *lo, int *hi) {
+  struct fold *a, *b;
+  foldsplit(E.folds, r + 1, INT_MAX, &a, &b);
+  struct fold *f = foldlast(a, r, open);
+  if (f) {
+    *lo = f->lo;
+    *hi = f->hi;
   }
-  if (E.cy < 0 || E.cy >= E.numrows)
+  E.folds = foldmerge(a, b);
+  return f != NULL;
+}
+
+void foldfree(struct fold *t) {
+  if (!t)
     return;
+  foldfree(t->l);
+  foldfree(t->r);
+  free(t);
+}
 
-  struct erow *row = &E.row[E.cy];
+void foldclose(struct fold *t, bool closed) {
+  if (!t)
+    return;
+  foldpush(t);
+  t->closed = closed;
+  foldclose(t->l, closed);
+  foldclose(t->r, closed);
+  foldpull(t);
+}
 
-  if (E.cx < 0)
-    E.cx = 0;
-  if (E.cx > row->size)
-    E.cx = row->size;
+// Opens, closes or with closed = -1 deletes the fold [lo, hi]
+bool foldset(int lo, int hi, int closed) {
+  struct fold *a, *m, *b;
+  foldsplit(E.folds, lo, hi, &a, &b);
+  foldsplit(b, lo, hi - 1, &m, &b);
+  bool found = m != NULL;
+  if (closed < 0) {
+    foldfree(m);
+    m = NULL;
+  } else
+    foldclose(m, closed);
+  E.folds = foldmerge(foldmerge(a, m), b);
+  return found;
+}
 
-  updaterow(row);
+// Adds the closed fold [lo, hi], refusing one that would cross another
+bool foldcreate(int lo, int hi) {
+  if (hi <= lo)
+    return false;
+  struct fold *a, *b, *c, *d;
+  foldsplit(E.folds, lo, INT_MAX, &a, &b);
+  foldsplit(b, lo + 1, INT_MAX, &b, &c);
+  foldsplit(c, hi + 1, INT_MAX, &c, &d);
+  // Folds holding lo nest, so the innermost one must hold hi as well
+  struct fold *outer = foldlast(a, lo, false);
+  bool ok = (!outer || outer->hi >= hi) && (!c || MAX(c->maxc, c->maxo) <= hi);
+  E.folds = foldmerge(foldmerge(a, b), foldmerge(c, d));
+  if (!ok)
+    return false;
+  if (foldset(lo, hi, true))
+    return true;
+  struct fold *f = malloc(sizeof(struct fold));
+  if (!f)
+    die("malloc");
+  f->lo = lo;
+  f->hi = hi;
+  f->closed = true;
+  f->prio = rand();
+  f->shift = 0;
+  f->l = f->r = NULL;
+  foldpull(f);
+  foldinsert(f);
+  return true;
+}
 
-  bool beforeOpen = (E.cx > 0 && row->line[E.cx - 1] == '{');
-  bool afterClose = (E.cx < row->size && row->line[E.cx] == '}');
+int linenumwidth() {
+  long long n = E.pager.fd != -1 ? pagerlines() : E.numrows;
+  return (n > 0) ? (int)log10(n) + 1 : 1;
+}
 
-  if (beforeOpen && afterClose) {
-    char *afterCursor = strdup(&row->line[E.cx]);
-    row->line[E.cx] = '\0';
-    row->size = E.cx;
-    updaterow(row);
+// Columns left for text once the line number gutter is drawn
+int textwidth() {
+  int w = E.cols - linenumwidth() - 1;
+  return w > 0 ? w : 1;
+}
 
-    editorInsertRow(E.cy + 1, afterCursor, strlen(afterCursor));
-    updaterow(&E.row[E.cy + 1]);
-    editorInsertRow(E.cy + 1, "", 0);
-    updaterow(&E.row[E.cy + 1]);
+// A row always takes one extra column for the cursor to sit past its end
+int rowvlines(struct erow *row, int width) { return row->width / width + 1; }
 
-    free(afterCursor);
+void wrapInvalidate() { E.wrap.valid = false; }
 
-    E.cy++;
-    E.cx = 0;
+// Opens every closed fold hiding row r
+void foldreveal(int r) {
+  struct fold *f;
+  while ((f = foldfirstclosed(r)) && f->lo < r) {
+    foldset(f->lo, f->hi, false);
+    wrapInvalidate();
+  }
+}
 
-    row = &E.row[E.cy - 1];
-    int spaces = 0, i = 0;
-    while (i < row->size) {
-      if (row->line[i] == ' ')
-        spaces++;
-      else if (row->line[i] == '\t')
-        spaces += TAB_LENGTH;
-      else
-        break;
-      i++;
+// Rebuilds the tree nodes over rows from on, each from its row's count and
+// the nodes below it, which are either untouched or rebuilt just before
+void wrapTree(int from) {
+  struct wrapindex *w = &E.wrap;
+  w->tree[0] = 0;
+  for (int i = from + 1; i <= w->n; i++) {
+    w->tree[i] = w->cnt[i - 1];
+    for (int c = 1; c < (i & -i); c *= 2)
+      w->tree[i] += w->tree[i - c];
+  }
+}
+
+void wrapRebuild() {
+  struct wrapindex *w = &E.wrap;
+  if (E.numrows > w->cap) {
+    w->cap = MAX(E.numrows, w->cap * 2);
+    w->tree = realloc(w->tree, sizeof(int) * (w->cap + 1));
+    w->cnt = realloc(w->cnt, sizeof(int) * w->cap);
+    if (!w->tree || !w->cnt)
+      die("realloc");
+  }
+  w->n = E.numrows;
+  w->width = textwidth();
+  // Rows hidden in closed folds take no visual lines
+  for (int i = 0, shown = 0; i < w->n; i++) {
+    w->cnt[i] = 0;
+    if (i == shown) {
+      w->cnt[i] = rowvlines(&E.row[i], w->width);
+      shown = foldnext(i);
     }
-    int tabs = spaces / TAB_LENGTH + 1;
+  }
+  wrapTree(0);
+  w->valid = true;
+}
 
-    for (int j = 0; j < tabs; j++)
-      insertchar('\t');
+// Moves the counts of the rows from at on for a row inserted (d = 1) or
+// deleted (d = -1) at at, rebuilding only the nodes over them, so adding a
+// row at the end costs a few nodes. The row now at at is counted by
+// wrapUpdate
+void wrapShift(int at, int d) {
+  struct wrapindex *w = &E.wrap;
+  if (!w->valid || w->n + d > w->cap || at < 0 || at > w->n - (d < 0)) {
+    wrapInvalidate();
+    return;
+  }
+  if (d > 0) {
+    memmove(&w->cnt[at + 1], &w->cnt[at], sizeof(int) * (w->n - at));
+    w->cnt[at] = 0;
+  } else
+    memmove(&w->cnt[at], &w->cnt[at + 1], sizeof(int) * (w->n - at - 1));
+  w->n += d;
+  wrapTree(at);
+}
+
+void wrapEnsure() {
+  if (!E.wrap.valid || E.wrap.n != E.numrows || E.wrap.width != textwidth())
+    wrapRebuild();
+}
+
+void wrapUpdate(int at) {
+  struct wrapindex *w = &E.wrap;
+  if (!w->valid || at < 0 || at >= w->n || at >= E.numrows)
+    return;
+  int lines = foldheader(at) == at ? rowvlines(&E.row[at], w->width) : 0;
+  int delta = lines - w->cnt[at];
+  if (delta == 0)
+    return;
+  w->cnt[at] += delta;
+  for (int i = at + 1; i <= w->n; i += i & -i)
+    w->tree[i] += delta;
+}
+
+// Visual line on which row `at` starts
+int wrapRowStart(int at) {
+  int sum = 0;
+  for (int i = MIN(at, E.wrap.n); i > 0; i -= i & -i)
+    sum += E.wrap.tree[i];
+  return sum;
+}
+
+// Row holding visual line v, with the wrapped segment of that row in *seg
+int wrapFind(int v, int *seg) {
+  struct wrapindex *w = &E.wrap;
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= w->n)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= w->n && w->tree[pos + step] <= v) {
+      pos += step;
+      v -= w->tree[pos];
+    }
+  }
+  if (seg)
+    *seg = (pos < w->n) ? v : 0;
+  return pos;
+}
+
+// Scrolls the wrapped view by visual lines, dragging the cursor along
+void wrapScroll(int delta) {
+  wrapEnsure();
+  struct wrapindex *w = &E.wrap;
+  int total = wrapRowStart(E.numrows);
+  w->voff = MAX(0, MIN(w->voff + delta, total - 1));
+  E.rowoff = w->toprow = wrapFind(w->voff, NULL);
+
+  if (E.cy >= E.numrows)
+    E.cy = E.numrows - 1;
+  int cv = wrapRowStart(E.cy) + cxtorx(&E.row[E.cy], E.cx) / w->width;
+  int target = -1;
+  if (cv < w->voff)
+    target = w->voff;
+  else if (cv >= w->voff + E.rows)
+    target = MIN(w->voff + E.rows - 1, total - 1);
+  if (target == -1)
+    return;
+  int seg;
+  E.cy = wrapFind(target, &seg);
+  E.cx = rxtocx(&E.row[E.cy], seg * w->width);
+}
+
+// Brackets
+
+// Kind of a bracket character, -1 for anything else
+int bracketkind(char c, bool *open) {
+  static const char opens[] = "({[<", closes[] = ")}]>";
+  char *p;
+  if (c && (p = strchr(opens, c))) {
+    *open = true;
+    return p - opens;
+  }
+  if (c && (p = strchr(closes, c))) {
+    *open = false;
+    return p - closes;
+  }
+  *open = false;
+  return -1;
+}
+
+void bracketcombine(struct bracketsum *out, struct bracketsum *a,
+                    struct bracketsum *b) {
+  for (int k = 0; k < 4; k++) {
+    int matched = MIN(a->open[k], b->close[k]);
+    out->close[k] = a->close[k] + b->close[k] - matched;
+    out->open[k] = a->open[k] + b->open[k] - matched;
+  }
+}
+
+void bracketsRebuild() {
+  struct bracketindex *b = &E.brackets;
+  int size = 1;
+  while (size < E.numrows)
+    size *= 2;
+  if (size != b->size) {
+    free(b->tree);
+    b->tree = malloc(sizeof(struct bracketsum) * 2 * size);
+    if (!b->tree)
+      die("malloc");
+    b->size = size;
+  }
+  memset(b->tree, 0, sizeof(struct bracketsum) * 2 * size);
+  for (int i = 0; i < E.numrows; i++)
+    b->tree[size + i] = E.row[i].brs;
+  for (int i = size - 1; i > 0; i--)
+    bracketcombine(&b->tree[i], &b->tree[2 * i], &b->tree[2 * i + 1]);
+  b->n = E.numrows;
+  b->valid = true;
+}
+
+// Moves the leaves of the rows from at on for a row inserted (d = 1) or
+// deleted (d = -1) at at, recombining only the nodes above them, so adding a
+// row at the end costs a path to the root. The row now at at is summed by
+// updatebrackets
+void bracketsShift(int at, int d) {
+  struct bracketindex *b = &E.brackets;
+  if (!b->valid || b->n + d > b->size || at < 0 || at > b->n - (d < 0)) {
+    b->valid = false;
+    return;
+  }
+  struct bracketsum *leaf = &b->tree[b->size];
+  int end = MAX(b->n, b->n + d);
+  if (d > 0)
+    memmove(&leaf[at + 1], &leaf[at], sizeof(*leaf) * (b->n - at));
+  else
+    memmove(&leaf[at], &leaf[at + 1], sizeof(*leaf) * (b->n - at - 1));
+  memset(&leaf[d > 0 ? at : b->n - 1], 0, sizeof(*leaf));
+  b->n += d;
+  for (int lo = b->size + at, hi = b->size + end - 1; lo > 1;) {
+    lo /= 2;
+    hi /= 2;
+    for (int i = lo; i <= hi; i++)
+      bracketcombine(&b->tree[i], &b->tree[2 * i], &b->tree[2 * i + 1]);
+  }
+}
+
+void bracketsEnsure() {
+  if (!E.brackets.valid || E.brackets.n != E.numrows)
+    bracketsRebuild();
+}
+
+// Rescans the brackets of line[from, size). Long rows only keep a window of
+// highlight, so their brackets are taken as they are
+void updatebrackets(struct erow *row, int from) {
+  if (!row->windowed)
+    from = 0;
+  int n = row->nbrk;
+  while (n > 0 && row->brk[n - 1] >= from)
+    n--;
+  for (int i = from; i < row->size; i++) {
+    bool open;
+    if (bracketkind(row->line[i], &open) < 0)
+      continue;
+    if (!row->windowed && row->highlight) {
+      int hl = row->highlight[cxtorb(row, i)];
+      if (hl == STRING || hl == COMMENT || hl == MULTICOMMENT)
+        continue;
+    }
+    if (n == row->brkcap) {
+      row->brkcap = row->brkcap ? row->brkcap * 2 : 8;
+      row->brk = realloc(row->brk, sizeof(int) * row->brkcap);
+      if (!row->brk)
+        die("realloc");
+    }
+    row->brk[n++] = i;
+  }
+  row->nbrk = n;
+
+  memset(&row->brs, 0, sizeof(row->brs));
+  for (int t = 0; t < n; t++) {
+    bool open;
+    int k = bracketkind(row->line[row->brk[t]], &open);
+    if (open)
+      row->brs.open[k]++;
+    else if (row->brs.open[k] > 0)
+      row->brs.open[k]--;
+    else
+      row->brs.close[k]++;
+  }
+
+  struct bracketindex *b = &E.brackets;
+  if (!b->valid || row->idx >= b->n)
+    return;
+  int i = b->size + row->idx;
+  b->tree[i] = row->brs;
+  for (i /= 2; i > 0; i /= 2)
+    bracketcombine(&b->tree[i], &b->tree[2 * i], &b->tree[2 * i + 1]);
+}
+
+// First bracket of the row at or after line offset x
+int bracketat(struct erow *row, int x) {
+  int lo = 0, hi = row->nbrk;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->brk[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Follows brackets of kind k forward from bracket t of row y with d opens
+// pending, stopping at the close that matches them all
+int bracketscanforward(struct erow *row, int t, int k, int *d) {
+  for (; t < row->nbrk; t++) {
+    bool open;
+    if (bracketkind(row->line[row->brk[t]], &open) != k)
+      continue;
+    if (open)
+      (*d)++;
+    else if (--*d == 0)
+      return row->brk[t];
+  }
+  return -1;
+}
+
+int bracketscanback(struct erow *row, int t, int k, int *d) {
+  for (; t >= 0; t--) {
+    bool open;
+    if (bracketkind(row->line[row->brk[t]], &open) != k)
+      continue;
+    if (!open)
+      (*d)++;
+    else if (--*d == 0)
+      return row->brk[t];
+  }
+  return -1;
+}
+
+// First row at or after `from` whose unmatched closes settle d pending opens
+int bracketdescend(int node, int lo, int hi, int from, int k, int *d) {
+  struct bracketsum *s = &E.brackets.tree[node];
+  if (hi <= from)
+    return -1;
+  if (lo >= from && s->close[k] < *d) {
+    *d += s->open[k] - s->close[k];
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int r = bracketdescend(2 * node, lo, mid, from, k, d);
+  return r >= 0 ? r : bracketdescend(2 * node + 1, mid, hi, from, k, d);
+}
+
+// Last row before `to` whose unmatched opens settle d pending closes
+int bracketascend(int node, int lo, int hi, int to, int k, int *d) {
+  struct bracketsum *s = &E.brackets.tree[node];
+  if (lo >= to)
+    return -1;
+  if (hi <= to && s->open[k] < *d) {
+    *d += s->close[k] - s->open[k];
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int r = bracketascend(2 * node + 1, mid, hi, to, k, d);
+  return r >= 0 ? r : bracketascend(2 * node, lo, mid, to, k, d);
+}
+
+bool bracketforward(int k, int y, int t, int d, int *outx, int *outy) {
+  int x = bracketscanforward(&E.row[y], t, k, &d);
+  if (x < 0 && d > 0) {
+    bracketsEnsure();
+    y = bracketdescend(1, 0, E.brackets.size, y + 1, k, &d);
+    if (y < 0)
+      return false;
+    x = bracketscanforward(&E.row[y], 0, k, &d);
+  }
+  *outx = x;
+  *outy = y;
+  return x >= 0;
+}
+
+bool bracketbackward(int k, int y, int t, int d, int *outx, int *outy) {
+  int x = bracketscanback(&E.row[y], t, k, &d);
+  if (x < 0 && d > 0) {
+    bracketsEnsure();
+    y = bracketascend(1, 0, E.brackets.size, y, k, &d);
+    if (y < 0)
+      return false;
+    x = bracketscanback(&E.row[y], E.row[y].nbrk - 1, k, &d);
+  }
+  *outx = x;
+  *outy = y;
+  return x >= 0;
+}
+
+// The bracket paired with the one at line offset x of row y
+bool bracketmatch(int x, int y, int *outx, int *outy) {
+  if (y < 0 || y >= E.numrows)
+    return false;
+  struct erow *row = &E.row[y];
+  int t = bracketat(row, x);
+  if (t == row->nbrk || row->brk[t] != x)
+    return false;
+  bool open;
+  int k = bracketkind(row->line[x], &open);
+  if (open)
+    return bracketforward(k, y, t, 0, outx, outy);
+  return bracketbackward(k, y, t, 0, outx, outy);
+}
+
+// Expands tabs of line[from, to) into row->render, aligned as if the render
+// started at column rx
+void renderline(struct erow *row, int from, int to, int rx) {
+  int tabs = 0;
+  int j;
+  for (j = from; j < to; j++)
+    if (row->line[j] == '\t')
+      tabs++;
+
+  free(row->render);
+  row->render = malloc(to - from + tabs * (TAB_LENGTH - 1) + 1);
+
+  int idx = 0;
+  for (j = from; j < to; j++) {
+    if (row->line[j] == '\t') {
+      row->render[idx++] = ' ';
+      rx++;
+      while (rx % TAB_LENGTH != 0) {
+        row->render[idx++] = ' ';
+        rx++;
+      }
+    } else if ((unsigned char)row->line[j] < 0x80) {
+      row->render[idx++] = row->line[j];
+      rx++;
+    } else {
+      int len;
+      rx += cellwidth(row->line, j, to, &len);
+      memcpy(&row->render[idx], &row->line[j], len);
+      idx += len;
+      j += len - 1;
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+}
+
+// Renders and highlights the chunks of a long row around render column rx
+void rowwindow(struct erow *row, int rx) {
+  int k = rxtocx(row, rx) / LONG_LINE_CHUNK;
+  row->loff = cellstart(row, MAX(k - 1, 0) * LONG_LINE_CHUNK);
+  row->lend = cellstart(row, MIN((k + 2) * LONG_LINE_CHUNK, row->size));
+  row->roff = cxtorx(row, row->loff);
+  renderline(row, row->loff, row->lend, row->roff);
+  updateSyntax(row);
+}
+
+// Frees what a row of a large file only needs while it is on screen
+void rowdrop(struct erow *row) {
+  free(row->render);
+  free(row->highlight);
+  free(row->tok);
+  row->render = NULL;
+  row->highlight = NULL;
+  row->tok = NULL;
+  row->rsize = row->ntok = row->tokcap = 0;
+}
+
+// Renders and highlights a row of a large file about to be drawn
+void rowshow(struct erow *row, int rx) {
+  struct largefile *L = &E.large;
+  if (row->windowed) {
+    rowwindow(row, rx);
+  } else {
+    renderline(row, 0, row->size, 0);
+    updateSyntax(row);
+  }
+  if (!L->on)
+    return;
+  if (L->nshown == L->cap) {
+    L->cap = MAX(64, L->cap * 2);
+    L->shown = realloc(L->shown, sizeof(int) * L->cap);
+  }
+  L->shown[L->nshown++] = row->idx;
+}
+
+// Drops the rows shown that are a screen or more away from the visible ones.
+// An index gone stale drops some other row, which is only rendered again
+void largetrim() {
+  struct largefile *L = &E.large;
+  int n = 0;
+  for (int i = 0; i < L->nshown; i++) {
+    int y = L->shown[i];
+    if (y >= E.numrows)
+      continue;
+    if (y >= E.rowoff - E.rows && y < E.rowoff + 2 * E.rows)
+      L->shown[n++] = y;
+    else
+      rowdrop(&E.row[y]);
+  }
+  L->nshown = n;
+}
+
+// Drops the render of every row. Auto-completion and relative line numbers
+// are off while it lasts, whatever the options say
+void largemode() {
+  if (E.large.on)
+    return;
+  E.large.on = true;
+  for (int i = 0; i < E.numrows; i++)
+    rowdrop(&E.row[i]);
+}
+
+// Index into row->render of the cell under render column rx, moving a long
+// row's window if rx..rx+E.cols falls outside of it
+int rowrender(struct erow *row, int rx) {
+  if (!row->render)
+    rowshow(row, rx);
+  int cx = rxtocx(row, rx);
+  int base = 0;
+  if (row->windowed) {
+    if (cx < row->loff ||
+        (row->lend < row->size && cxtorx(row, row->lend) < rx + E.cols))
+      rowwindow(row, rx);
+    base = cxtorb(row, row->loff);
+  }
+  int idx = cxtorb(row, cx) - base;
+  // Starting half way through a tab skips the spaces already scrolled past
+  if (cx < row->size && row->line[cx] == '\t')
+    idx += rx - cxtorx(row, cx);
+  return idx;
+}
+
+// Swap file
+// Edits are journaled to .<name>.swp next to the file, after a header naming
+// the pid and the size and mtime of the file they apply to:
+//   I <row> [<n>]\n           n empty rows inserted, 1 when left out
+//   D <row> [<n>]\n           n rows deleted
+//   S <row> <len>\n<line>\n   row content
+// Changed rows are only flagged, and their content recorded when the records
+// are written out, so an edit costs no copying. The write happens from
+// readkey once the oldest record is SWAP_INTERVAL ms old
+
+long long nowms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void swappath(char *path, int size) {
+  char *slash = strrchr(E.filename, '/');
+  if (slash)
+    snprintf(path, size, "%.*s/.%s.swp", (int)(slash - E.filename),
+             E.filename, slash + 1);
+  else
+    snprintf(path, size, ".%s.swp", E.filename);
+}
+
+bool swapping() { return E.swap.on && E.filename && SWAP_INTERVAL > 0; }
+
+void swapadd(const char *s, int len) {
+  if (!E.swap.len && !E.swap.ndirty)
+    E.swap.stamp = nowms();
+  if (E.swap.len + len > E.swap.cap) {
+    E.swap.cap = MAX(E.swap.cap * 2, E.swap.len + len);
+    E.swap.buf = realloc(E.swap.buf, E.swap.cap);
+  }
+  memcpy(&E.swap.buf[E.swap.len], s, len);
+  E.swap.len += len;
+}
+
+// Records the content of the flagged rows
+void swaprows() {
+  char head[32];
+  for (int i = 0; i < E.swap.ndirty; i++) {
+    struct erow *row = &E.row[E.swap.dirty[i]];
+    row->swapdirty = false;
+    swapadd(head,
+            snprintf(head, sizeof(head), "S %d %d\n", row->idx, row->size));
+    swapadd(row->line, row->size);
+    swapadd("\n", 1);
+  }
+  E.swap.ndirty = 0;
+}
+
+void swaprow(struct erow *row) {
+  if (!swapping() || row->swapdirty)
+    return;
+  if (E.swap.ndirty == SWAP_DIRTY_MAX)
+    swaprows();
+  if (!E.swap.len && !E.swap.ndirty)
+    E.swap.stamp = nowms();
+  row->swapdirty = true;
+  E.swap.dirty[E.swap.ndirty++] = row->idx;
+}
+
+// Records d rows being inserted at row at (d > 0) or -d deleted from it, and
+// moves the flags of the rows below
+void swapshift(int at, int d) {
+  if (!swapping())
+    return;
+  char rec[48];
+  char op = d > 0 ? 'I' : 'D';
+  if (d == 1 || d == -1)
+    swapadd(rec, snprintf(rec, sizeof(rec), "%c %d\n", op, at));
+  else
+    swapadd(rec, snprintf(rec, sizeof(rec), "%c %d %d\n", op, at, abs(d)));
+  int n = 0;
+  for (int i = 0; i < E.swap.ndirty; i++) {
+    int y = E.swap.dirty[i];
+    if (d < 0 && y >= at && y < at - d)
+      continue;
+    E.swap.dirty[n++] = y >= at ? y + d : y;
+  }
+  E.swap.ndirty = n;
+}
+
+// Unflags rows [at, at + n) before they are moved around, to be flagged
+// again in their new places
+void swapforget(int at, int n) {
+  int k = 0;
+  for (int i = 0; i < E.swap.ndirty; i++) {
+    int y = E.swap.dirty[i];
+    if (y >= at && y < at + n)
+      E.row[y].swapdirty = false;
+    else
+      E.swap.dirty[k++] = y;
+  }
+  E.swap.ndirty = k;
+}
+
+// Remembers the file as it is on disk, the base the journal applies to
+void swapbase(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return;
+  E.swap.size = st.st_size;
+  E.swap.sec = st.st_mtim.tv_sec;
+  E.swap.nsec = st.st_mtim.tv_nsec;
+}
+
+bool swapcreate() {
+  char path[PATH_MAX];
+  swappath(path, sizeof(path));
+  E.swap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (E.swap.fd == -1)
+    return false;
+  char head[128];
+  int len = snprintf(head, sizeof(head),
+                     "batata swap 1\npid %d\nfile %lld %lld %lld\n",
+                     (int)getpid(), E.swap.size, E.swap.sec, E.swap.nsec);
+  return write(E.swap.fd, head, len) == len;
+}
+
+void swapflush() {
+  swaprows();
+  if (!E.swap.len)
+    return;
+  if (E.swap.fd == -1 && !swapcreate()) {
+    setstatus("Swap file: %s", strerror(errno));
+    E.swap.on = false;
+  } else if (write(E.swap.fd, E.swap.buf, E.swap.len) != E.swap.len) {
+    setstatus("Swap file: %s", strerror(errno));
+  }
+  E.swap.len = 0;
+}
+
+void swaptick() {
+  if ((E.swap.len || E.swap.ndirty) &&
+      nowms() - E.swap.stamp >= SWAP_INTERVAL)
+    swapflush();
+}
+
+// Drops the journal once the buffer matches the file again, or on quit
+void swapdiscard() {
+  for (int i = 0; i < E.swap.ndirty; i++)
+    E.row[E.swap.dirty[i]].swapdirty = false;
+  E.swap.ndirty = 0;
+  E.swap.len = 0;
+  if (E.swap.fd == -1)
+    return;
+  close(E.swap.fd);
+  E.swap.fd = -1;
+  char path[PATH_MAX];
+  swappath(path, sizeof(path));
+  unlink(path);
+}
+
+void updaterow(struct erow *row) {
+  swaprow(row);
+  int from = row->editfrom;
+  updatecols(row, from);
+  row->editfrom = 0;
+  if (E.large.on || input.defer) {
+    rowdrop(row);
+    row->windowed = row->size > LONG_LINE_LENGTH;
+    updatebrackets(row, 0);
+    wrapUpdate(row->idx);
+    return;
+  }
+  if (row->size > LONG_LINE_LENGTH) {
+    row->windowed = true;
+    rowwindow(row, row->roff);
+    updatebrackets(row, from);
+    wrapUpdate(row->idx);
+    return;
+  }
+  row->windowed = false;
+  row->loff = row->roff = 0;
+  renderline(row, 0, row->size, 0);
+  updateSyntax(row);
+  updatebrackets(row, 0);
+  wrapUpdate(row->idx);
+}
+
+// Renders a row left unrendered while a replay runs, for code reading its
+// tokens
+void rowready(struct erow *row) {
+  if (row->render || E.large.on)
+    return;
+  input.defer = false;
+  updaterow(row);
+  input.defer = replaying();
+}
+
+// Renders the rows edited by a replay once it is done, top down so the C
+// parser carries its state through them
+void replaydone() {
+  input.defer = false;
+  if (E.large.on)
+    return;
+  for (int i = 0; i < E.numrows; i++)
+    if (!E.row[i].render)
+      updaterow(&E.row[i]);
+}
+
+// Undo and redo put back a saved line, render and highlight as they were
+void rowrestored(struct erow *row) {
+  swaprow(row);
+  if (E.large.on || row->windowed || row->size > LONG_LINE_LENGTH ||
+      (E.syntax && E.syntax->parse)) {
+    updaterow(row);
+    return;
+  }
+  updatecols(row, 0);
+  updatebrackets(row, 0);
+  wrapUpdate(row->idx);
+}
+
+// Sets up a row holding s, not rendered yet
+void rowinit(struct erow *row, int at, const char *s, size_t len) {
+  row->idx = at;
+
+  row->size = len;
+  row->line = malloc(len + 1);
+  memcpy(row->line, s, len);
+  row->line[len] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->highlight = NULL;
+  row->openComment = false;
+  row->width = 0;
+  row->colcx = NULL;
+  row->colrx = NULL;
+  row->colrb = NULL;
+  row->ncols = 0;
+  row->colcap = 0;
+  row->windowed = false;
+  row->loff = 0;
+  row->lend = 0;
+  row->roff = 0;
+  row->editfrom = 0;
+  row->brk = NULL;
+  row->nbrk = 0;
+  row->brkcap = 0;
+  row->tok = NULL;
+  row->ntok = 0;
+  row->tokcap = 0;
+  row->lexout = -1; // differs from any state, so rows below get relexed
+  row->typegen = 0;
+  row->tdefs = NULL;
+  row->ntdefs = 0;
+  row->swapdirty = false;
+}
+
+// Makes room for n rows
+void rowsreserve(int n) {
+  if (n <= E.rowcap)
+    return;
+  int cap = MAX(16, E.rowcap);
+  while (cap < n)
+    cap *= 2;
+  struct erow *new = realloc(E.row, sizeof(struct erow) * cap);
+  if (!new)
+    die("realloc");
+  E.row = new;
+  E.rowcap = cap;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows)
+    return;
+  rowsreserve(E.numrows + 1);
+  memmove(&E.row[at + 1], &E.row[at], sizeof(struct erow) * (E.numrows - at));
+  for (int i = at + 1; i <= E.numrows; i++)
+    E.row[i].idx++;
+  swapshift(at, 1);
+  foldshift(at, 1);
+  markshift(at, 1);
+  wrapShift(at, 1);
+  bracketsShift(at, 1);
+
+  rowinit(&E.row[at], at, s, len);
+  E.numrows++;
+  updaterow(&E.row[at]);
+  E.dirty = true;
+}
+
+void editorFreeRow(struct erow *row) {
+  free(row->colcx);
+  free(row->colrx);
+  free(row->colrb);
+  free(row->brk);
+  free(row->tok);
+  rowtypedefs(row, NULL, 0);
+  free(row->render);
+  free(row->line);
+  free(row->highlight);
+}
+
+void editorDelRow(int at) {
+  pushUndo(EDITDELETE, at, 0);
+  if (at < 0 || at >= E.numrows)
+    return;
+  int lexout = E.row[at].lexout;
+  swapshift(at, -1);
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1],
+          sizeof(struct erow) * (E.numrows - at - 1));
+  for (int i = at; i < E.numrows - 1; i++)
+    E.row[i].idx--;
+  E.numrows--;
+  foldshift(at, -1);
+  markshift(at, -1);
+  wrapShift(at, -1);
+  // A fold the row headed may be gone, showing the row below
+  wrapUpdate(at);
+  bracketsShift(at, -1);
+  // The row below now starts where the one above the deleted row ended
+  if (E.syntax && E.syntax->parse && at < E.numrows &&
+      (at > 0 ? E.row[at - 1].lexout : 0) != lexout) {
+    updateSyntax(&E.row[at]);
+    updatebrackets(&E.row[at], 0);
+  }
+  E.dirty = true;
+}
+
+// Replaces rows [at, at + n) with m lines in one move of the rows below,
+// taking over the lines. The lines of the rows replaced are handed to out,
+// or freed when it is NULL
+void rowsreplace(int at, int n, struct rowsnap *lines, int m,
+                 struct rowsnap *out) {
+  rowsreserve(E.numrows - n + m);
+  // The journal and folds only know single row moves
+  if (n > m)
+    swapshift(at + m, m - n);
+  for (int i = 0; i < n - m; i++)
+    foldshift(at + m, -1);
+  if (n > m)
+    markshift(at + m, m - n);
+  for (int i = 0; i < n; i++) {
+    struct erow *row = &E.row[at + i];
+    if (out) {
+      out[i] = (struct rowsnap){at + i, row->line, row->size};
+      row->line = NULL;
+    }
+    editorFreeRow(row);
+  }
+  memmove(&E.row[at + m], &E.row[at + n],
+          sizeof(struct erow) * (E.numrows - at - n));
+  E.numrows += m - n;
+  for (int i = at + m; i < E.numrows; i++)
+    E.row[i].idx = i;
+  if (m > n)
+    swapshift(at + n, m - n);
+  for (int i = 0; i < m - n; i++)
+    foldshift(at + n, 1);
+  if (m > n)
+    markshift(at + n, m - n);
+  // Rows replaced one for one keep their places in the wrap and bracket
+  // indexes, updaterow refreshes their counts there
+  if (n != m) {
+    wrapInvalidate();
+    E.brackets.valid = false;
+  }
+
+  // Every new row is set up before any is rendered, as the C parser moves
+  // on into the rows below
+  for (int i = 0; i < m; i++) {
+    struct erow *row = &E.row[at + i];
+    // A row still in the journal's list must not be listed again
+    bool listed = i < n && row->swapdirty;
+    rowinit(row, at + i, "", 0);
+    row->swapdirty = listed;
+    free(row->line);
+    row->line = lines[i].line;
+    row->size = lines[i].size;
+  }
+  for (int i = 0; i < m; i++)
+    updaterow(&E.row[at + i]);
+  // The C parser carries its state into the rows below
+  if (E.syntax && E.syntax->parse && at + m < E.numrows) {
+    updateSyntax(&E.row[at + m]);
+    updatebrackets(&E.row[at + m], 0);
+  }
+  E.dirty = true;
+}
+
+// Moves the rows below a span of n rows at at that is becoming m rows long
+void rowsresize(int at, int n, int m) {
+  rowsreserve(E.numrows - n + m);
+  if (n > m)
+    swapshift(at + m, m - n);
+  else if (m > n)
+    swapshift(at + n, m - n);
+  for (int i = 0; i < n - m; i++)
+    foldshift(at + m, -1);
+  for (int i = 0; i < m - n; i++)
+    foldshift(at + n, 1);
+  markshift(at + MIN(n, m), m - n);
+  memmove(&E.row[at + m], &E.row[at + n],
+          sizeof(struct erow) * (E.numrows - at - n));
+  E.numrows += m - n;
+}
+
+// Journals and highlights the m rows at at after they were moved around
+void rowsmoved(int at, int m) {
+  for (int i = at; i < E.numrows; i++)
+    E.row[i].idx = i;
+  for (int i = at; i < at + m; i++)
+    swaprow(&E.row[i]);
+  // Highlighting can carry from one row into the next
+  for (int i = at; E.syntax && i <= at + m && i < E.numrows; i++) {
+    updateSyntax(&E.row[i]);
+    updatebrackets(&E.row[i], 0);
+  }
+  wrapInvalidate();
+  E.brackets.valid = false;
+  E.dirty = true;
+}
+
+// Reorders the n rows at at so row at + i is the one that was at + perm[i],
+// for i below m, handing the lines of the rows perm leaves out to dropped.
+// The rows move with their lines and renders, nothing is copied
+void rowspermute(int at, int n, int *perm, int m, struct rowsnap *dropped) {
+  struct erow *old = malloc(sizeof(struct erow) * MAX(n, 1));
+  bool *kept = calloc(MAX(n, 1), 1);
+  swapforget(at, n);
+  memcpy(old, &E.row[at], sizeof(struct erow) * n);
+  for (int i = 0; i < m; i++)
+    kept[perm[i]] = true;
+  rowsresize(at, n, m);
+  for (int i = 0; i < m; i++)
+    E.row[at + i] = old[perm[i]];
+  for (int i = 0, k = 0; i < n; i++)
+    if (!kept[i]) {
+      dropped[k++] = (struct rowsnap){at + i, old[i].line, old[i].size};
+      old[i].line = NULL;
+      editorFreeRow(&old[i]);
+    }
+  free(kept);
+  free(old);
+  rowsmoved(at, m);
+}
+
+// Undoes rowspermute, putting the rows back in their order and the dropped
+// ones back in their place
+void rowsunpermute(int at, int n, int *perm, int m, struct rowsnap *dropped) {
+  struct erow *cur = malloc(sizeof(struct erow) * MAX(m, 1));
+  swapforget(at, m);
+  memcpy(cur, &E.row[at], sizeof(struct erow) * m);
+  rowsresize(at, m, n);
+  for (int i = 0; i < m; i++)
+    E.row[at + perm[i]] = cur[i];
+  for (int k = 0; k < n - m; k++) {
+    struct erow *row = &E.row[dropped[k].at];
+    rowinit(row, dropped[k].at, "", 0);
+    free(row->line);
+    row->line = dropped[k].line;
+    row->size = dropped[k].size;
+  }
+  free(cur);
+  for (int i = at; i < E.numrows; i++)
+    E.row[i].idx = i;
+  for (int k = 0; k < n - m; k++)
+    updaterow(&E.row[dropped[k].at]);
+  rowsmoved(at, n);
+}
+
+void rowinsertchar(struct erow *row, int at, int c) {
+  if (at < 0 || at > row->size)
+    at = row->size;
+  row->line = realloc(row->line, row->size + 2);
+  memmove(&row->line[at + 1], &row->line[at], row->size - at + 1);
+  row->size++;
+  row->line[at] = c;
+  row->editfrom = at;
+  updaterow(row);
+  E.dirty = true;
+  if (!coalesce_state.active)
+    pushUndo(EDITINSERT, E.cy, E.cx);
+}
+
+void rowdeletebytes(struct erow *row, int at, int n) {
+  if (at < 0 || n <= 0 || at + n > row->size)
+    return;
+  memmove(&row->line[at], &row->line[at + n], row->size - at - n + 1);
+  row->size -= n;
+  row->editfrom = at;
+  updaterow(row);
+  E.dirty = true;
+  if (!coalesce_state.active) {
+    if (E.cx > 0)
+      pushUndo(EDITDELETE, E.cy, E.cx - 1);
+    else
+      pushUndo(EDITDELETE, E.cy - 1, E.row[E.cy - 1].size);
+  }
+}
+
+void rowdeletechar(struct erow *row, int at) { rowdeletebytes(row, at, 1); }
+
+// Replaces the character under the cursor with the one starting with byte c,
+// reading the rest of a multibyte sequence from the keyboard
+void replacecell(int c) {
+  char buf[4];
+  int n = 1;
+  buf[0] = c;
+  if ((c & 0xE0) == 0xC0)
+    n = 2;
+  else if ((c & 0xF0) == 0xE0)
+    n = 3;
+  else if ((c & 0xF8) == 0xF0)
+    n = 4;
+  for (int i = 1; i < n; i++)
+    buf[i] = readkey();
+  struct erow *row = &E.row[E.cy];
+  rowdeletebytes(row, E.cx, nextcell(row, E.cx) - E.cx);
+  for (int i = 0; i < n; i++)
+    rowinsertchar(row, E.cx + i, buf[i]);
+}
+
+void insertchar(int c) {
+  if (!coalesce_state.active)
+    pushUndo(EDITINSERT, E.cy, E.cx);
+
+  if (E.cy == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+
+  if (c == ')' || c == ']' || c == '}' || c == '"' || c == '\'') {
+    struct erow *row = &E.row[E.cy];
+    if (E.cx < row->size && row->line[E.cx] == c) {
+      E.cx++;
+      return;
+    }
+  }
+
+  rowinsertchar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+  struct erow *row = &E.row[E.cy];
+
+  if (AUTO_COMPLETION && !E.large.on) {
+    switch (c) {
+    case '(':
+      rowinsertchar(row, E.cx, ')');
+      break;
+    case '[':
+      rowinsertchar(row, E.cx, ']');
+      break;
+    case '{':
+      rowinsertchar(row, E.cx, '}');
+      break;
+    case '"':
+      rowinsertchar(row, E.cx, '"');
+      break;
+    case '\'':
+      rowinsertchar(row, E.cx, '\'');
+      break;
+    default:
+      return;
+    }
+  }
+  // E.cx--;
+}
+
+void insertnewline() {
+  if (E.numrows == 0) {
+    editorInsertRow(0, "", 0);
+    updaterow(&E.row[0]);
+    E.cy = 0;
+    E.cx = 0;
+    return;
+  }
+  if (E.cy < 0 || E.cy >= E.numrows)
+    return;
+
+  struct erow *row = &E.row[E.cy];
+
+  if (E.cx < 0)
+    E.cx = 0;
+  if (E.cx > row->size)
+    E.cx = row->size;
+
+  updaterow(row);
+
+  bool beforeOpen = (E.cx > 0 && row->line[E.cx - 1] == '{');
+  bool afterClose = (E.cx < row->size && row->line[E.cx] == '}');
+
+  if (beforeOpen && afterClose) {
+    char *afterCursor = strdup(&row->line[E.cx]);
+    row->line[E.cx] = '\0';
+    row->size = E.cx;
+    updaterow(row);
+
+    editorInsertRow(E.cy + 1, afterCursor, strlen(afterCursor));
+    updaterow(&E.row[E.cy + 1]);
+    editorInsertRow(E.cy + 1, "", 0);
+    updaterow(&E.row[E.cy + 1]);
+
+    free(afterCursor);
+
+    E.cy++;
+    E.cx = 0;
+
+    row = &E.row[E.cy - 1];
+    int spaces = 0, i = 0;
+    while (i < row->size) {
+      if (row->line[i] == ' ')
+        spaces++;
+      else if (row->line[i] == '\t')
+        spaces += TAB_LENGTH;
+      else
+        break;
+      i++;
+    }
+    int tabs = spaces / TAB_LENGTH + 1;
+
+    for (int j = 0; j < tabs; j++)
+      insertchar('\t');
 
     return;
   }
@@ -1002,139 +3621,1931 @@ void insertnewline() {
       spaces += TAB_LENGTH;
     else
       break;
-    i++;
+    i++;
+  }
+  int tabs = spaces / TAB_LENGTH;
+
+  if (E.syntax && row->size > 0) {
+    char *Is = E.syntax->IndentStart;
+    char *Ie = E.syntax->IndentEnd;
+    int IsLen = Is ? strlen(Is) : 0;
+    int IeLen = Ie ? strlen(Ie) : 0;
+
+    if (IsLen > 0) {
+      for (int j = i; j <= row->size - IsLen; j++) {
+        if (!strncmp(&row->line[j], Is, IsLen)) {
+          tabs++;
+          break;
+        }
+      }
+    }
+    if (IeLen > 0) {
+      for (int j = i; j <= row->size - IeLen; j++) {
+        if (!strncmp(&row->line[j], Ie, IeLen)) {
+          tabs--;
+          break;
+        }
+      }
+    }
+  }
+
+  if (tabs < 0)
+    tabs = 0;
+
+  editorInsertRow(E.cy + 1, &row->line[E.cx], row->size - E.cx);
+  row = &E.row[E.cy];
+
+  size_t new_size = E.cx;
+  char *new_line = realloc(row->line, new_size + 1);
+  if (!new_line)
+    die("realloc");
+  row->line = new_line;
+  row->size = new_size;
+  row->line[row->size] = '\0';
+  updaterow(row);
+
+  E.cy++;
+  E.cx = 0;
+
+  for (int j = 0; j < tabs; j++)
+    insertchar('\t');
+}
+
+void rowinsertstring(struct erow *row, char *s, size_t len) {
+  row->line = realloc(row->line, row->size + len + 1);
+  memcpy(&row->line[row->size], s, len);
+  row->editfrom = row->size;
+  row->size += len;
+  row->line[row->size] = '\0';
+  updaterow(row);
+  E.dirty = true;
+}
+
+void deletechar() {
+  if (E.cy >= E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  if (!coalesce_state.active) {
+    if (E.cx > 0)
+      pushUndo(EDITDELETE, E.cy, E.cx - 1);
+    else
+      pushUndo(EDITDELETE, E.cy - 1, E.row[E.cy - 1].size);
+  }
+
+  struct erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    int from = prevcell(row, E.cx);
+    rowdeletebytes(row, from, E.cx - from);
+    E.cx = from;
+  } else {
+    E.cx = E.row[E.cy - 1].size;
+    rowinsertstring(&E.row[E.cy - 1], row->line, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+    coalesce_state.active = false;
+  }
+}
+
+// Multiple cursors
+// Each key is applied at every cursor in one pass over the rows they are on,
+// rebuilding each row once, and the rows are saved once in an EDITROWS undo
+// action that goes on collecting edits while typing continues
+
+// First cursor on row y or below it
+int mcfirst(int y) {
+  int lo = 0, hi = E.multi.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.multi.at[mid].y < y)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void mcclear() {
+  E.multi.n = 0;
+  E.multi.coalesce = false;
+  E.multi.block = false;
+}
+
+int mcadd(int x, int y) {
+  struct cursors *M = &E.multi;
+  if (M->n == M->cap) {
+    M->cap = MAX(16, M->cap * 2);
+    M->at = realloc(M->at, sizeof(struct cursor) * M->cap);
+  }
+  M->at[M->n] = (struct cursor){x, y};
+  return M->n++;
+}
+
+// Makes the cursor at or after the main one the main cursor, going back to
+// a single one when there are fewer than two
+void mcstart() {
+  struct cursors *M = &E.multi;
+  M->main = 0;
+  while (M->main < M->n - 1 &&
+         (M->at[M->main].y < E.cy ||
+          (M->at[M->main].y == E.cy && M->at[M->main].x < E.cx)))
+    M->main++;
+  if (M->n) {
+    E.cx = M->at[M->main].x;
+    E.cy = M->at[M->main].y;
+  }
+  if (M->n < 2) {
+    setstatus(M->n ? "Only one match" : "No matches");
+    mcclear();
+    return;
+  }
+  M->coalesce = false;
+  coalesce_state.active = false;
+  setstatus("%d cursors, Esc to leave", M->n);
+}
+
+// A cursor at every match of the last search
+void mcsearch() {
+  if (!searchquery) {
+    setstatus("Search with / first");
+    return;
+  }
+  int qlen = strlen(searchquery);
+  mcclear();
+  for (int y = 0; y < E.numrows; y++) {
+    char *line = E.row[y].line, *p = line;
+    while ((p = strstr(p, searchquery))) {
+      mcadd(p - line, y);
+      p += qlen;
+    }
+  }
+  mcstart();
+}
+
+// A cursor on every line of the visual selection, in the cursor's column
+void mcselection() {
+  int from = MIN(E.sel_y, E.cy), to = MAX(E.sel_y, E.cy);
+  mcclear();
+  for (int y = from; y <= to && y < E.numrows; y++)
+    mcadd(cellstart(&E.row[y], MIN(E.cx, E.row[y].size)), y);
+  E.mode = 'n';
+  mcstart();
+}
+
+// Drops cursors that ran into each other and puts E.cx, E.cy on the main one
+void mcmerge() {
+  struct cursors *M = &E.multi;
+  int n = 0;
+  for (int i = 0; i < M->n; i++) {
+    bool same = n && M->at[n - 1].y == M->at[i].y &&
+                M->at[n - 1].x == M->at[i].x;
+    if (i == M->main)
+      M->main = same ? n - 1 : n;
+    if (!same)
+      M->at[n++] = M->at[i];
+  }
+  M->n = n;
+  E.cx = M->at[M->main].x;
+  E.cy = M->at[M->main].y;
+  if (M->n < 2)
+    mcclear();
+}
+
+// Keeps every cursor inside its row after an undo or redo
+void mcclamp() {
+  struct cursors *M = &E.multi;
+  for (int i = 0; i < M->n; i++) {
+    struct cursor *c = &M->at[i];
+    if (c->y >= E.numrows) {
+      mcclear();
+      break;
+    }
+    c->x = cellstart(&E.row[c->y], MIN(c->x, E.row[c->y].size));
+  }
+  if (M->n) {
+    mcmerge();
+  } else if (E.cy < E.numrows) {
+    E.cx = MIN(E.cx, E.row[E.cy].size);
+  }
+}
+
+// Saves the rows holding a cursor as one undo action, unless typing goes on
+// into the last one
+void mcundo() {
+  struct cursors *M = &E.multi;
+  if (M->coalesce && E.undotop && E.UndoStack[E.undotop - 1].type == EDITROWS)
+    return;
+  struct action a = {.type = EDITROWS};
+  a.rows = malloc(sizeof(struct rowsnap) * M->n);
+  for (int i = 0; i < M->n; i++) {
+    int y = M->at[i].y;
+    if (a.nrows && a.rows[a.nrows - 1].at == y)
+      continue;
+    struct erow *row = &E.row[y];
+    a.rows[a.nrows++] = (struct rowsnap){y, strdup(row->line), row->size};
+  }
+  pushrows(a);
+  M->coalesce = true;
+}
+
+// Spans of a row an edit at cursor x replaces, returning where they start
+// and setting to where they end
+int spanat(struct erow *row, int x, int *to) {
+  (void)row;
+  *to = x;
+  return x;
+}
+
+int spanback(struct erow *row, int x, int *to) {
+  *to = x;
+  return x > 0 ? prevcell(row, x) : x;
+}
+
+int spanforward(struct erow *row, int x, int *to) {
+  *to = x < row->size ? nextcell(row, x) : x;
+  return x;
+}
+
+// From x through the cell on the right edge of the block
+int spanblock(struct erow *row, int x, int *to) {
+  *to = rxtocx(row, E.multi.right);
+  if (*to < row->size)
+    *to = nextcell(row, *to);
+  *to = MAX(*to, x);
+  return x;
+}
+
+// Replaces the span around every cursor with s, leaving the cursor after it
+void mcedit(const char *s, int len, int (*span)(struct erow *, int, int *)) {
+  struct cursors *M = &E.multi;
+  mcundo();
+  for (int i = 0; i < M->n;) {
+    int y = M->at[i].y, end = i;
+    while (end < M->n && M->at[end].y == y)
+      end++;
+    struct erow *row = &E.row[y];
+    char *line = malloc(row->size + (end - i) * len + 1);
+    int w = 0, r = 0, first = -1;
+    for (; i < end; i++) {
+      int to, from = span(row, M->at[i].x, &to);
+      if (first == -1)
+        first = from;
+      memcpy(&line[w], &row->line[r], from - r);
+      w += from - r;
+      memcpy(&line[w], s, len);
+      w += len;
+      M->at[i].x = w;
+      r = to;
+    }
+    memcpy(&line[w], &row->line[r], row->size - r);
+    w += row->size - r;
+    line[w] = '\0';
+    free(row->line);
+    row->line = line;
+    row->size = w;
+    row->editfrom = first;
+    updaterow(row);
+  }
+  E.dirty = true;
+  mcmerge();
+}
+
+// Moves every cursor with the key, in a line of its own
+void mcmove(int c) {
+  struct cursors *M = &E.multi;
+  for (int i = 0; i < M->n; i++) {
+    struct erow *row = &E.row[M->at[i].y];
+    int *x = &M->at[i].x;
+    if (c == ARROW_LEFT && *x > 0)
+      *x = prevcell(row, *x);
+    else if (c == ARROW_RIGHT && *x < row->size)
+      *x = nextcell(row, *x);
+    else if (c == HOME)
+      *x = 0;
+    else if (c == END)
+      *x = row->size;
+    else if (c == '^')
+      for (*x = 0; *x < row->size && isWhitespace(row->line[*x]);)
+        (*x)++;
+  }
+  M->coalesce = false;
+  mcmerge();
+}
+
+// Handles c at every cursor, returns false for keys that work on a single
+// cursor, which leave multi-cursor editing unless they save or quit
+bool multikey(int c) {
+  if (E.mode == 'i') {
+    switch (c) {
+    case '\x1b':
+    case CTRL_KEY('l'):
+      E.mode = 'n';
+      E.multi.coalesce = false;
+      mcmove(ARROW_LEFT);
+      if (E.multi.block)
+        mcclear();
+      return true;
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+      mcedit("", 0, spanback);
+      return true;
+    case DEL:
+      mcedit("", 0, spanforward);
+      return true;
+    case '\r':
+      setstatus("New lines are not split at several cursors");
+      return true;
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case HOME:
+    case END:
+      mcmove(c);
+      return true;
+    }
+    if (c == '\t' || (c >= ' ' && c < ARROW_LEFT && c != BACKSPACE)) {
+      char ch = c;
+      mcedit(&ch, 1, spanat);
+      return true;
+    }
+  } else {
+    switch (c) {
+    case '\x1b':
+      mcclear();
+      setstatus("");
+      return true;
+    case 'h':
+    case ARROW_LEFT:
+      mcmove(ARROW_LEFT);
+      return true;
+    case 'l':
+    case ARROW_RIGHT:
+      mcmove(ARROW_RIGHT);
+      return true;
+    case '0':
+    case HOME:
+      mcmove(HOME);
+      return true;
+    case '$':
+    case END:
+      mcmove(END);
+      return true;
+    case '^':
+      mcmove('^');
+      return true;
+    case 'i':
+      E.mode = 'i';
+      return true;
+    case 'a':
+      mcmove(ARROW_RIGHT);
+      E.mode = 'i';
+      return true;
+    case 'I':
+      mcmove('^');
+      E.mode = 'i';
+      return true;
+    case 'A':
+      mcmove(END);
+      E.mode = 'i';
+      return true;
+    case 'x':
+      mcedit("", 0, spanforward);
+      E.multi.coalesce = false;
+      return true;
+    case 'u':
+    case CTRL_KEY('z'):
+      applyUndo();
+      mcclamp();
+      return true;
+    case CTRL_KEY('r'):
+      applyRedo();
+      mcclamp();
+      return true;
+    }
+  }
+  if (c != CTRL_KEY('s') && c != CTRL_KEY('q'))
+    mcclear();
+  return false;
+}
+
+char *rowstostring(int *len) {
+  int total = 0;
+  for (int j = 0; j < E.numrows; j++)
+    total += E.row[j].size + 1;
+  *len = total;
+
+  char *buf = malloc(total);
+  char *p = buf;
+  for (int j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].line, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    ++p;
+  }
+
+  return buf;
+}
+
+// File watching
+// The directory of the file is watched with inotify and checked from readkey
+// while it waits for input. Growth that keeps the old bytes in place only
+// has the new tail loaded. Any other change is offered as a reload, which
+// diffs the file against the rows and only replaces the rows that differ
+
+// Remembers the file as the buffer last saw it, st_size bytes of it
+void diskstate(int fd, struct stat *st) {
+  E.disk.size = st->st_size;
+  E.disk.sec = st->st_mtim.tv_sec;
+  E.disk.nsec = st->st_mtim.tv_nsec;
+  E.disk.ino = st->st_ino;
+  E.disk.ntail = MIN((long long)sizeof(E.disk.tail), E.disk.size);
+  if (pread(fd, E.disk.tail, E.disk.ntail, E.disk.size - E.disk.ntail) !=
+      E.disk.ntail)
+    E.disk.ntail = 0;
+}
+
+void watchfile() {
+  // The size of a compressed file says nothing about its lines
+  if (E.decode.codec != CODEC_NONE)
+    return;
+  if (E.disk.watch != -1)
+    close(E.disk.watch);
+  E.disk.watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.disk.watch == -1)
+    return;
+  char dir[PATH_MAX];
+  char *slash = strrchr(E.filename, '/');
+  snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - E.filename) + 1 : 1,
+           slash ? E.filename : ".");
+  if (inotify_add_watch(E.disk.watch, dir,
+                        IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                            IN_CREATE) == -1) {
+    close(E.disk.watch);
+    E.disk.watch = -1;
+  }
+}
+
+// Drops the first n rows in one go, follow mode's bound on memory
+void followtrim(int n) {
+  for (int i = 0; i < n; i++) {
+    editorFreeRow(&E.row[i]);
+    foldshift(0, -1);
+  }
+  markshift(0, -n);
+  E.numrows -= n;
+  memmove(&E.row[0], &E.row[n], sizeof(struct erow) * E.numrows);
+  for (int i = 0; i < E.numrows; i++)
+    E.row[i].idx = i;
+  wrapInvalidate();
+  E.brackets.valid = false;
+  E.cy = MAX(E.cy - n, 0);
+  E.rowoff = MAX(E.rowoff - n, 0);
+  if (E.syntax) {
+    // The new first row starts outside of any comment
+    updateSyntax(&E.row[0]);
+    updatebrackets(&E.row[0], 0);
+  }
+}
+
+// Adds the lines from p to end after the rows, the first one continuing the
+// last row if that is partial. Returns whether the last line is partial
+bool appendlines(char *p, char *end, bool partial) {
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    int len = (nl ? nl : end) - p;
+    if (nl && len > 0 && p[len - 1] == '\r')
+      len--;
+    if (len > LARGE_LINE_LENGTH)
+      largemode();
+    if (partial && E.numrows)
+      rowinsertstring(&E.row[E.numrows - 1], p, len);
+    else
+      editorInsertRow(E.numrows, p, len);
+    partial = !nl;
+    p = nl ? nl + 1 : end;
+  }
+  return partial;
+}
+
+// Loads the bytes appended to the file since it was last read, like tail -f
+void diskappend(int fd, struct stat *st) {
+  long long from = E.disk.size;
+  long long want = MIN(st->st_size - from, DISK_READ_CHUNK);
+  char *buf = malloc(want);
+  ssize_t n = pread(fd, buf, want, from);
+  if (n <= 0) {
+    free(buf);
+    return;
+  }
+  E.disk.behind = from + n < st->st_size;
+  // Rows loaded from disk are only journaled on top of unsaved edits
+  bool dirty = E.dirty, on = E.swap.on;
+  E.swap.on = on && dirty;
+  bool pinned = E.follow && E.cy >= E.numrows - 1;
+  // A last line still missing its newline is continued. Without its bytes,
+  // only the single empty row of a new buffer is
+  bool partial = E.disk.ntail ? E.disk.tail[E.disk.ntail - 1] != '\n'
+                              : E.numrows == 1 && E.row[0].size == 0;
+  appendlines(buf, buf + n, partial);
+  free(buf);
+  E.swap.on = on;
+  E.dirty = dirty;
+  if (!dirty)
+    swapbase(fd);
+  st->st_size = from + n;
+  diskstate(fd, st);
+  if (E.follow) {
+    if (E.numrows > FOLLOW_LINES)
+      followtrim(E.numrows - FOLLOW_LINES);
+    if (pinned) {
+      E.cy = E.numrows - 1;
+      E.cx = 0;
+    }
+  }
+}
+
+#define RELOAD_MAX_EDITS 512
+
+struct rowedit {
+  int x; // row deleted, or the one the line goes in front of
+  int y; // line inserted, -1 for a delete
+};
+
+bool rowis(int x, char **s, int *len, int y) {
+  return E.row[x].size == len[y] && !memcmp(E.row[x].line, s[y], len[y]);
+}
+
+// Shortest edit script in order turning rows [a, a + n) into lines
+// [b, b + m), found with Myers' greedy algorithm. Past RELOAD_MAX_EDITS edits
+// all the rows are replaced
+struct rowedit *rowdiff(int a, int n, char **s, int *len, int b, int m,
+                        int *count) {
+  int max = MIN(n + m, RELOAD_MAX_EDITS);
+  int w = 2 * max + 3, off = max + 1;
+  int *v = calloc(w, sizeof(int));
+  int *trace = NULL;
+  int d, found = -1;
+  for (d = 0; d <= max && found < 0; d++) {
+    trace = realloc(trace, sizeof(int) * w * (d + 1));
+    memcpy(&trace[d * w], v, sizeof(int) * w);
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+                  ? v[off + k + 1]
+                  : v[off + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && rowis(a + x, s, len, b + y))
+        x++, y++;
+      v[off + k] = x;
+      if (x >= n && y >= m) {
+        found = d;
+        break;
+      }
+    }
+  }
+  free(v);
+
+  struct rowedit *ed = malloc(sizeof(*ed) * (n + m + 1));
+  *count = 0;
+  if (found < 0) {
+    for (int x = 0; x < n; x++)
+      ed[(*count)++] = (struct rowedit){a + x, -1};
+    for (int y = 0; y < m; y++)
+      ed[(*count)++] = (struct rowedit){a + n, b + y};
+    free(trace);
+    return ed;
+  }
+  // Walk back from the end, each step down is an insert, right a delete
+  int x = n, y = m;
+  for (d = found; d > 0; d--) {
+    int *pv = &trace[d * w];
+    int k = x - y;
+    bool down = k == -d || (k != d && pv[off + k - 1] < pv[off + k + 1]);
+    int pk = down ? k + 1 : k - 1;
+    int px = pv[off + pk], py = px - pk;
+    if (down)
+      ed[(*count)++] = (struct rowedit){a + px, b + py};
+    else
+      ed[(*count)++] = (struct rowedit){a + px, -1};
+    x = px;
+    y = py;
+  }
+  free(trace);
+  for (int i = 0; i < *count / 2; i++) {
+    struct rowedit t = ed[i];
+    ed[i] = ed[*count - 1 - i];
+    ed[*count - 1 - i] = t;
+  }
+  return ed;
+}
+
+// Builds the new row array in one pass, moving the rows the edits keep
+void applyrowedits(struct rowedit *ed, int count, char **s, int *len) {
+  int total = E.numrows;
+  for (int i = 0; i < count; i++)
+    total += ed[i].y < 0 ? -1 : 1;
+  struct erow *rows = malloc(sizeof(struct erow) * MAX(total, 1));
+  int *touched = malloc(sizeof(int) * (count + 1)); // rows to render again
+  int ntouched = 0, out = 0, x = 0, cy = -1;
+  for (int i = 0; i <= count; i++) {
+    int to = i < count ? ed[i].x : E.numrows;
+    for (; x < to; x++) {
+      if (x == E.cy)
+        cy = out;
+      rows[out++] = E.row[x];
+    }
+    if (i == count)
+      break;
+    if (ed[i].y < 0) {
+      if (x == E.cy)
+        cy = out;
+      editorFreeRow(&E.row[x++]);
+      foldshift(out, -1);
+      markshift(out, -1);
+      if (!ntouched || touched[ntouched - 1] != out)
+        touched[ntouched++] = out;
+    } else {
+      rowinit(&rows[out], out, s[ed[i].y], len[ed[i].y]);
+      foldshift(out, 1);
+      markshift(out, 1);
+      if (ntouched && touched[ntouched - 1] == out)
+        ntouched--;
+      touched[ntouched++] = out++;
+    }
+  }
+  free(E.row);
+  E.row = rows;
+  E.rowcap = MAX(total, 1);
+  E.numrows = out;
+  for (int i = 0; i < out; i++)
+    E.row[i].idx = i;
+  wrapInvalidate();
+  E.brackets.valid = false;
+  // Bottom up, so a row's syntax never runs on into one not rendered yet
+  for (int i = ntouched - 1; i >= 0; i--) {
+    int y = touched[i];
+    if (y >= out)
+      continue;
+    if (E.row[y].render == NULL) {
+      updaterow(&E.row[y]);
+    } else if (E.syntax) {
+      // The row after deleted ones starts in another state
+      updateSyntax(&E.row[y]);
+      updatebrackets(&E.row[y], 0);
+    }
+  }
+  free(touched);
+  E.cy = cy < 0 || cy >= out ? out - 1 : cy;
+  E.cx = cellstart(&E.row[E.cy], MIN(E.cx, E.row[E.cy].size));
+}
+
+// Makes the buffer match the file, keeping the rows it has in common
+void diskreload(int fd, struct stat *st) {
+  char *buf = malloc(st->st_size + 1);
+  ssize_t n = pread(fd, buf, st->st_size, 0);
+  if (n < 0) {
+    free(buf);
+    setstatus("Reload failed: %s", strerror(errno));
+    return;
+  }
+  int cap = 64, m = 0;
+  char **s = malloc(sizeof(*s) * cap);
+  int *len = malloc(sizeof(*len) * cap);
+  for (char *p = buf, *end = buf + n; p < end;) {
+    char *nl = memchr(p, '\n', end - p);
+    char *e = nl ? nl : end;
+    if (m == cap) {
+      cap *= 2;
+      s = realloc(s, sizeof(*s) * cap);
+      len = realloc(len, sizeof(*len) * cap);
+    }
+    s[m] = p;
+    len[m] = e - p;
+    while (len[m] > 0 && p[len[m] - 1] == '\r')
+      len[m]--;
+    m++;
+    p = nl ? nl + 1 : end;
+  }
+  if (m == 0) {
+    s[0] = buf;
+    len[m++] = 0;
+  }
+
+  int pre = 0, suf = 0;
+  while (pre < E.numrows && pre < m && rowis(pre, s, len, pre))
+    pre++;
+  while (suf < E.numrows - pre && suf < m - pre &&
+         rowis(E.numrows - 1 - suf, s, len, m - 1 - suf))
+    suf++;
+  int count;
+  struct rowedit *ed =
+      rowdiff(pre, E.numrows - pre - suf, s, len, pre, m - pre - suf, &count);
+  bool on = E.swap.on;
+  swapdiscard();
+  E.swap.on = false;
+  applyrowedits(ed, count, s, len);
+  E.swap.on = on;
+  // The steps name rows by index, which the reload has moved
+  historyfree();
+  free(s);
+  free(len);
+  free(buf);
+
+  E.dirty = false;
+  swapbase(fd);
+  st->st_size = n;
+  diskstate(fd, st);
+  int added = 0;
+  for (int i = 0; i < count; i++)
+    added += ed[i].y >= 0;
+  setstatus("Reloaded %s: %d rows removed, %d added, undo history cleared",
+            E.filename, count - added, added);
+  free(ed);
+}
+
+// Checks the file after an event in its directory, closed says a writer is
+// done with it
+void diskchanged(bool closed) {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      (st.st_size == E.disk.size && st.st_mtim.tv_sec == E.disk.sec &&
+       st.st_mtim.tv_nsec == E.disk.nsec &&
+       (long long)st.st_ino == E.disk.ino)) {
+    close(fd);
+    return;
+  }
+  char tail[sizeof(E.disk.tail)];
+  bool grown = (long long)st.st_ino == E.disk.ino && st.st_size > E.disk.size &&
+               pread(fd, tail, E.disk.ntail, E.disk.size - E.disk.ntail) ==
+                   E.disk.ntail &&
+               !memcmp(tail, E.disk.tail, E.disk.ntail);
+  if (grown) {
+    diskappend(fd, &st);
+  } else if (E.follow) {
+    // Truncated or replaced, what it holds now is new output
+    E.disk.size = 0;
+    E.disk.ntail = 0;
+    diskappend(fd, &st);
+    setstatus("%s was truncated or replaced, following it from the start",
+              E.filename);
+  } else if (closed) {
+    setstatus("%s changed on disk, reload it%s? (y/n)", E.filename,
+              E.dirty ? " and lose unsaved changes" : "");
+    clearscreen();
+    int c = readkey();
+    if (c == 'y' || c == 'Y') {
+      diskreload(fd, &st);
+    } else {
+      // Not asked again until the next change, the buffer now differs
+      diskstate(fd, &st);
+      E.dirty = true;
+      setstatus("Kept the buffer, it no longer matches the file");
+    }
+  }
+  close(fd);
+}
+
+// Opens a file in follow mode, loading no more than its last FOLLOW_LINES
+// lines
+void followopen(char *filename) {
+  E.follow = true;
+  E.mode = 'n';
+  E.swap.on = false;
+  free(E.filename);
+  E.filename = strdup(filename);
+  selectHL();
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open");
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    die("fstat");
+
+  char buf[65536];
+  long long from = st.st_size;
+  int lines = 0;
+  while (from > 0 && lines <= FOLLOW_LINES) {
+    int n = MIN((long long)sizeof(buf), from);
+    if (pread(fd, buf, n, from - n) != n)
+      die("pread");
+    int i = n - 1;
+    while (i >= 0 && (buf[i] != '\n' || ++lines <= FOLLOW_LINES))
+      i--;
+    from -= n - (i + 1);
+  }
+
+  editorInsertRow(0, "", 0);
+  E.disk.size = from;
+  E.disk.ntail = 0;
+  E.disk.ino = st.st_ino;
+  diskappend(fd, &st);
+  close(fd);
+  E.cy = E.numrows - 1;
+  E.dirty = false;
+  watchfile();
+}
+
+// Keys that only look, the ones follow and view mode let through
+bool viewkey(int c) {
+  return (c > 0 && c < 128 &&
+          strchr("hjklwWbBeE0$fFtT^%HMLzgG/123456789", c)) ||
+         c == ARROW_LEFT || c == ARROW_RIGHT || c == ARROW_UP ||
+         c == ARROW_DOWN || c == MOUSE_EVENT || c == CTRL_KEY('q') ||
+         c == CTRL_KEY('e') || c == CTRL_KEY('y') || c == CTRL_KEY('b') ||
+         c == CTRL_KEY('f') || c == CTRL_KEY('d') || c == CTRL_KEY('u');
+}
+
+// Maps the part of the file from off on, at least need bytes of it where the
+// file has them, returns it and how much of it is mapped
+char *pagerspan(long long off, long long need, long long *avail) {
+  struct pager *P = &E.pager;
+  need = MIN(need, P->size - off);
+  if (off < P->mapoff || off + MAX(need, 1) > P->mapoff + P->maplen) {
+    if (P->map)
+      munmap(P->map, P->maplen);
+    long long page = sysconf(_SC_PAGESIZE);
+    P->mapoff = off / page * page;
+    P->maplen = MIN(PAGER_MAP, P->size - P->mapoff);
+    P->map = mmap(NULL, P->maplen, PROT_READ, MAP_PRIVATE, P->fd, P->mapoff);
+    if (P->map == MAP_FAILED)
+      die("mmap");
+  }
+  *avail = P->mapoff + P->maplen - off;
+  return P->map + (off - P->mapoff);
+}
+
+char *pagerat(long long off, long long *avail) {
+  return pagerspan(off, 1, avail);
+}
+
+// Counts lines until line is indexed and the one holding off is known
+void pagerscan(long long line, long long off) {
+  struct pager *P = &E.pager;
+  while (P->scanned < P->size && (P->lines < line || P->scanned <= off)) {
+    long long avail;
+    char *p = pagerat(P->scanned, &avail);
+    char *nl = memchr(p, '\n', avail);
+    if (!nl) {
+      P->scanned += avail;
+      continue;
+    }
+    P->scanned += nl - p + 1;
+    P->linestart = P->scanned;
+    if (++P->lines % PAGER_STEP)
+      continue;
+    if (P->nindex == P->indexcap) {
+      P->indexcap *= 2;
+      P->index = realloc(P->index, sizeof(long long) * P->indexcap);
+    }
+    P->index[P->nindex++] = P->scanned;
+  }
+}
+
+// Whether the number of lines in the file is known, from scanning it or
+// having its end loaded
+bool pagercounted() {
+  struct pager *P = &E.pager;
+  return P->scanned == P->size || P->end == P->size;
+}
+
+// Lines in the file, or as many as are known to be there
+long long pagerlines() {
+  struct pager *P = &E.pager;
+  if (P->end == P->size)
+    return P->base + E.numrows;
+  if (P->scanned < P->size)
+    return MAX(P->lines, P->base + E.numrows);
+  return P->lines + (P->linestart < P->size || P->lines == 0);
+}
+
+// Where line starts, after clamping it to the last line
+long long pagerline(long long *line) {
+  struct pager *P = &E.pager;
+  pagerscan(*line, -1);
+  *line = MAX(MIN(*line, pagerlines() - 1), 0);
+  long long off = P->index[*line / PAGER_STEP], avail;
+  for (long long n = *line % PAGER_STEP; n > 0;) {
+    char *p = pagerat(off, &avail);
+    char *nl = memchr(p, '\n', avail);
+    off += nl ? nl - p + 1 : avail;
+    n -= nl != NULL;
+  }
+  return off;
+}
+
+// The line holding off
+long long pagerlineof(long long off) {
+  struct pager *P = &E.pager;
+  pagerscan(0, off);
+  int k = P->nindex - 1;
+  while (P->index[k] > off)
+    k--;
+  long long line = (long long)k * PAGER_STEP, at = P->index[k], avail;
+  while (at < off) {
+    char *p = pagerat(at, &avail);
+    char *nl = memchr(p, '\n', MIN(avail, off - at));
+    at += nl ? nl - p + 1 : MIN(avail, off - at);
+    line += nl != NULL;
+  }
+  return line;
+}
+
+// Adds the line at off as the last row, returns where the next one starts
+long long pagerrow(long long off) {
+  struct pager *P = &E.pager;
+  long long end = off, avail;
+  char *nl = NULL;
+  while (end < P->size && !nl) {
+    char *p = pagerat(end, &avail);
+    nl = memchr(p, '\n', avail);
+    end += nl ? nl - p : avail;
+  }
+  long long len = MIN(end - off, PAGER_LINE_MAX);
+  char *buf = malloc(len + 1);
+  for (long long i = 0; i < len;) {
+    char *p = pagerat(off + i, &avail);
+    long long n = MIN(avail, len - i);
+    memcpy(buf + i, p, n);
+    i += n;
+  }
+  if (len == end - off && len > 0 && buf[len - 1] == '\r')
+    len--;
+  editorInsertRow(E.numrows, buf, len);
+  free(buf);
+  return nl ? end + 1 : end;
+}
+
+// Rows kept around the cursor
+int pagerwindow() { return MAX(6 * E.rows, 256); }
+
+// Replaces the rows with the window starting at line. Marks keep their
+// lines, rows outside the window included, and folds are kept only while
+// the new window holds all of their rows
+void pagerseek(long long line) {
+  struct pager *P = &E.pager;
+  struct fold *folds = E.folds;
+  struct mark *marks = E.marks.root;
+  long long oldbase = P->base;
+  E.folds = NULL;
+  E.marks.root = NULL;
+  for (int i = 0; i < E.numrows; i++)
+    editorFreeRow(&E.row[i]);
+  E.numrows = 0;
+  P->end = -1;
+  long long off = pagerline(&line);
+  P->base = line;
+  for (int i = 0; i < pagerwindow() && (off < P->size || i == 0); i++)
+    off = pagerrow(off);
+  P->end = off;
+  foldapply(folds, oldbase - P->base);
+  foldclip(folds);
+  markapply(marks, oldbase - P->base);
+  markroot(marks);
+  E.dirty = false;
+  E.wrap.toprow = -1;
+  wrapInvalidate();
+  E.brackets.valid = false;
+}
+
+// Moves the cursor to line, col and the window around them
+void pagergoto(long long line, int col) {
+  struct pager *P = &E.pager;
+  pagerseek(MAX(line - pagerwindow() / 2, 0));
+  E.cy = MIN(line - P->base, E.numrows - 1);
+  E.cx = MIN(col, E.row[E.cy].size);
+  E.rowoff = MAX(E.cy - E.rows / 2, 0);
+}
+
+// Reloads the window around the cursor once it comes within a screen of an
+// edge the file goes on past
+void pagerfit() {
+  struct pager *P = &E.pager;
+  int top = MIN(E.cy, E.rowoff), bottom = MAX(E.cy, E.rowoff + E.rows);
+  if (!(top < E.rows && P->base > 0) &&
+      !(bottom >= E.numrows - E.rows && P->end < P->size))
+    return;
+  long long cy = P->base + E.cy, rowoff = P->base + E.rowoff;
+  pagerseek(MAX(cy - pagerwindow() / 2, 0));
+  E.cy = MIN(cy - P->base, E.numrows - 1);
+  E.rowoff = MIN(MAX(rowoff - P->base, 0), E.cy);
+}
+
+// Where the next match of query starts, searching forward from off or back
+// from before it. -1 if there is none
+long long pagerfind(const char *query, long long off, int dir) {
+  struct pager *P = &E.pager;
+  long long qlen = strlen(query), avail;
+  if (dir > 0) {
+    while (off < P->size) {
+      // A match across the end of the map is mapped whole from its start
+      char *p = pagerspan(off, qlen, &avail);
+      char *hit = memmem(p, avail, query, qlen);
+      if (hit)
+        return off + (hit - p);
+      if (off + avail >= P->size)
+        break;
+      off += MAX(avail - qlen + 1, 1);
+    }
+    return -1;
+  }
+  // Half a map back at a time
+  while (off > 0) {
+    long long lo = MAX(off - PAGER_MAP / 2, 0);
+    char *p = pagerspan(lo, off - lo + qlen - 1, &avail);
+    long long n = MIN(avail, off - lo + qlen - 1);
+    char *hit = NULL, *at = p;
+    while ((at = memmem(at, n - (at - p), query, qlen)) && at - p < off - lo)
+      hit = at++;
+    if (hit)
+      return lo + (hit - p);
+    off = lo;
+  }
+  return -1;
+}
+
+void pagersearch(int dir) {
+  struct pager *P = &E.pager;
+  if (!P->query)
+    return;
+  long long line = P->base + E.cy;
+  long long at = pagerline(&line) + MIN(E.cx, E.row[E.cy].size);
+  long long hit = pagerfind(P->query, dir > 0 ? at + 1 : at, dir);
+  if (hit == -1) {
+    setstatus("Not found: %s", P->query);
+    return;
+  }
+  line = pagerlineof(hit);
+  pagergoto(line, hit - pagerline(&line));
+}
+
+// Keys that move through the whole file rather than the rows loaded,
+// returns whether c was one of them
+bool pagerkey(int c) {
+  struct pager *P = &E.pager;
+  switch (c) {
+  case 'g':
+    c = readkey();
+    if (c != 'g') {
+      if (viewkey(c))
+        processmotion(c);
+      return true;
+    }
+    pagergoto(0, 0);
+    return true;
+  case 'G':
+    pagerscan(LLONG_MAX, LLONG_MAX);
+    pagergoto(pagerlines() - 1, 0);
+    return true;
+  case '/': {
+    char *query = editorprompt("Search: %s (Esc to cancel)", NULL);
+    if (query) {
+      free(P->query);
+      P->query = query;
+      pagersearch(1);
+    }
+    return true;
+  }
+  case 'n':
+  case 'N':
+    pagersearch(c == 'n' ? 1 : -1);
+    return true;
+  }
+  return false;
+}
+
+// Opens a file read only, holding no more of it than the rows around the
+// cursor
+void pageropen(char *filename) {
+  struct pager *P = &E.pager;
+  E.mode = 'n';
+  E.swap.on = false;
+  free(E.filename);
+  E.filename = strdup(filename);
+  selectHL();
+  P->fd = open(filename, O_RDONLY);
+  if (P->fd == -1)
+    die("open");
+  struct stat st;
+  if (fstat(P->fd, &st) == -1)
+    die("fstat");
+  P->size = st.st_size;
+  P->indexcap = 64;
+  P->index = malloc(sizeof(long long) * P->indexcap);
+  P->index[P->nindex++] = 0;
+  pagerseek(0);
+}
+
+// Hex view
+// Binary files, and any file opened with -x, are shown as offset, hex and
+// text columns read straight from an mmap of the whole file, so even huge
+// ones open at once. Edited bytes are kept in a hash over the mapping, and
+// saving writes back only the pages holding one
+
+// A NUL in the first 8 KiB makes a file binary
+bool isbinary(int fd) {
+  char buf[8192];
+  ssize_t n = pread(fd, buf, sizeof(buf), 0);
+  return n > 0 && memchr(buf, '\0', n);
+}
+
+unsigned hexhash(long long off) {
+  return (unsigned)(off ^ (off >> 32)) * 2654435761u & E.hex.mask;
+}
+
+struct hexbyte *hexslot(long long off) {
+  struct hexview *H = &E.hex;
+  unsigned h = hexhash(off);
+  while (H->edits[h].off != -1 && H->edits[h].off != off)
+    h = (h + 1) & H->mask;
+  return &H->edits[h];
+}
+
+// The byte at off as edited
+unsigned char hexat(long long off) {
+  struct hexbyte *b = hexslot(off);
+  return b->off == off ? b->val : E.hex.map[off];
+}
+
+bool hexedited(long long off) { return hexslot(off)->off == off; }
+
+void hexclear(unsigned cap) {
+  struct hexview *H = &E.hex;
+  free(H->edits);
+  H->edits = malloc(sizeof(struct hexbyte) * cap);
+  for (unsigned i = 0; i < cap; i++)
+    H->edits[i].off = -1;
+  H->mask = cap - 1;
+  H->nedits = 0;
+}
+
+// Empties slot b, moving back the entries after it in its probe run that
+// would no longer be found past the gap
+void hexunset(struct hexbyte *b) {
+  struct hexview *H = &E.hex;
+  if (b->off == -1)
+    return;
+  unsigned i = b - H->edits;
+  for (unsigned j = (i + 1) & H->mask; H->edits[j].off != -1;
+       j = (j + 1) & H->mask) {
+    unsigned h = hexhash(H->edits[j].off);
+    // Entries whose home lies cyclically in (i, j] stay put
+    if (i <= j ? (h <= i || h > j) : (h <= i && h > j)) {
+      H->edits[i] = H->edits[j];
+      i = j;
+    }
+  }
+  H->edits[i].off = -1;
+  H->nedits--;
+}
+
+void hexset(long long off, unsigned char val) {
+  struct hexview *H = &E.hex;
+  if (H->nundo == H->undocap) {
+    H->undocap = MAX(64, H->undocap * 2);
+    H->undo = realloc(H->undo, sizeof(struct hexbyte) * H->undocap);
+  }
+  H->undo[H->nundo++] = (struct hexbyte){off, hexat(off)};
+  // Kept at most half full
+  if (2 * (H->nedits + 1) > (int)H->mask + 1) {
+    struct hexbyte *old = H->edits;
+    unsigned cap = H->mask + 1;
+    H->edits = NULL;
+    hexclear(cap * 2);
+    for (unsigned i = 0; i < cap; i++)
+      if (old[i].off != -1) {
+        *hexslot(old[i].off) = old[i];
+        H->nedits++;
+      }
+    free(old);
+  }
+  struct hexbyte *b = hexslot(off);
+  if (val == H->map[off]) {
+    // Back to what the file holds, so no longer an edit
+    hexunset(b);
+  } else {
+    if (b->off == -1)
+      H->nedits++;
+    *b = (struct hexbyte){off, val};
+  }
+  E.dirty = H->nedits > 0;
+}
+
+void hexundo() {
+  struct hexview *H = &E.hex;
+  if (!H->nundo)
+    return;
+  struct hexbyte u = H->undo[--H->nundo];
+  hexset(u.off, u.val);
+  H->nundo--;
+  H->cur = u.off;
+  H->low = false;
+}
+
+int hexcmp(const void *a, const void *b) {
+  long long x = ((const struct hexbyte *)a)->off;
+  long long y = ((const struct hexbyte *)b)->off;
+  return (x > y) - (x < y);
+}
+
+// Writes the pages holding edited bytes back into the file
+void hexsave() {
+  struct hexview *H = &E.hex;
+  if (H->readonly) {
+    setstatus("%s is read only", E.filename);
+    return;
+  }
+  struct hexbyte *list = malloc(sizeof(struct hexbyte) * MAX(H->nedits, 1));
+  int n = 0;
+  for (unsigned i = 0; i <= H->mask; i++)
+    if (H->edits[i].off != -1)
+      list[n++] = H->edits[i];
+  qsort(list, n, sizeof(struct hexbyte), hexcmp);
+
+  long long page = sysconf(_SC_PAGESIZE);
+  unsigned char *buf = malloc(page);
+  int pages = 0;
+  for (int i = 0; i < n;) {
+    long long from = list[i].off / page * page;
+    long long len = MIN(page, H->size - from);
+    memcpy(buf, H->map + from, len);
+    for (; i < n && list[i].off < from + len; i++)
+      buf[list[i].off - from] = list[i].val;
+    if (pwrite(H->fd, buf, len, from) != len) {
+      setstatus("I/O error: %s", strerror(errno));
+      free(buf);
+      free(list);
+      return;
+    }
+    pages++;
+  }
+  free(buf);
+  free(list);
+  hexclear(H->mask + 1);
+  E.dirty = false;
+  setstatus("%d bytes written in %d pages", n, pages);
+}
+
+void hexopen(char *filename) {
+  struct hexview *H = &E.hex;
+  H->on = true;
+  E.mode = 'n';
+  E.swap.on = false;
+  free(E.filename);
+  E.filename = strdup(filename);
+  H->fd = open(filename, O_RDWR);
+  if (H->fd == -1) {
+    H->readonly = true;
+    H->fd = open(filename, O_RDONLY);
+  }
+  if (H->fd == -1)
+    die("open");
+  struct stat st;
+  if (fstat(H->fd, &st) == -1)
+    die("fstat");
+  H->size = st.st_size;
+  if (H->size > 0) {
+    H->map = mmap(NULL, H->size, PROT_READ, MAP_SHARED, H->fd, 0);
+    if (H->map == MAP_FAILED)
+      die("mmap");
+  }
+  hexclear(64);
+}
+
+// Moves the cursor by delta bytes, staying inside the file
+void hexmove(long long delta) {
+  struct hexview *H = &E.hex;
+  H->cur = MAX(MIN(H->cur + delta, H->size - 1), 0);
+  H->low = false;
+}
+
+void hexsearch(int dir) {
+  struct hexview *H = &E.hex;
+  if (!H->query || !H->size)
+    return;
+  size_t qlen = strlen(H->query);
+  unsigned char *hit = NULL;
+  if (dir > 0) {
+    long long from = MIN(H->cur + 1, H->size);
+    hit = memmem(H->map + from, H->size - from, H->query, qlen);
+  } else {
+    unsigned char *at = H->map, *end = H->map + H->cur;
+    while (at < end && (at = memmem(at, H->size - (at - H->map), H->query,
+                                    qlen)) && at < end)
+      hit = at++;
+  }
+  if (!hit) {
+    setstatus("Not found: %s", H->query);
+    return;
+  }
+  H->cur = hit - H->map;
+  H->low = false;
+}
+
+// Types c over the byte under the cursor, a nibble at a time in the hex
+// column
+void hextype(int c) {
+  struct hexview *H = &E.hex;
+  if (H->readonly) {
+    setstatus("%s is read only", E.filename);
+    return;
+  }
+  if (!H->size)
+    return;
+  if (H->ascii) {
+    if (c < ' ' || c > '~')
+      return;
+    hexset(H->cur, c);
+    hexmove(1);
+    return;
+  }
+  if (!isxdigit(c))
+    return;
+  int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+  unsigned char b = hexat(H->cur);
+  b = H->low ? (b & 0xf0) | v : (b & 0x0f) | v << 4;
+  hexset(H->cur, b);
+  if (H->low)
+    hexmove(1);
+  else
+    H->low = true;
+}
+
+void hexkey(int c) {
+  struct hexview *H = &E.hex;
+  if (H->replacing && c != '\x1b' && c != '\t' && c < 128 &&
+      !iscntrl(c)) {
+    hextype(c);
+    return;
+  }
+  switch (c) {
+  case '\x1b':
+    H->replacing = false;
+    H->low = false;
+    break;
+  case 'i':
+  case 'R':
+    H->replacing = !H->readonly;
+    if (H->readonly)
+      setstatus("%s is read only", E.filename);
+    break;
+  case '\t':
+    H->ascii = !H->ascii;
+    H->low = false;
+    break;
+  case 'h':
+  case ARROW_LEFT:
+    hexmove(-1);
+    break;
+  case 'l':
+  case ARROW_RIGHT:
+    hexmove(1);
+    break;
+  case 'k':
+  case ARROW_UP:
+    hexmove(-HEX_WIDTH);
+    break;
+  case 'j':
+  case ARROW_DOWN:
+    if (H->cur + HEX_WIDTH < H->size)
+      hexmove(HEX_WIDTH);
+    break;
+  case '0':
+  case HOME:
+    hexmove(-(H->cur % HEX_WIDTH));
+    break;
+  case '$':
+  case END:
+    hexmove(HEX_WIDTH - 1 - H->cur % HEX_WIDTH);
+    break;
+  case CTRL_KEY('d'):
+    hexmove((long long)HEX_WIDTH * (E.rows / 2));
+    break;
+  case CTRL_KEY('u'):
+    hexmove(-(long long)HEX_WIDTH * (E.rows / 2));
+    break;
+  case CTRL_KEY('f'):
+  case PG_DN:
+    hexmove((long long)HEX_WIDTH * E.rows);
+    break;
+  case CTRL_KEY('b'):
+  case PG_UP:
+    hexmove(-(long long)HEX_WIDTH * E.rows);
+    break;
+  case 'g':
+    if (readkey() == 'g')
+      hexmove(-H->cur);
+    break;
+  case 'G':
+    hexmove(H->size);
+    break;
+  case 'u':
+    hexundo();
+    break;
+  case '/': {
+    char *query = editorprompt("Search: %s (Esc to cancel)", NULL);
+    if (query) {
+      free(H->query);
+      H->query = query;
+      hexsearch(1);
+    }
+    break;
   }
-  int tabs = spaces / TAB_LENGTH;
-
-  if (E.syntax && row->render && row->rsize > 0) {
-    char *Is = E.syntax->IndentStart;
-    char *Ie = E.syntax->IndentEnd;
-    int IsLen = Is ? strlen(Is) : 0;
-    int IeLen = Ie ? strlen(Ie) : 0;
+  case 'n':
+  case 'N':
+    hexsearch(c == 'n' ? 1 : -1);
+    break;
+  case CTRL_KEY('s'):
+    hexsave();
+    break;
+  }
+}
 
-    if (IsLen > 0) {
-      for (int j = i; j <= row->rsize - IsLen; j++) {
-        if (!strncmp(&row->render[j], Is, IsLen)) {
-          tabs++;
-          break;
-        }
-      }
-    }
-    if (IeLen > 0) {
-      for (int j = i; j <= row->rsize - IeLen; j++) {
-        if (!strncmp(&row->render[j], Ie, IeLen)) {
-          tabs--;
-          break;
-        }
+void watchtick() {
+  static bool busy; // the reload prompt reads keys through here
+  if (E.disk.watch == -1 || busy)
+    return;
+  _Alignas(struct inotify_event) char buf[4096];
+  char *slash = strrchr(E.filename, '/');
+  const char *name = slash ? slash + 1 : E.filename;
+  bool hit = false, closed = false;
+  ssize_t n;
+  while ((n = read(E.disk.watch, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len && !strcmp(ev->name, name)) {
+        hit = true;
+        closed |= !(ev->mask & IN_MODIFY);
       }
+      p += sizeof(struct inotify_event) + ev->len;
     }
   }
+  if (!hit && !E.disk.behind)
+    return;
+  busy = true;
+  diskchanged(closed);
+  busy = false;
+  clearscreen();
+}
 
-  if (tabs < 0)
-    tabs = 0;
+// Compressed files
+// Files starting with the gzip or zstd magic are decoded on a thread, and
+// the editor opens as soon as the first screen of them is there. The rest
+// is handed over from readkey while it waits for input, like file changes
+// are, and saving compresses the rows with the same codec again. Each codec
+// is only there when the build found its library
+
+enum codec codecof(int fd) {
+  unsigned char magic[4];
+  if (pread(fd, magic, 4, 0) != 4)
+    return CODEC_NONE;
+  if (magic[0] == 0x1f && magic[1] == 0x8b)
+    return CODEC_GZIP;
+  if (!memcmp(magic, "\x28\xb5\x2f\xfd", 4))
+    return CODEC_ZSTD;
+  return CODEC_NONE;
+}
 
-  editorInsertRow(E.cy + 1, &row->line[E.cx], row->size - E.cx);
-  row = &E.row[E.cy];
+// Called from the decoding thread, returns false once the file is too large
+// to load
+bool decodeput(struct decoder *d, const char *s, size_t n) {
+  pthread_mutex_lock(&d->lock);
+  d->total += n;
+  d->cut = d->total > VIEW_FILE_SIZE;
+  if (d->cut) {
+    pthread_mutex_unlock(&d->lock);
+    return false;
+  }
+  if (d->len + n > d->cap) {
+    d->cap = MAX(d->cap * 2, d->len + n);
+    d->buf = realloc(d->buf, d->cap);
+  }
+  memcpy(d->buf + d->len, s, n);
+  d->len += n;
+  pthread_cond_signal(&d->more);
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
 
-  size_t new_size = E.cx;
-  char *new_line = realloc(row->line, new_size + 1);
-  if (!new_line)
-    kill("realloc");
-  row->line = new_line;
-  row->size = new_size;
-  row->line[row->size] = '\0';
-  updaterow(row);
+#ifdef HAVE_ZLIB
+const char *decodegzip(struct decoder *d) {
+  unsigned char in[DECODE_CHUNK], out[DECODE_CHUNK];
+  z_stream zs = {0};
+  if (inflateInit2(&zs, 15 + 16) != Z_OK)
+    return "zlib failed to start";
+  const char *error = NULL;
+  bool ended = false;
+  ssize_t n;
+  while (!error && (n = read(d->fd, in, sizeof(in))) > 0) {
+    zs.next_in = in;
+    zs.avail_in = n;
+    do {
+      zs.next_out = out;
+      zs.avail_out = sizeof(out);
+      int ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        error = zs.msg ? zs.msg : "corrupt gzip data";
+        break;
+      }
+      if (!decodeput(d, (char *)out, sizeof(out) - zs.avail_out)) {
+        error = "larger than VIEW_FILE_SIZE, only its start is loaded";
+        break;
+      }
+      // Concatenated gzip members are read as one file
+      ended = ret == Z_STREAM_END;
+      if (ended)
+        inflateReset(&zs);
+      if (ret == Z_BUF_ERROR)
+        break;
+    } while (zs.avail_in || !zs.avail_out);
+  }
+  inflateEnd(&zs);
+  return error ? error : ended ? NULL : "gzip data cut short";
+}
+#endif
+
+#ifdef HAVE_ZSTD
+const char *decodezstd(struct decoder *d) {
+  unsigned char in[DECODE_CHUNK], out[DECODE_CHUNK];
+  ZSTD_DCtx *z = ZSTD_createDCtx();
+  if (!z)
+    return "zstd failed to start";
+  const char *error = NULL;
+  size_t ret = 0;
+  ssize_t n;
+  while (!error && (n = read(d->fd, in, sizeof(in))) > 0) {
+    ZSTD_inBuffer ib = {in, n, 0};
+    bool full;
+    do {
+      ZSTD_outBuffer ob = {out, sizeof(out), 0};
+      ret = ZSTD_decompressStream(z, &ob, &ib);
+      if (ZSTD_isError(ret)) {
+        error = ZSTD_getErrorName(ret);
+        break;
+      }
+      if (!decodeput(d, (char *)out, ob.pos)) {
+        error = "larger than VIEW_FILE_SIZE, only its start is loaded";
+        break;
+      }
+      full = ob.pos == ob.size;
+    } while (ib.pos < ib.size || full);
+  }
+  ZSTD_freeDCtx(z);
+  return error ? error : ret ? "zstd data cut short" : NULL;
+}
+#endif
+
+void *decodethread(void *arg) {
+  struct decoder *d = arg;
+  const char *error = NULL;
+#ifdef HAVE_ZLIB
+  if (d->codec == CODEC_GZIP)
+    error = decodegzip(d);
+#endif
+#ifdef HAVE_ZSTD
+  if (d->codec == CODEC_ZSTD)
+    error = decodezstd(d);
+#endif
+  pthread_mutex_lock(&d->lock);
+  d->error = error;
+  d->done = true;
+  pthread_cond_signal(&d->more);
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
 
-  E.cy++;
-  E.cx = 0;
+// Loads up to max more decoded bytes into the rows, and joins the thread
+// once it is done. Returns whether there was anything to load
+bool decodetake(size_t max) {
+  struct decoder *d = &E.decode;
+  if (d->used == d->ntaken) {
+    free(d->taken);
+    pthread_mutex_lock(&d->lock);
+    d->taken = d->buf;
+    d->ntaken = d->len;
+    d->used = 0;
+    d->buf = NULL;
+    d->len = d->cap = 0;
+    long long total = d->total;
+    pthread_mutex_unlock(&d->lock);
+    if (total > LARGE_FILE_SIZE)
+      largemode();
+  }
 
-  for (int j = 0; j < tabs; j++)
-    insertchar('\t');
+  // The decoded rows are the file, only edits made to them are journaled
+  bool dirty = E.dirty, on = E.swap.on;
+  E.swap.on = false;
+  size_t n = MIN(d->ntaken - d->used, max);
+  char *p = d->taken + d->used;
+  d->partial = appendlines(p, p + n, d->partial);
+  d->used += n;
+  E.swap.on = on;
+  E.dirty = dirty;
+  if (d->used < d->ntaken)
+    return true;
+
+  pthread_mutex_lock(&d->lock);
+  bool done = d->done && !d->len;
+  pthread_mutex_unlock(&d->lock);
+  if (!done)
+    return n > 0;
+  pthread_join(d->thread, NULL);
+  close(d->fd);
+  d->fd = -1;
+  d->running = false;
+  free(d->taken);
+  d->taken = NULL;
+  d->ntaken = d->used = 0;
+  if (d->error)
+    setstatus("%s: %s", E.filename, d->error);
+  return true;
 }
 
-void rowinsertstring(struct erow *row, char *s, size_t len) {
-  row->line = realloc(row->line, row->size + len + 1);
-  memcpy(&row->line[row->size], s, len);
-  row->size += len;
-  row->line[row->size] = '\0';
-  updaterow(row);
-  E.dirty = true;
+// Loads slices of the decoded bytes until a key is waiting
+void decodetick() {
+  struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+  bool took = false;
+  while (E.decode.running && decodetake(DECODE_SLICE)) {
+    took = true;
+    swaptick();
+    if (poll(&in, 1, 0) > 0)
+      break;
+  }
+  if (took)
+    clearscreen();
 }
 
-void deletechar() {
-  if (E.cy >= E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0)
+// Takes the rest of the file, for when every row is needed
+void decodewait() {
+  struct decoder *d = &E.decode;
+  if (!d->running)
     return;
+  pthread_mutex_lock(&d->lock);
+  while (!d->done)
+    pthread_cond_wait(&d->more, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+  while (d->running)
+    decodetake(SIZE_MAX);
+}
 
-  if (!coalesce_state.active) {
-    if (E.cx > 0)
-      pushUndo(EDITDELETE, E.cy, E.cx - 1);
-    else
-      pushUndo(EDITDELETE, E.cy - 1, E.row[E.cy - 1].size);
+// Starts decoding fd if it is compressed, and loads the first screen of it.
+// Returns false for a file to be read as it is
+bool decodeopen(int fd) {
+  struct decoder *d = &E.decode;
+  d->codec = codecof(fd);
+  const char *missing = NULL;
+#ifndef HAVE_ZLIB
+  if (d->codec == CODEC_GZIP)
+    missing = "gzip";
+#endif
+#ifndef HAVE_ZSTD
+  if (d->codec == CODEC_ZSTD)
+    missing = "zstd";
+#endif
+  if (missing) {
+    setstatus("Built without %s, showing the compressed bytes", missing);
+    d->codec = CODEC_NONE;
   }
+  if (d->codec == CODEC_NONE)
+    return false;
 
-  struct erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    rowdeletechar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    rowinsertstring(&E.row[E.cy - 1], row->line, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-    coalesce_state.active = false;
+  d->fd = dup(fd);
+  d->partial = true;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->more, NULL);
+  if (d->fd == -1 || pthread_create(&d->thread, NULL, decodethread, d))
+    die("decode");
+  d->running = true;
+  pthread_mutex_lock(&d->lock);
+  while (!d->done && d->len < DECODE_FIRST)
+    pthread_cond_wait(&d->more, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+  decodetake(SIZE_MAX);
+  return true;
+}
+
+// The rows as saved with the codec the file was loaded with, NULL if that
+// failed
+char *encode(char *s, int len, int *outlen) {
+  char *out = NULL;
+#ifdef HAVE_ZLIB
+  if (E.decode.codec == CODEC_GZIP) {
+    z_stream zs = {0};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    uLong cap = deflateBound(&zs, len);
+    out = malloc(cap);
+    zs.next_in = (unsigned char *)s;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+      *outlen = zs.total_out;
+    } else {
+      free(out);
+      out = NULL;
+    }
+    deflateEnd(&zs);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (E.decode.codec == CODEC_ZSTD) {
+    size_t cap = ZSTD_compressBound(len);
+    out = malloc(cap);
+    size_t n = ZSTD_compress(out, cap, s, len, 3);
+    if (ZSTD_isError(n)) {
+      free(out);
+      return NULL;
+    }
+    *outlen = n;
   }
+#endif
+  (void)s;
+  (void)len;
+  (void)outlen;
+  return out;
 }
 
-char *rowstostring(int *len) {
-  int total = 0;
-  for (int j = 0; j < E.numrows; j++)
-    total += E.row[j].size + 1;
-  *len = total;
+// Replays the records of a swap file from p, returns how far they were whole
+char *swapreplay(char *p, char *end) {
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char op;
+    int at, len = 0, count = 1;
+    if (!nl || sscanf(p, "%c %d", &op, &at) != 2)
+      break;
+    if (op != 'S' && sscanf(p, "%*c %*d %d", &count) == 1 && count < 1)
+      break;
+    char *next = nl + 1;
+    if (op == 'S') {
+      if (sscanf(p, "S %d %d", &at, &len) != 2 || len < 0 ||
+          len >= end - next || next[len] != '\n' || at < 0 ||
+          at >= E.numrows)
+        break;
+      struct erow *row = &E.row[at];
+      free(row->line);
+      row->line = malloc(len + 1);
+      memcpy(row->line, next, len);
+      row->line[len] = '\0';
+      row->size = len;
+      row->editfrom = 0;
+      updaterow(row);
+      next += len + 1;
+    } else if (op == 'I' && at >= 0 && at <= E.numrows) {
+      struct rowsnap *empty = malloc(sizeof(struct rowsnap) * count);
+      for (int i = 0; i < count; i++)
+        empty[i] = (struct rowsnap){at + i, strdup(""), 0};
+      rowsreplace(at, 0, empty, count, NULL);
+      free(empty);
+    } else if (op == 'D' && at >= 0 && count <= E.numrows - at) {
+      rowsreplace(at, count, NULL, 0, NULL);
+    } else {
+      break;
+    }
+    p = next;
+  }
+  return p;
+}
 
-  char *buf = malloc(total);
-  char *p = buf;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].line, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    ++p;
+// Offers to recover the edits in a swap file left by a session that did not
+// exit cleanly
+void swaprecover() {
+  char path[PATH_MAX];
+  swappath(path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  char *buf = NULL;
+  int pid, head = 0;
+  long long size, sec, nsec;
+  if (fstat(fd, &st) == 0) {
+    buf = malloc(st.st_size + 1);
+    if (read(fd, buf, st.st_size) == st.st_size) {
+      buf[st.st_size] = '\0';
+      sscanf(buf, "batata swap 1\npid %d\nfile %lld %lld %lld\n%n", &pid,
+             &size, &sec, &nsec, &head);
+    }
+  }
+  close(fd);
+  if (!head) {
+    free(buf);
+    return;
   }
 
-  return buf;
+  char proc[32];
+  snprintf(proc, sizeof(proc), "/proc/%d", pid);
+  if (pid != getpid() && access(proc, F_OK) == 0) {
+    setstatus("%s belongs to running process %d, edits are not journaled",
+              path, pid);
+    E.swap.on = false;
+    free(buf);
+    return;
+  }
+  bool same = size == E.swap.size && sec == E.swap.sec && nsec == E.swap.nsec;
+  setstatus("Found swap file %s%s, recover it? (y/n)", path,
+            same ? "" : " of an older version of the file");
+  clearscreen();
+  int c = readkey();
+  if (c != 'y' && c != 'Y') {
+    unlink(path);
+    setstatus("Swap file removed");
+    free(buf);
+    return;
+  }
+
+  E.swap.on = false;
+  char *end = swapreplay(buf + head, buf + st.st_size);
+  E.swap.on = true;
+  // The replayed edits are the starting point, not something to undo
+  while (E.undotop > 0) {
+    actionfree(&E.UndoStack[--E.undotop]);
+  }
+  coalesce_state.active = false;
+  E.cy = MIN(E.cy, E.numrows - 1);
+  E.cx = 0;
+  E.dirty = true;
+
+  // Journaling goes on in a fresh swap file holding the same records
+  E.swap.size = size;
+  E.swap.sec = sec;
+  E.swap.nsec = nsec;
+  if (swapcreate()) {
+    int len = end - (buf + head);
+    if (write(E.swap.fd, buf + head, len) != len)
+      setstatus("Swap file: %s", strerror(errno));
+    else
+      setstatus("Recovered unsaved edits from %s", path);
+  }
+  free(buf);
 }
 
 void editorOpen(char *filename) {
   free(E.filename);
   E.filename = strdup(filename);
+  E.swap.on = false;
   selectHL();
   FILE *fp = fopen(filename, "r");
   if (!fp) {
     fp = fopen(filename, "w");
     if (!fp)
-      kill("fopen");
+      die("fopen");
     fclose(fp);
 
     fp = fopen(filename, "r");
     if (!fp)
-      kill("fopen");
+      die("fopen");
+  }
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == -1)
+    die("fstat");
+  if (codecof(fileno(fp)) == CODEC_NONE && isbinary(fileno(fp))) {
+    fclose(fp);
+    hexopen(filename);
+    return;
+  }
+  if (st.st_size > VIEW_FILE_SIZE && codecof(fileno(fp)) == CODEC_NONE) {
+    fclose(fp);
+    pageropen(filename);
+    setstatus("Over VIEW_FILE_SIZE, opened read only");
+    return;
   }
+  if (st.st_size > LARGE_FILE_SIZE)
+    largemode();
 
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+  bool compressed = decodeopen(fileno(fp));
+  while (!compressed && (linelen = getline(&line, &linecap, fp)) != -1) {
     while (linelen > 0 &&
            (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       linelen--;
+    if (linelen > LARGE_LINE_LENGTH)
+      largemode();
     editorInsertRow(E.numrows, line, linelen);
   }
   if (E.numrows == 0)
     editorInsertRow(0, "", 0);
   E.dirty = false;
   free(line);
+  if (fstat(fileno(fp), &st) == 0)
+    diskstate(fileno(fp), &st);
+  swapbase(fileno(fp));
   fclose(fp);
+  watchfile();
+  E.swap.on = true;
+  if (SWAP_INTERVAL > 0) {
+    // A journal applies to the whole file
+    char path[PATH_MAX];
+    swappath(path, sizeof(path));
+    if (access(path, F_OK) == 0)
+      decodewait();
+    swaprecover();
+  }
 }
 
 void save() {
@@ -1147,13 +5558,34 @@ void save() {
     selectHL();
   }
 
+  decodewait();
+  if (E.decode.cut) {
+    setstatus("Only the start of the file is loaded, not saving");
+    return;
+  }
   int len;
   char *buf = rowstostring(&len);
+  if (E.decode.codec != CODEC_NONE) {
+    char *packed = encode(buf, len, &len);
+    free(buf);
+    if (!packed) {
+      setstatus("Compressing failed, not saved");
+      return;
+    }
+    buf = packed;
+  }
   int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
   if (fd != -1) {
     if (ftruncate(fd, len) != -1) {
       if (write(fd, buf, len) == len) {
+        struct stat st;
+        swapdiscard();
+        swapbase(fd);
+        if (fstat(fd, &st) == 0)
+          diskstate(fd, &st);
         close(fd);
+        if (E.disk.watch == -1)
+          watchfile();
         free(buf);
         E.dirty = false;
         setstatus("%d bytes written to disk", len);
@@ -1172,7 +5604,10 @@ void findCallback(char *query, int key) {
   static int savedLine;
   static char *savedHL = NULL;
   if (savedHL) {
-    memcpy(E.row[savedLine].highlight, savedHL, E.row[savedLine].rsize);
+    if (E.row[savedLine].windowed)
+      updateSyntax(&E.row[savedLine]);
+    else
+      memcpy(E.row[savedLine].highlight, savedHL, E.row[savedLine].rsize);
     free(savedHL);
     savedHL = NULL;
   }
@@ -1200,17 +5635,21 @@ void findCallback(char *query, int key) {
     else if (cur == E.numrows)
       cur = 0;
     struct erow *row = &E.row[cur];
-    char *match = strstr(row->render, query);
+    // Long rows only keep a window of render, so search the line itself
+    char *match = strstr(row->line, query);
     if (match) {
       last = cur;
       E.cy = cur;
-      E.cx = rxtocx(row, match - row->render);
+      foldreveal(cur);
+      E.cx = match - row->line;
       E.rowoff = E.numrows;
 
+      int at = rowrender(row, cxtorx(row, E.cx));
       savedLine = cur;
       savedHL = malloc(row->rsize);
       memcpy(savedHL, row->highlight, row->rsize);
-      memset(&row->highlight[match - row->render], MATCH, strlen(query));
+      memset(&row->highlight[at], MATCH,
+             MIN((int)strlen(query), row->rsize - at));
       break;
     }
   }
@@ -1223,9 +5662,12 @@ void find() {
   int initrowoff = E.rowoff;
 
   char *query = editorprompt("Search: %s (Esc to cancel)", findCallback);
-  if (query)
-    free(query);
-  else {
+  if (query) {
+    free(searchquery);
+    searchquery = query;
+    if (E.cy != initcy || E.cx != initcx)
+      jumppush(initcy, initcx);
+  } else {
     E.cx = initcx;
     E.cy = initcy;
     E.coloff = initcoloff;
@@ -1253,13 +5695,51 @@ void abAdd(struct abuf *ab, const char *s, int len) {
 void abFree(struct abuf *ab) { free(ab->b); }
 
 void scroll() {
+  if (E.pager.fd != -1)
+    pagerfit();
   E.rx = 0;
-  if (E.cy < E.numrows)
+  if (E.folds && E.cy < E.numrows && foldheader(E.cy) != E.cy) {
+    E.cy = foldheader(E.cy);
+    E.cx = MIN(E.cx, E.row[E.cy].size);
+  }
+  if (E.cy < E.numrows) {
+    // Never leave the cursor before the row or inside a multibyte character,
+    // as $ or gg on an empty row would
+    E.cx = cellstart(&E.row[E.cy], MAX(E.cx, 0));
     E.rx = cxtorx(&E.row[E.cy], E.cx);
-  if (E.cy < E.rowoff)
-    E.rowoff = E.cy;
-  if (E.cy >= E.rowoff + E.rows) {
-    E.rowoff = E.cy - E.rows + 1;
+  }
+  if (SOFT_WRAP) {
+    wrapEnsure();
+    struct wrapindex *w = &E.wrap;
+    // Ctrl-E/Ctrl-Y and the mouse wheel still move rowoff directly
+    if (E.rowoff != w->toprow)
+      w->voff = wrapRowStart(E.rowoff);
+    int cv = wrapRowStart(E.cy) + E.rx / w->width;
+    if (cv < w->voff)
+      w->voff = cv;
+    if (cv >= w->voff + E.rows)
+      w->voff = cv - E.rows + 1;
+    E.rowoff = wrapFind(w->voff, NULL);
+    w->toprow = E.rowoff;
+    E.coloff = 0;
+    return;
+  }
+  if (E.folds) {
+    // Count screen lines in visible rows, folds take one line each
+    E.rowoff = foldheader(E.rowoff);
+    if (E.cy < E.rowoff)
+      E.rowoff = E.cy;
+    if (foldcount(E.rowoff, E.cy, E.rows) >= E.rows) {
+      E.rowoff = E.cy;
+      for (int i = 1; i < E.rows && E.rowoff > 0; i++)
+        E.rowoff = foldprev(E.rowoff);
+    }
+  } else {
+    if (E.cy < E.rowoff)
+      E.rowoff = E.cy;
+    if (E.cy >= E.rowoff + E.rows) {
+      E.rowoff = E.cy - E.rows + 1;
+    }
   }
   if (E.rx < E.coloff)
     E.coloff = E.rx;
@@ -1268,6 +5748,9 @@ void scroll() {
 }
 
 bool inSelection(int x, int y) {
+  if (E.block)
+    return y >= MIN(E.sel_y, E.cy) && y <= MAX(E.sel_y, E.cy) &&
+           x >= MIN(E.sel_x, E.rx) && x <= MAX(E.sel_x, E.rx);
   // int lineNumGutter = (E.numrows > 0) ? (int)log10(E.numrows) + 1 : 1;
   // x = x - 1 - (lineNumGutter + 1) + E.coloff;
 
@@ -1298,103 +5781,314 @@ bool inSelection(int x, int y) {
     return true;
 }
 
+// Prints the line number, or blank padding for a wrapped continuation
+void drawgutter(struct abuf *ab, int filerow, bool number) {
+  int padding = linenumwidth();
+  if (!number) {
+    for (; padding >= 0; padding--)
+      abAdd(ab, " ", 1);
+    return;
+  }
+  char lineNum[24];
+  long long num = 0;
+  bool relative = RELATIVE_LINE_NUMBERS && !E.large.on;
+  if (relative && E.folds)
+    num = (filerow == E.cy)  ? E.pager.base + filerow + 1
+          : (filerow < E.cy) ? foldcount(filerow, E.cy, INT_MAX)
+                             : foldcount(E.cy, filerow, INT_MAX);
+  else if (relative)
+    num = (filerow == E.cy) ? E.pager.base + filerow + 1 : abs(filerow - E.cy);
+  else
+    num = E.pager.base + filerow + 1;
+
+  int wlen = snprintf(lineNum, sizeof(lineNum), "%lld", num);
+  padding -= wlen;
+
+  for (; padding > 0; padding--)
+    abAdd(ab, " ", 1);
+
+  if (filerow == E.cy) {
+    abAdd(ab, "\x1b[32m", 5);
+    abAdd(ab, lineNum, wlen);
+    abAdd(ab, "\x1b[39m", 5);
+
+  } else {
+    abAdd(ab, lineNum, wlen);
+  }
+
+  abAdd(ab, foldclosedlines(filerow) ? "+" : " ", 1);
+}
+
+// Trails the header of a closed fold with the number of rows it hides
+void drawfoldmark(struct abuf *ab, int filerow, int used) {
+  int hidden = foldclosedlines(filerow);
+  if (!hidden)
+    return;
+  char mark[32];
+  int len = snprintf(mark, sizeof(mark), " ... %d line%s", hidden,
+                     hidden == 1 ? "" : "s");
+  if (used + len > textwidth())
+    return;
+  abAdd(ab, "\x1b[2m", 4);
+  abAdd(ab, mark, len);
+  abAdd(ab, "\x1b[22m", 5);
+}
+
+// Bracket under the cursor and its pair, highlighted by drawspan
+static struct {
+  int x[2];
+  int y[2];
+} shownpair = {{-1, -1}, {-1, -1}};
+
+// Prints at most `width` render columns of a row starting at column `start`
+void drawspan(struct abuf *ab, int filerow, int start, int width) {
+  struct erow *row = &E.row[filerow];
+  // Typedef names came or went since the row was painted
+  if (row->ntok && !row->windowed && row->typegen != typenames.gen)
+    paintrow(row);
+  int i = rowrender(row, start);
+  int col = start;
+  // A wide character cut by the left edge leaves blank columns
+  int cx = rxtocx(row, start);
+  if (cx < row->size && row->line[cx] != '\t' && cxtorx(row, cx) < start) {
+    int len;
+    int end = cxtorx(row, cx) + cellwidth(row->line, cx, row->size, &len);
+    for (; col < end && col < start + width; col++)
+      abAdd(ab, " ", 1);
+    i += len;
+  }
+
+  // Render bytes of the bracket pair around the cursor
+  int pair[2] = {-1, -1};
+  for (int p = 0; p < 2; p++)
+    if (shownpair.y[p] == filerow)
+      pair[p] = cxtorb(row, shownpair.x[p]) - cxtorb(row, row->loff);
+
+  // Render byte of the next of the other cursors on the row
+  struct cursors *M = &E.multi;
+  int base = cxtorb(row, row->loff), k = mcfirst(filerow), other = -1;
+
+  char *c = row->render;
+  unsigned char *hl = row->highlight;
+  int curColour = -1;
+  while (i < row->rsize) {
+    int n = 1, w = 1, cp;
+    bool malformed = false;
+    if ((unsigned char)c[i] >= 0x80) {
+      n = utf8decode(&c[i], row->rsize - i, &cp);
+      if (n == 0)
+        malformed = true, n = 1;
+      else
+        w = cpwidth(cp);
+    }
+    if (col + w > start + width)
+      break;
+    while (k < M->n && M->at[k].y == filerow &&
+           (other = cxtorb(row, M->at[k].x) - base) < i)
+      k++;
+    bool cursor = k < M->n && M->at[k].y == filerow && other == i &&
+                  k != M->main;
+    bool selected = E.mode == 'v' && inSelection(col, filerow);
+    const char *bg = selected                        ? "\x1b[100m"
+                     : cursor                         ? "\x1b[45m"
+                     : (i == pair[0] || i == pair[1]) ? "\x1b[46m"
+                                                      : NULL;
+    if (malformed || iscntrl(c[i])) {
+      char sym = (!malformed && c[i] <= 26) ? '@' + c[i] : '?';
+      abAdd(ab, "\x1b[7m", 4);
+      abAdd(ab, &sym, 1);
+      abAdd(ab, "\x1b[m", 3);
+      if (curColour != -1) {
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%dm", curColour);
+        abAdd(ab, buf, len);
+      }
+    } else if (hl[i] == NORMAL) {
+      if (curColour != -1) {
+        abAdd(ab, "\x1b[39m", 5);
+        curColour = -1;
+      }
+      if (bg)
+        abAdd(ab, bg, strlen(bg));
+      abAdd(ab, &c[i], n);
+      if (bg)
+        abAdd(ab, "\x1b[49m", 5);
+    } else {
+      int colour = syntocolour(hl[i]);
+      if (curColour != colour) {
+        curColour = colour;
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
+        abAdd(ab, buf, clen);
+      }
+      if (bg)
+        abAdd(ab, bg, strlen(bg));
+      abAdd(ab, &c[i], n);
+      if (bg)
+        abAdd(ab, "\x1b[49m", 5);
+    }
+    i += n;
+    col += w;
+  }
+  // A cursor past the end of the line
+  for (; k < M->n && M->at[k].y == filerow; k++)
+    if (M->at[k].x == row->size && k != M->main && col < start + width &&
+        cxtorb(row, row->size) - base == i)
+      abAdd(ab, "\x1b[45m \x1b[49m", 11);
+  abAdd(ab, "\x1b[39;49m", 8);
+}
+
+void drawwelcome(struct abuf *ab) {
+  char message[80];
+  int messagelen = snprintf(message, sizeof(message), "Batata -- version %s",
+                            editor_version);
+  if (messagelen > E.cols)
+    messagelen = E.cols;
+
+  int padding = (E.cols - messagelen) / 2;
+  if (padding < 0)
+    padding = 0;
+  if (padding) {
+    abAdd(ab, "~", 1);
+    padding--;
+  }
+  while (padding--)
+    abAdd(ab, " ", 1);
+  abAdd(ab, message, messagelen);
+}
+
+// Soft wrap: screen lines map to visual lines starting at wrap.voff
+void drawwrapped(struct abuf *ab) {
+  int width = E.wrap.width;
+  int seg;
+  int filerow = wrapFind(E.wrap.voff, &seg);
+  for (int y = 0; y < E.rows; y++) {
+    if (filerow >= E.numrows) {
+      abAdd(ab, "~", 1);
+    } else {
+      drawgutter(ab, filerow, seg == 0);
+      drawspan(ab, filerow, seg * width, width);
+      if (++seg >= E.wrap.cnt[filerow]) {
+        drawfoldmark(ab, filerow, E.row[filerow].width - (seg - 1) * width);
+        filerow = foldnext(filerow);
+        seg = 0;
+      }
+    }
+    abAdd(ab, "\x1b[K", 3);
+    abAdd(ab, "\r\n", 2);
+  }
+}
+
+// Digits in the offset column
+int hexdigits() {
+  int n = 8;
+  while (n < 16 && E.hex.size >> (4 * n))
+    n++;
+  return n;
+}
+
+void hexscroll() {
+  struct hexview *H = &E.hex;
+  long long line = H->cur / HEX_WIDTH;
+  if (line < H->top)
+    H->top = line;
+  if (line >= H->top + E.rows)
+    H->top = line - E.rows + 1;
+}
+
+// Where the cursor goes on screen
+void hexcursor(int *y, int *x) {
+  struct hexview *H = &E.hex;
+  int i = H->cur % HEX_WIDTH, left = hexdigits() + 2;
+  *y = H->cur / HEX_WIDTH - H->top;
+  if (H->ascii)
+    *x = left + HEX_WIDTH * 3 + 2 + i;
+  else
+    *x = left + i * 3 + (i >= HEX_WIDTH / 2) + H->low;
+}
+
+// Offset, hex and text columns, with edited bytes in red and the byte under
+// the cursor shown inverse in the column it is not in
+void drawhex(struct abuf *ab) {
+  struct hexview *H = &E.hex;
+  int digits = hexdigits();
+  char buf[32];
+  for (int y = 0; y < E.rows; y++) {
+    long long from = (H->top + y) * HEX_WIDTH;
+    if (from >= H->size && !(from == 0 && y == 0)) {
+      abAdd(ab, "~\x1b[K\r\n", 6);
+      continue;
+    }
+    int len = snprintf(buf, sizeof(buf), "%0*llx  ", digits, from);
+    abAdd(ab, buf, len);
+    for (int pane = 0; pane < 2; pane++) {
+      if (pane)
+        abAdd(ab, "|", 1);
+      for (int i = 0; i < HEX_WIDTH; i++) {
+        long long off = from + i;
+        if (off >= H->size) {
+          if (!pane)
+            abAdd(ab, "    ", 3 + (i == HEX_WIDTH / 2 - 1));
+          continue;
+        }
+        unsigned char b = hexat(off);
+        bool edited = hexedited(off);
+        bool shown = off == H->cur && H->ascii != pane;
+        if (edited)
+          abAdd(ab, "\x1b[31m", 5);
+        if (shown)
+          abAdd(ab, "\x1b[7m", 4);
+        if (pane) {
+          char ch = b >= ' ' && b <= '~' ? b : '.';
+          abAdd(ab, &ch, 1);
+        } else {
+          snprintf(buf, sizeof(buf), "%02x", b);
+          abAdd(ab, buf, 2);
+        }
+        if (edited || shown)
+          abAdd(ab, "\x1b[m", 3);
+        if (!pane)
+          abAdd(ab, "  ", 1 + (i == HEX_WIDTH / 2 - 1));
+      }
+      if (pane)
+        abAdd(ab, "|", 1);
+    }
+    abAdd(ab, "\x1b[K\r\n", 5);
+  }
+}
+
 void drawrows(struct abuf *ab) {
+  if (E.hex.on) {
+    drawhex(ab);
+    return;
+  }
+  if (E.large.on)
+    largetrim();
+  int mx, my;
+  shownpair.y[0] = shownpair.y[1] = -1;
+  if (E.cy < E.numrows && E.mode != 'v' && bracketmatch(E.cx, E.cy, &mx, &my)) {
+    shownpair.x[0] = E.cx;
+    shownpair.y[0] = E.cy;
+    shownpair.x[1] = mx;
+    shownpair.y[1] = my;
+  }
+  if (SOFT_WRAP && E.numrows > 0) {
+    drawwrapped(ab);
+    return;
+  }
+  int filerow = E.rowoff;
   for (int y = 0; y < E.rows; y++) {
-    int filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
       if (y == E.rows / 3 && E.numrows == 0) {
-        char message[80];
-        int messagelen = snprintf(message, sizeof(message),
-                                  "Batata -- version %s", editor_version);
-        if (messagelen > E.cols)
-          messagelen = E.cols;
-
-        int padding = (E.cols - messagelen) / 2;
-        if (padding < 0)
-          padding = 0;
-        if (padding) {
-          abAdd(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAdd(ab, " ", 1);
-        abAdd(ab, message, messagelen);
+        drawwelcome(ab);
       } else {
         abAdd(ab, "~", 1);
       }
     } else {
-      // Prints the line Number
-      int padding = (E.numrows > 0) ? (int)log10(E.numrows) + 1 : 1;
-      char lineNum[16];
-      int number = 0;
-      if (RELATIVE_LINE_NUMBERS)
-        number = (filerow == E.cy) ? filerow + 1 : abs(filerow - E.cy);
-      else
-        number = filerow + 1;
-
-      int wlen = snprintf(lineNum, sizeof(lineNum), "%d", number);
-      padding -= wlen;
-
-      for (; padding > 0; padding--)
-        abAdd(ab, " ", 1);
-
-      if (filerow == E.cy) {
-        abAdd(ab, "\x1b[32m", 5);
-        abAdd(ab, lineNum, wlen);
-        abAdd(ab, "\x1b[39m", 5);
-
-      } else {
-        abAdd(ab, lineNum, wlen);
-      }
-
-      abAdd(ab, " ", 1);
-
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.cols)
-        len = E.cols;
-
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].highlight[E.coloff];
-      int curColour = -1;
-      for (int j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAdd(ab, "\x1b[7m", 4);
-          abAdd(ab, &sym, 1);
-          abAdd(ab, "\x1b[m", 3);
-          if (curColour != -1) {
-            char buf[16];
-            int len = snprintf(buf, sizeof(buf), "\x1b[%dm", curColour);
-            abAdd(ab, buf, len);
-          }
-        } else if (hl[j] == NORMAL) {
-          if (curColour != -1) {
-            abAdd(ab, "\x1b[39m", 5);
-            curColour = -1;
-          }
-          if (E.mode == 'v' && inSelection(j, filerow))
-            abAdd(ab, "\x1b[100m", 6);
-          abAdd(ab, &c[j], 1);
-          if (E.mode == 'v' && inSelection(j, filerow))
-            abAdd(ab, "\x1b[49m", 5);
-        } else {
-          int colour = syntocolour(hl[j]);
-          if (curColour != colour) {
-            curColour = colour;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-            abAdd(ab, buf, clen);
-          }
-          if (E.mode == 'v' && inSelection(j, filerow))
-            abAdd(ab, "\x1b[100m", 6);
-          abAdd(ab, &c[j], 1);
-          if (E.mode == 'v' && inSelection(j, filerow))
-            abAdd(ab, "\x1b[49m", 6);
-        }
-      }
-      abAdd(ab, "\x1b[39;49m", 8);
+      drawgutter(ab, filerow, true);
+      drawspan(ab, filerow, E.coloff, E.cols);
+      drawfoldmark(ab, filerow, MAX(E.row[filerow].width - E.coloff, 0));
+      filerow = foldnext(filerow);
     }
 
     abAdd(ab, "\x1b[K", 3);
@@ -1411,21 +6105,46 @@ void DrawStatusBar(struct abuf *ab) {
     break;
   case 'n':
     mode = "NORMAL";
+    if (E.follow)
+      mode = E.cy == E.numrows - 1 ? "FOLLOW" : "FOLLOW, paused";
+    if (E.pager.fd != -1)
+      mode = "VIEW";
+    if (E.hex.on)
+      mode = E.hex.replacing ? "HEX REPLACE" : "HEX";
     break;
   case 'v':
-    mode = "VISUAL";
+    mode = E.block ? "VISUAL BLOCK" : "VISUAL";
     break;
   case 'r':
     mode = "REPLACE";
     break;
   }
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), " [%s] %.20s - %d lines %s", mode,
-                     E.filename ? E.filename : "[No Name]", E.numrows,
+  long long lines = E.pager.fd != -1 ? pagerlines() : E.numrows;
+  // Until a view has been scanned or a file decoded to the end, its line
+  // count is a lower bound
+  bool counted = E.pager.fd != -1 ? pagercounted() : !E.decode.running;
+  const char *more = counted ? "" : "+";
+  int len = snprintf(status, sizeof(status), " [%s] %.20s - %lld%s lines %s",
+                     mode, E.filename ? E.filename : "[No Name]", lines, more,
                      E.dirty ? "(modified)" : "");
-  int rlen =
-      snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-               E.syntax ? E.syntax->ftype : "no filetype", E.cy + 1, E.numrows);
+  char cursors[32] = "";
+  if (E.multi.n)
+    snprintf(cursors, sizeof(cursors), "%d cursors | ", E.multi.n);
+  else if (input.recording != -1)
+    snprintf(cursors, sizeof(cursors), "recording @%c | ",
+             'a' + input.recording);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %lld/%lld%s",
+                      cursors, E.large.on ? "large file | " : "",
+                      E.syntax ? E.syntax->ftype : "no filetype",
+                      E.pager.base + E.cy + 1, lines, more);
+  if (E.hex.on) {
+    len = snprintf(status, sizeof(status), " [%s] %.20s - %lld bytes %s",
+                   mode, E.filename, E.hex.size,
+                   E.dirty ? "(modified)" : "");
+    rlen = snprintf(rstatus, sizeof(rstatus), "binary | %llx/%llx",
+                    E.hex.cur, E.hex.size);
+  }
   int total = len + rlen;
   if (total > E.cols) {
     len -= (total - E.cols);
@@ -1507,7 +6226,15 @@ char *editorprompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void clearscreen() {
-  scroll();
+  if (input.defer && !replaying())
+    replaydone();
+  if (E.hex.on)
+    hexscroll();
+  else
+    scroll();
+  // A replay is drawn once it is done
+  if (replaying())
+    return;
   struct abuf ab = ABUF_INIT;
 
   abAdd(&ab, "\x1b[?25l", 6);
@@ -1524,9 +6251,16 @@ void clearscreen() {
     abAdd(&ab, "\x1b[2 q", 5);
   }
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1,
-           E.rx - E.coloff + 2 +
-               ((E.numrows > 0) ? (int)log10(E.numrows) + 1 : 1));
+  int screeny = E.folds ? foldcount(E.rowoff, E.cy, E.rows) : E.cy - E.rowoff;
+  int screenx = E.rx - E.coloff;
+  if (SOFT_WRAP) {
+    screeny = wrapRowStart(E.cy) + E.rx / E.wrap.width - E.wrap.voff;
+    screenx = E.rx % E.wrap.width;
+  }
+  screenx += 1 + linenumwidth();
+  if (E.hex.on)
+    hexcursor(&screeny, &screenx);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", screeny + 1, screenx + 1);
   abAdd(&ab, buf, strlen(buf));
 
   abAdd(&ab, "\x1b[?25h", 6);
@@ -1535,50 +6269,125 @@ void clearscreen() {
   abFree(&ab);
 }
 
+// Keeps the cursor's column inside its row and on the start of a cell
+void cursorfit() {
+  struct erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen)
+    E.cx = rowlen;
+  if (row)
+    E.cx = cellstart(row, E.cx);
+}
+
 void movecursor(int key) {
   coalesce_state.active = false;
   struct erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
   switch (key) {
   case ARROW_LEFT:
     if (E.cx != 0)
-      E.cx--;
+      E.cx = prevcell(row, E.cx);
     else if (E.cy > 0) {
-      E.cy--;
+      E.cy = foldprev(E.cy);
       E.cx = E.row[E.cy].size;
     }
     break;
   case ARROW_DOWN:
     if (E.cy < E.numrows)
-      E.cy++;
+      E.cy = foldnext(E.cy);
     break;
   case ARROW_UP:
     if (E.cy != 0)
-      E.cy--;
+      E.cy = foldprev(E.cy);
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size)
-      E.cx++;
+      E.cx = nextcell(row, E.cx);
     else if (row && E.cx == row->size) {
-      E.cy++;
+      E.cy = foldnext(E.cy);
       E.cx = 0;
     }
     break;
   }
+  cursorfit();
+}
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen)
-    E.cx = rowlen;
+// Puts the cursor on row cy, as many arrow presses up or down would
+void cursorrow(int cy) {
+  coalesce_state.active = false;
+  E.cy = cy;
+  cursorfit();
+}
+
+// Moves the cursor n cells right, or left for a negative n, going on to the
+// next or previous row at either end as the arrow keys do
+void cursorcells(int n) {
+  coalesce_state.active = false;
+  while (n > 0 && E.cy < E.numrows) {
+    struct erow *row = &E.row[E.cy];
+    for (; n > 0 && E.cx < row->size; n--)
+      E.cx = nextcell(row, E.cx);
+    if (n > 0) {
+      E.cy = foldnext(E.cy);
+      E.cx = 0;
+      n--;
+    }
+  }
+  for (; n < 0 && (E.cx > 0 || E.cy > 0); n++) {
+    if (E.cx > 0)
+      E.cx = prevcell(&E.row[E.cy], E.cx);
+    else {
+      E.cy = foldprev(E.cy);
+      E.cx = E.row[E.cy].size;
+    }
+  }
+  cursorfit();
+}
+
+// Scrolls by visible rows while folds are closed, keeping the cursor on screen
+void foldscroll(int delta) {
+  for (; delta > 0; delta--) {
+    int next = foldnext(E.rowoff);
+    if (next >= E.numrows)
+      break;
+    E.rowoff = next;
+  }
+  for (; delta < 0 && E.rowoff > 0; delta++)
+    E.rowoff = foldprev(E.rowoff);
+  if (E.cy < E.rowoff)
+    E.cy = E.rowoff;
+  if (foldcount(E.rowoff, E.cy, E.rows) >= E.rows) {
+    E.cy = E.rowoff;
+    for (int i = 1; i < E.rows && foldnext(E.cy) < E.numrows; i++)
+      E.cy = foldnext(E.cy);
+  }
 }
 
 void handlemouse(int btn, int x, int y, char type) {
   if (type == 'M') {
     switch (btn) {
     case 0: {
-      int lineNumGutter = (E.numrows > 0) ? (int)log10(E.numrows) + 1 : 1;
+      int lineNumGutter = linenumwidth();
+
+      if (SOFT_WRAP && E.numrows > 0) {
+        wrapEnsure();
+        int seg;
+        E.cy = wrapFind(E.wrap.voff + y - 1, &seg);
+        if (E.cy >= E.numrows)
+          E.cy = E.numrows - 1;
+        int rx = seg * E.wrap.width + x - 1 - (lineNumGutter + 1);
+        E.cx = rxtocx(&E.row[E.cy], MAX(rx, 0));
+        if (E.cx >= E.row[E.cy].size)
+          E.cx = MAX(E.row[E.cy].size - 1, 0);
+        E.rx = cxtorx(&E.row[E.cy], E.cx);
+        break;
+      }
 
-      E.cy = y - 1 + E.rowoff;
+      E.cy = E.rowoff;
+      for (int i = 1; i < y && E.cy < E.numrows; i++)
+        E.cy = foldnext(E.cy);
       E.cx = x - 1 - (lineNumGutter + 1) + E.coloff;
+      if (E.cy >= 0 && E.cy < E.numrows)
+        E.cx = rxtocx(&E.row[E.cy], MAX(E.cx, 0));
 
       if (E.cy < 0)
         E.cy = 0;
@@ -1603,6 +6412,14 @@ void handlemouse(int btn, int x, int y, char type) {
 
     case 64: {
       int scroll = 3;
+      if (SOFT_WRAP && E.numrows > 0) {
+        wrapScroll(-scroll);
+        break;
+      }
+      if (E.folds) {
+        foldscroll(-scroll);
+        break;
+      }
       if (E.rowoff >= scroll)
         E.rowoff -= scroll;
       else
@@ -1622,6 +6439,14 @@ void handlemouse(int btn, int x, int y, char type) {
 
     case 65: {
       int scroll = 3;
+      if (SOFT_WRAP && E.numrows > 0) {
+        wrapScroll(scroll);
+        break;
+      }
+      if (E.folds) {
+        foldscroll(scroll);
+        break;
+      }
       if (E.rowoff < E.numrows - scroll)
         E.rowoff += scroll;
       else
@@ -1639,458 +6464,946 @@ void handlemouse(int btn, int x, int y, char type) {
   }
 }
 
-void nextWord(char key) {
-  if (E.mode == 'i')
+// w and b over the tokens of a parser, false if the rows were not lexed
+bool tokenword(int dir) {
+  if (!E.syntax || !E.syntax->parse || E.cy >= E.numrows ||
+      E.row[E.cy].windowed)
+    return false;
+  struct erow *row = &E.row[E.cy];
+  rowready(row);
+  if (dir > 0) {
+    for (int t = 0; t < row->ntok; t++) {
+      if (row->tok[t].start > E.cx) {
+        E.cx = row->tok[t].start;
+        return true;
+      }
+    }
+    int next = foldnext(E.cy);
+    if (next >= E.numrows || E.row[next].windowed)
+      return next >= E.numrows;
+    row = &E.row[next];
+    rowready(row);
+    E.cy = next;
+    E.cx = row->ntok ? row->tok[0].start : 0;
+    return true;
+  }
+  for (int t = row->ntok - 1; t >= 0; t--) {
+    if (row->tok[t].start < E.cx) {
+      E.cx = row->tok[t].start;
+      return true;
+    }
+  }
+  if (E.cy == 0 || E.row[foldprev(E.cy)].windowed)
+    return E.cy == 0;
+  E.cy = foldprev(E.cy);
+  row = &E.row[E.cy];
+  rowready(row);
+  E.cx = row->ntok ? row->tok[row->ntok - 1].start : 0;
+  return true;
+}
+
+// Word motions take their count in one call, each word scanning on from
+// where the last one stopped. w, b and e split words at blanks and at runs
+// of punctuation, W, B and E at blanks only
+
+// Whether line[i] is in a different word than line[i - 1]
+bool wordsplit(const char *line, int i, int mask) {
+  return CHARIS(line[i], CC_BLANK) || CHARIS(line[i - 1], CC_BLANK) ||
+         !CHARIS(line[i], mask) != !CHARIS(line[i - 1], mask);
+}
+
+// To the start of the next word, false at the end of the last row
+bool wordnext(int mask) {
+  struct erow *row = &E.row[E.cy];
+  int cx = E.cx;
+  if (cx < row->size && !CHARIS(row->line[cx], CC_BLANK))
+    while (++cx < row->size && !wordsplit(row->line, cx, mask))
+      ;
+  while (cx < row->size && CHARIS(row->line[cx], CC_BLANK))
+    cx++;
+  if (cx < row->size) {
+    E.cx = cx;
+    return true;
+  }
+  if (E.cy + 1 >= E.numrows) {
+    E.cx = MAX(row->size - 1, 0);
+    return false;
+  }
+  row = &E.row[++E.cy];
+  cx = 0;
+  while (cx < row->size && CHARIS(row->line[cx], CC_BLANK))
+    cx++;
+  E.cx = cx < row->size ? cx : 0;
+  return true;
+}
+
+// To the start of this word or the one before, false at the first row's
+// start
+bool wordprev(int mask) {
+  struct erow *row = &E.row[E.cy];
+  int cx = MIN(E.cx, row->size) - 1;
+  while (cx >= 0 && CHARIS(row->line[cx], CC_BLANK))
+    cx--;
+  if (cx < 0) {
+    if (E.cy == 0) {
+      E.cx = 0;
+      return false;
+    }
+    row = &E.row[--E.cy];
+    cx = row->size - 1;
+    while (cx >= 0 && CHARIS(row->line[cx], CC_BLANK))
+      cx--;
+    if (cx < 0) {
+      E.cx = 0;
+      return true;
+    }
+  }
+  while (cx > 0 && !wordsplit(row->line, cx, mask))
+    cx--;
+  E.cx = cx;
+  return true;
+}
+
+// To the end of this word or the next, over any blank rows
+bool wordlast(int mask) {
+  int cy = E.cy;
+  int cx = E.cx + 1;
+  struct erow *row = &E.row[cy];
+  while (1) {
+    while (cx < row->size && CHARIS(row->line[cx], CC_BLANK))
+      cx++;
+    if (cx < row->size)
+      break;
+    if (cy + 1 >= E.numrows)
+      return false;
+    row = &E.row[++cy];
+    cx = 0;
+  }
+  while (cx + 1 < row->size && !wordsplit(row->line, cx + 1, mask))
+    cx++;
+  E.cy = cy;
+  E.cx = cellstart(row, cx);
+  return true;
+}
+
+void nextWord(int key, int count) {
+  if (E.mode == 'i' || E.numrows == 0)
+    return;
+  int mask = key == 'w' ? CC_SEP : CC_BLANK;
+  for (int i = 0; i < count; i++) {
+    int cx = E.cx, cy = E.cy;
+    if (key == 'w' && tokenword(1)) {
+      if (E.cx == cx && E.cy == cy)
+        break;
+    } else if (!wordnext(mask))
+      break;
+  }
+}
+
+void prevWord(int key, int count) {
+  if (E.mode == 'i' || E.numrows == 0)
+    return;
+  int mask = key == 'b' ? CC_SEP : CC_BLANK;
+  for (int i = 0; i < count; i++) {
+    int cx = E.cx, cy = E.cy;
+    if (key == 'b' && tokenword(-1)) {
+      if (E.cx == cx && E.cy == cy)
+        break;
+    } else if (!wordprev(mask))
+      break;
+  }
+}
+
+void wordend(int key, int count) {
+  if (E.mode == 'i' || E.numrows == 0)
+    return;
+  int mask = key == 'e' ? CC_SEP : CC_BLANK;
+  for (int i = 0; i < count && wordlast(mask); i++)
+    ;
+}
+
+// Vim motion directions
+// Runs the keys of a register (@) or of the last change (.) count times,
+// drawing once they are done
+void replay(int key, int count) {
+  struct keylist *k = &input.last;
+  if (key == '@') {
+    int r = readkey();
+    if (r == '@')
+      r = input.lastreg + 'a';
+    if (r < 'a' || r > 'z' || r - 'a' == input.recording)
+      return;
+    input.lastreg = r - 'a';
+    k = &input.reg[r - 'a'];
+  }
+  if (k->n && queuekeys(k->k, k->n, count))
+    input.defer = true;
+}
+
+void processmotion(int key) {
+  if (E.mode == 'i')
+    return;
+
+  int count = 0;
+  int motion = 0;
+  int typed = 0; // the count if one was typed, 0 if not
+
+  if (isdigit(key) && key != '0') {
+    count = key - '0';
+    while (1) {
+      int k = readkey();
+      if (isdigit(k)) {
+        count = count * 10 + (k - '0');
+      } else {
+        motion = k;
+        break;
+      }
+    }
+    typed = count;
+  } else {
+    count = 1;
+    motion = key;
+  }
+  // Read-only views take motions only, whatever follows a count or g
+  if ((E.follow || E.pager.fd != -1) && !viewkey(motion))
+    return;
+  switch (motion) {
+  case '@':
+  case '.':
+    replay(motion, count);
+    break;
+  case CTRL_KEY('a'):
+  case CTRL_KEY('x'):
+    input.change = true;
+    incrementOrDecrement(motion == CTRL_KEY('a') ? count : -count);
+    break;
+  case 'd':
+    input.change = true;
+    NormalDelete(typed, '\0');
+    break;
+  case 'y':
+    NormalYank(typed, '\0');
+    break;
+  case 'x':
+    input.change = true;
+    NormalDelete(count, 'l');
+    break;
+  case '~':
+    input.change = true;
+    toggleCase(count);
+    break;
+  case CTRL_KEY('o'):
+  case '\t':
+    jumpgo(motion == '\t' ? count : -count);
+    break;
+  case 'g': {
+    int k = readkey();
+    if (k == ';' || k == ',')
+      changego(k == ';' ? -count : count);
+    else if (k == 'g')
+      countedmotion('G', count);
+    break;
+  }
+  default:
+    countedmotion(motion, typed);
+  }
+}
+
+// Index of the count-th c in the cursor's row after the cursor, or before
+// it for a negative count, -1 if there are fewer
+int rowfind(int c, int count) {
+  struct erow *row = &E.row[E.cy];
+  int dir = count > 0 ? 1 : -1;
+  for (int i = E.cx + dir; i >= 0 && i < row->size; i += dir)
+    if (row->line[i] == c && (count -= dir) == 0)
+      return i;
+  return -1;
+}
+
+// Runs a motion count times, finding where it ends in one step rather than
+// moving count times. A count of 0 is none typed, which only G tells from 1
+void countedmotion(int motion, int count) {
+  if (E.numrows == 0)
+    return;
+  int typed = count;
+  count = MAX(count, 1);
+  switch (motion) {
+  case 'w':
+  case 'W':
+    nextWord(motion, count);
+    break;
+  case 'b':
+  case 'B':
+    prevWord(motion, count);
+    break;
+  case 'e':
+  case 'E':
+    wordend(motion, count);
+    break;
+  case 'h':
+    cursorcells(-count);
+    break;
+  case 'l':
+    cursorcells(count);
+    break;
+  case 'j':
+    cursorrow(foldmove(E.cy, count));
+    break;
+  case 'k':
+    cursorrow(foldmove(E.cy, -count));
+    break;
+  case PG_UP:
+    cursorrow(foldmove(E.rowoff, -E.rows * count));
+    break;
+  case PG_DN:
+    cursorrow(foldmove(MIN(E.rowoff + E.rows - 1, E.numrows),
+                       E.rows * count));
+    break;
+  case 'G':
+    jumppush(E.cy, E.cx);
+    cursorrow((typed ? MIN(typed, E.numrows) : E.numrows) - 1);
+    break;
+  case 'g':
+    // gg after an operator, to the count-th row or the first
+    if (readkey() == 'g')
+      countedmotion('G', count);
+    break;
+  case '0':
+    E.cx = 0;
+    clearscreen();
+    break;
+
+  case '$':
+    E.cx = E.row[E.cy].size - 1;
+    clearscreen();
+    break;
+  case 'f':
+  case 't': {
+    int found = rowfind(readkey(), count);
+    if (found != -1)
+      E.cx = motion == 'f' ? found : found - 1;
+    break;
+  }
+  case 'F':
+  case 'T': {
+    int found = rowfind(readkey(), -count);
+    if (found != -1)
+      E.cx = motion == 'F' ? found : found + 1;
+    break;
+  }
+  case '^':
+    E.cx = 0;
+    while (isWhitespace(E.row[E.cy].line[E.cx]))
+      E.cx++;
+    break;
+
+  case '%': {
+    int matchX, matchY;
+    if (bracketmatch(E.cx, E.cy, &matchX, &matchY)) {
+      jumppush(E.cy, E.cx);
+      E.cx = matchX;
+      E.cy = matchY;
+    }
+    break;
+  }
+    // Move to top of the screen
+  case 'H':
+    jumppush(E.cy, E.cx);
+    cursorrow(MIN(E.rowoff + count - 1, E.numrows - 1));
+    break;
+
+  // Middle of the screen
+  case 'M':
+    jumppush(E.cy, E.cx);
+    cursorrow(MIN(E.rowoff + (E.rows - 1) / 2, E.numrows - 1));
+    break;
+
+  // Bottom of the screen
+  case 'L':
+    jumppush(E.cy, E.cx);
+    cursorrow(MAX(MIN(E.rowoff + E.rows, E.numrows) - count, 0));
+    break;
+  }
+}
+
+// Marks
+// m{a-z} marks the cursor's position, '{a-z} goes back to its row and `{a-z}
+// to the position itself. Jumps (G, gg, H, M, L, %, searches, marks and :N)
+// leave where they started in the jump list Ctrl-o and Ctrl-i walk, '' and
+// `` going back to the last one. Changes leave where they were made in the
+// change list g; and g, walk. Every position is a node of the E.marks treap,
+// shifted with the rows by markshift
+
+void markapply(struct mark *m, int d) {
+  if (!m)
+    return;
+  m->row += d;
+  m->shift += d;
+}
+
+void markpush(struct mark *m) {
+  if (m->shift) {
+    markapply(m->l, m->shift);
+    markapply(m->r, m->shift);
+    m->shift = 0;
+  }
+}
+
+void markpull(struct mark *m) {
+  if (m->l)
+    m->l->up = m;
+  if (m->r)
+    m->r->up = m;
+}
+
+// Splits t into the marks above row and the rest
+void marksplit(struct mark *t, int row, struct mark **a, struct mark **b) {
+  if (!t) {
+    *a = *b = NULL;
+    return;
+  }
+  markpush(t);
+  if (t->row < row) {
+    marksplit(t->r, row, &t->r, b);
+    *a = t;
+  } else {
+    marksplit(t->l, row, a, &t->l);
+    *b = t;
+  }
+  markpull(t);
+}
+
+struct mark *markmerge(struct mark *a, struct mark *b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (a->prio > b->prio) {
+    markpush(a);
+    a->r = markmerge(a->r, b);
+    markpull(a);
+    return a;
+  }
+  markpush(b);
+  b->l = markmerge(a, b->l);
+  markpull(b);
+  return b;
+}
+
+void markroot(struct mark *t) {
+  if (t)
+    t->up = NULL;
+  E.marks.root = t;
+}
+
+// The row of m, its own plus the shifts still owed to it from above
+int markrow(struct mark *m) {
+  int row = m->row;
+  for (struct mark *p = m->up; p; p = p->up)
+    row += p->shift;
+  return row;
+}
+
+struct mark *markadd(int row, int col) {
+  struct mark *m = malloc(sizeof(struct mark));
+  if (!m)
+    die("malloc");
+  *m = (struct mark){.row = row, .col = col, .prio = rand()};
+  struct mark *a, *b;
+  marksplit(E.marks.root, row, &a, &b);
+  markroot(markmerge(markmerge(a, m), b));
+  return m;
+}
+
+// Applies the shifts owed to m from the root down
+void markpushpath(struct mark *m) {
+  if (m->up) {
+    markpushpath(m->up);
+    markpush(m->up);
+  }
+}
+
+void markdrop(struct mark *m) {
+  if (!m)
+    return;
+  markpushpath(m);
+  markpush(m);
+  struct mark *t = markmerge(m->l, m->r);
+  struct mark *p = m->up;
+  if (t)
+    t->up = p;
+  if (!p)
+    E.marks.root = t;
+  else if (p->l == m)
+    p->l = t;
+  else
+    p->r = t;
+  free(m);
+}
+
+void markclamp(struct mark *t, int row) {
+  if (!t)
     return;
-  int (*fptr)(int) = ((key == 'w') ? &isSepator : &isWhitespace);
-  int cx = E.cx;
-  int cy = E.cy;
-  while (cy < E.numrows) {
-    struct erow *row = &E.row[cy];
-    if (fptr(row->line[cx])) {
-      while (cx < row->size && fptr(row->line[cx]))
-        cx++;
-      if (cx < row->size) {
-        E.cx = cx;
-        E.cy = cy;
-        return;
-      }
-    } else {
-      while (cx < row->size && isWhitespace(row->line[cx]))
-        cx++;
-      while (cx < row->size && !fptr(row->line[cx]))
-        cx++;
-      while (cx < row->size && isWhitespace(row->line[cx]))
-        cx++;
-    }
-    if (cx < row->size) {
-      E.cx = cx;
-      E.cy = cy;
-      return;
-    } else {
-      cx = 0;
-      cy++;
-      E.cx = cx;
-      E.cy = cy;
-      while (isWhitespace(E.row[E.cy].line[E.cx]))
-        E.cx++;
-      return;
-    }
-  }
-  E.cx = 0;
-  E.cy = E.numrows - 1;
+  markpush(t);
+  t->row = row;
+  markclamp(t->l, row);
+  markclamp(t->r, row);
 }
 
-void prevWord(char key) {
-  if (E.mode == 'i')
+// Keeps marks on their rows after d rows are inserted at row at, or -d rows
+// deleted from it. Marks on deleted rows move to the row now at at, the
+// only ones visited
+void markshift(int at, int d) {
+  if (!E.marks.root || !d)
     return;
-  int (*fptr)(int) = ((key == 'b') ? &isSepator : &isWhitespace);
-  int cx = E.cx;
-  int cy = E.cy;
-  while (cy >= 0) {
-    struct erow *row = &E.row[cy];
-    if (fptr(row->line[cx])) {
-      while (cx >= 0 && fptr(row->line[cx]))
-        cx--;
-      while (cx >= 0 && !fptr(row->line[cx]))
-        cx--;
-      if (cx >= 0) {
-        E.cx = cx + 1;
-        E.cy = cy;
-        return;
-      }
-    } else {
-      while (cx > -1 && isWhitespace(row->line[cx]))
-        cx--;
-      while (cx > -1 && !fptr(row->line[cx]))
-        cx--;
-      while (cx > -1 && isWhitespace(row->line[cx]))
-        cx--;
-    }
-    if (cx > -1) {
-      E.cx = cx;
-      E.cy = cy;
-      return;
-    } else {
-      cy = ((cy > 0) ? cy - 1 : 0);
-      cx = E.row[cy].size - 1;
-      E.cx = cx;
-      E.cy = cy;
-      while (isWhitespace(E.row[E.cy].line[E.cx]))
-        E.cx--;
-      // if (isSepator(E.row[E.cy].line[E.cx + 1]))
-      //   E.cx++;
-      return;
-    }
+  struct mark *a, *b, *m = NULL;
+  marksplit(E.marks.root, at, &a, &b);
+  if (d < 0) {
+    marksplit(b, at - d, &m, &b);
+    markclamp(m, at);
   }
-  E.cx = E.row[0].size;
-  E.cy = 0;
+  markapply(b, d);
+  markroot(markmerge(markmerge(a, m), b));
 }
 
-void wordend() {
-  if (E.mode == 'i')
+void markfree(struct mark *t) {
+  if (!t)
     return;
+  markfree(t->l);
+  markfree(t->r);
+  free(t);
+}
 
+// Moves to m, its column with exact or else the row's first non-blank
+void markgo(struct mark *m, bool exact) {
+  if (E.numrows == 0)
+    return;
+  int r = markrow(m);
+  if (E.pager.fd != -1 && (r < 0 || r >= E.numrows))
+    pagergoto(E.pager.base + r, m->col);
+  else
+    cursorrow(MIN(r, E.numrows - 1));
   struct erow *row = &E.row[E.cy];
-  int i = E.cx + 1;
+  if (exact)
+    E.cx = m->col;
+  else
+    for (E.cx = 0; E.cx < row->size && isWhitespace(row->line[E.cx]);)
+      E.cx++;
+  cursorfit();
+}
 
-  while (i < row->size && isWhitespace(row->line[i]))
-    i++;
+// Drops entry i of a list of n marks
+void markremove(struct mark **list, int *n, int i) {
+  markdrop(list[i]);
+  memmove(&list[i], &list[i + 1], sizeof(*list) * (--*n - i));
+}
 
-  if (i >= row->size) {
-    if (E.cy + 1 < E.numrows) {
-      E.cy++;
-      E.cx = 0;
-    }
+// Where a jump starts from, replacing an older one on the same row
+void jumppush(int row, int col) {
+  struct marks *k = &E.marks;
+  for (int i = k->njump - 1; i >= 0; i--)
+    if (markrow(k->jump[i]) == row)
+      markremove(k->jump, &k->njump, i);
+  if (k->njump == JUMPS_MAX)
+    markremove(k->jump, &k->njump, 0);
+  k->jump[k->njump++] = markadd(row, col);
+  k->jumpat = k->njump;
+}
+
+// Where a change was made, the last one moving along while on its row
+void changepush(int row, int col) {
+  struct marks *k = &E.marks;
+  k->changeat = k->nchange;
+  if (k->nchange && markrow(k->change[k->nchange - 1]) == row) {
+    k->change[k->nchange - 1]->col = col;
     return;
   }
+  if (k->nchange == CHANGES_MAX)
+    markremove(k->change, &k->nchange, 0);
+  k->change[k->nchange++] = markadd(row, col);
+  k->changeat = k->nchange;
+}
 
-  bool in_separator = isSepator(row->line[i]);
-
-  while (i < row->size) {
-    char c = row->line[i];
-    if (isWhitespace(c))
-      break;
-    if (in_separator && !isSepator(c))
-      break;
-    if (!in_separator && isSepator(c))
-      break;
-    i++;
+// Ctrl-o and Ctrl-i, n entries on in the jump list or back for n < 0
+void jumpgo(int n) {
+  struct marks *k = &E.marks;
+  if (n < 0 && k->jumpat == k->njump && k->njump) {
+    // Ctrl-i can come back to where Ctrl-o was first used
+    jumppush(E.cy, E.cx);
+    k->jumpat = k->njump - 1;
   }
+  int to = k->jumpat + n;
+  if (to < 0 || to >= k->njump)
+    return;
+  k->jumpat = to;
+  markgo(k->jump[to], true);
+}
 
-  if (i > 0)
-    i--;
+// g; and g,
+void changego(int n) {
+  struct marks *k = &E.marks;
+  int to = k->changeat + n;
+  if (to < 0 || to >= k->nchange) {
+    setstatus(k->nchange ? "At the end of the change list" : "No changes");
+    return;
+  }
+  k->changeat = to;
+  markgo(k->change[to], true);
+}
 
-  E.cx = i;
+// m{a-z}
+void markset(int name) {
+  if (name < 'a' || name > 'z' || E.numrows == 0)
+    return;
+  markdrop(E.marks.named[name - 'a']);
+  E.marks.named[name - 'a'] = markadd(E.cy, E.cx);
 }
 
-// Vim motion directions
-void processmotion(int key) {
-  if (E.mode == 'i')
+// '{a-z} and `{a-z}, '' and `` for the start of the last jump
+void markjump(int name, bool exact) {
+  struct marks *k = &E.marks;
+  struct mark *m;
+  if (name == '\'' || name == '`') {
+    if (!k->njump)
+      return;
+    m = k->jump[k->njump - 1];
+  } else if (name >= 'a' && name <= 'z' && k->named[name - 'a'])
+    m = k->named[name - 'a'];
+  else {
+    setstatus("Mark not set");
     return;
+  }
+  int row = markrow(m), col = m->col;
+  jumppush(E.cy, E.cx);
+  struct mark to = {.row = row, .col = col};
+  markgo(&to, exact);
+}
 
-  int count = 0;
-  int motion = 0;
+// Registers
+// "x before a yank, delete or put names the register it uses. Without a
+// name yanks go to "0 and deletes to "1, moving the older ones up to "9, and
+// either to the unnamed register p puts from. "A to "Z append to "a to "z.
+// Text is written once into the arena as it is yanked, and only the slice
+// is handed between registers
 
-  if (isdigit(key) && key != '0') {
-    count = key - '0';
-    while (1) {
-      int k = readkey();
-      if (isdigit(k)) {
-        count = count * 10 + (k - '0');
-      } else {
-        motion = k;
-        break;
-      }
-    }
-  } else {
-    count = 1;
-    motion = key;
+#define ARENA_CHUNK (1 << 20)
+
+void chunkdrop(struct chunk *c) {
+  if (c && --c->refs == 0)
+    free(c);
+}
+
+void regset(struct reg *dst, struct reg src) {
+  if (src.chunk)
+    src.chunk->refs++;
+  chunkdrop(dst->chunk);
+  *dst = src;
+}
+
+const char *regtext(struct reg *r) { return &r->chunk->text[r->off]; }
+
+// Starts a text at the end of the arena
+void arenaopen() { regs.start = regs.fill ? regs.fill->len : 0; }
+
+void arenaput(const char *s, size_t n) {
+  struct chunk *c = regs.fill;
+  if (!c || c->len + n > c->cap) {
+    // The text written so far moves into the new chunk
+    size_t have = c ? c->len - regs.start : 0;
+    size_t cap = MAX(ARENA_CHUNK, 2 * (have + n));
+    struct chunk *new = malloc(sizeof(struct chunk) + cap);
+    if (!new)
+      die("malloc");
+    new->refs = 1;
+    new->len = have;
+    new->cap = cap;
+    if (have)
+      memcpy(new->text, &c->text[regs.start], have);
+    chunkdrop(c);
+    regs.fill = c = new;
+    regs.start = 0;
   }
+  memcpy(&c->text[c->len], s, n);
+  c->len += n;
+}
 
-  for (int i = 0; i < count; i++) {
-    switch (motion) {
-    case 'h':
-      movecursor(ARROW_LEFT);
-      break;
-    case 'j':
-      movecursor(ARROW_DOWN);
-      break;
-    case 'k':
-      movecursor(ARROW_UP);
-      break;
-    case 'l':
-      movecursor(ARROW_RIGHT);
-      break;
-    case 'w':
-    case 'W':
-      nextWord(key);
-      break;
-    case 'b':
-    case 'B':
-      prevWord(key);
-      break;
-    case 'e':
-    case 'E':
-      wordend();
-      break;
+// The text written since arenaopen
+struct reg arenaclose(bool linewise) {
+  arenaput("", 0);
+  return (struct reg){regs.fill, regs.start, regs.fill->len - regs.start,
+                      linewise};
+}
 
-    case '0':
-      E.cx = 0;
-      clearscreen();
-      break;
+struct reg *regget(int name) {
+  if (isalpha(name))
+    return &regs.named[tolower(name) - 'a'];
+  if (name == '0')
+    return &regs.yanked;
+  if (name >= '1' && name <= '9')
+    return &regs.deleted[(regs.ring + name - '1') % 9];
+  return &regs.unnamed;
+}
 
-    case '$':
-      E.cx = E.row[E.cy].size - 1;
-      clearscreen();
-      break;
-    case 'f': {
-      int k = readkey();
-      int found = -1;
-      for (int i = E.cx + 1; i < E.row[E.cy].size; i++) {
-        if (E.row[E.cy].line[i] == k) {
-          found = i;
-          break;
-        }
-      }
-      if (found + 1)
-        E.cx = found;
-      break;
-    }
-    case 'F': {
-      int k = readkey();
-      if (E.cx <= 0)
-        return;
-      int found = -1;
-      for (int i = E.cx - 1; i >= 0; i--) {
-        if (E.row[E.cy].line[i] == k) {
-          found = i;
-          break;
-        }
-      }
-      if (found + 1)
-        E.cx = found;
+// System clipboard
+// With SYSTEM_CLIPBOARD=1 the text is written to the terminal in an OSC 52
+// sequence, which reaches the clipboard of the machine the terminal runs
+// on, over SSH too. With 2 it is piped to wl-copy under Wayland or xclip
+// under X, from a thread that holds a reference to the register's slice, so
+// a 100 MB yank is streamed without a copy while editing goes on. A newer
+// yank cuts one still being sent short
+
+void clipsend(const char *s, size_t len) {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  if (len > OSC52_MAX) {
+    setstatus("Over %d bytes, not copied to the terminal's clipboard",
+              OSC52_MAX);
+    return;
+  }
+  size_t n = 0;
+  char *out = malloc(len / 3 * 4 + 16);
+  n += sprintf(out, "\x1b]52;c;");
+  for (size_t i = 0; i < len; i += 3) {
+    unsigned v = (unsigned char)s[i] << 16;
+    if (i + 1 < len)
+      v |= (unsigned char)s[i + 1] << 8;
+    if (i + 2 < len)
+      v |= (unsigned char)s[i + 2];
+    out[n++] = b64[v >> 18 & 63];
+    out[n++] = b64[v >> 12 & 63];
+    out[n++] = i + 1 < len ? b64[v >> 6 & 63] : '=';
+    out[n++] = i + 2 < len ? b64[v & 63] : '=';
+  }
+  out[n++] = '\a';
+  write(STDOUT_FILENO, out, n);
+  free(out);
+}
 
+void *clipthread(void *arg) {
+  struct clipcopy *c = arg;
+  const char *s = regtext(&c->text);
+  size_t left = c->text.len;
+  while (left) {
+    ssize_t n = send(c->fd, s, left, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
       break;
-    }
-    case 't': {
-      int k = readkey();
-      int found = -1;
-      for (int i = E.cx + 1; i < E.row[E.cy].size; i++) {
-        if (E.row[E.cy].line[i] == k) {
-          found = i;
-          break;
-        }
-      }
-      if (found > 0)
-        E.cx = found - 1;
+    s += n;
+    left -= n;
+  }
+  shutdown(c->fd, SHUT_WR);
+  while (waitpid(c->pid, &c->status, 0) == -1 && errno == EINTR)
+    ;
+  return NULL;
+}
 
-      break;
-    }
-    case 'T': {
-      int k = readkey();
-      if (E.cx <= 0)
-        return;
-      int found = -1;
-      for (int i = E.cx - 1; i < E.row[E.cy].size; i++) {
-        if (E.row[E.cy].line[i] == k) {
-          found = i;
-          break;
-        }
-      }
-      if (found > 0)
-        E.cx = found + 1;
+// Frees what the thread used once it is done, or waits for it with wait
+void clipdone(bool wait) {
+  struct clipcopy *c = &regs.clip;
+  if (!c->running)
+    return;
+  if (wait)
+    pthread_join(c->thread, NULL);
+  else if (pthread_tryjoin_np(c->thread, NULL) != 0)
+    return;
+  close(c->fd);
+  regset(&c->text, (struct reg){0});
+  c->running = false;
+  if (!WIFEXITED(c->status) || WEXITSTATUS(c->status) != 0)
+    setstatus("%s failed, not copied to the clipboard", c->helper);
+}
 
-      break;
-    }
-    case '^':
-      E.cx = 0;
-      while (isWhitespace(E.row[E.cy].line[E.cx]))
-        E.cx++;
-      break;
+void cliptick() { clipdone(false); }
 
-    case '%': {
-      char currentChar = E.row[E.cy].line[E.cx];
-      int matchX = -1, matchY = -1;
-      if (currentChar == '(' || currentChar == '{' || currentChar == '[' ||
-          currentChar == '<') {
-        if (matchingParen(currentChar, E.cx, E.cy, &matchX, &matchY)) {
-          E.cx = matchX;
-          E.cy = matchY;
-        }
-      } else if (currentChar == ')' || currentChar == '}' ||
-                 currentChar == ']' || currentChar == '>') {
-        char match;
-        switch (currentChar) {
-        case ')':
-          match = '(';
-          break;
-        case '}':
-          match = '{';
-          break;
-        case ']':
-          match = '[';
-          break;
-        case '>':
-          match = '<';
-          break;
-        default:
-          match = '\0';
-          break;
-        }
-        if (match != '\0') {
-          int depth = 1;
-          int x = E.cx - 1;
-          int y = E.cy;
-          while (y >= 0) {
-            while (x >= 0) {
-              if (E.row[y].highlight &&
-                  (E.row[y].highlight[x] == STRING ||
-                   E.row[y].highlight[x] == COMMENT ||
-                   E.row[y].highlight[x] == MULTICOMMENT)) {
-                x--;
-                continue;
-              }
-              char c = E.row[y].line[x];
-              if (c == currentChar) {
-                depth++;
-              } else if (c == match) {
-                depth--;
-                if (depth == 0) {
-                  matchX = x;
-                  matchY = y;
-                  goto foundMatch;
-                }
-              }
-              x--;
-            }
-            y--;
-            if (y >= 0)
-              x = strlen(E.row[y].line) - 1;
-          }
-        foundMatch:
-          if (matchX != -1 && matchY != -1) {
-            E.cx = matchX;
-            E.cy = matchY;
-          }
-        }
-      }
-      break;
-    }
-      // Move to top of the screen
-    case 'H':
-      E.cy = E.rowoff;
-      break;
+void clippipe(struct reg *r) {
+  struct clipcopy *c = &regs.clip;
+  if (c->running) {
+    shutdown(c->fd, SHUT_RDWR);
+    clipdone(true);
+  }
+  char *wayland[] = {"wl-copy", NULL};
+  char *x[] = {"xclip", "-selection", "clipboard", "-i", NULL};
+  char **argv = getenv("WAYLAND_DISPLAY") ? wayland : x;
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    return;
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(sv[1], STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  close(sv[1]);
+  if (pid == -1) {
+    close(sv[0]);
+    return;
+  }
+  *c = (struct clipcopy){.fd = sv[0], .pid = pid, .status = -1,
+                         .helper = argv[0]};
+  regset(&c->text, *r);
+  c->running = pthread_create(&c->thread, NULL, clipthread, c) == 0;
+  if (!c->running) {
+    close(c->fd);
+    regset(&c->text, (struct reg){0});
+  }
+}
 
-    // Middle of the screen
-    case 'M':
-      E.cy = E.rowoff + (E.rows - 1) / 2;
-      break;
+void clipsync(struct reg *r) {
+  if (SYSTEM_CLIPBOARD == 1)
+    clipsend(regtext(r), r->len);
+  else if (SYSTEM_CLIPBOARD == 2)
+    clippipe(r);
+}
 
-    // Bottom of the screen
-    case 'L':
-      E.cy = E.rowoff + E.rows - 1;
-      break;
-    }
+// Puts a text just written in the register named for it
+void regstore(struct reg r, bool deleted) {
+  int name = regs.pending;
+  regs.pending = 0;
+  struct reg *named = isalpha(name) ? regget(name) : NULL;
+  if (isupper(name) && named->chunk) {
+    r.chunk->refs++;
+    arenaopen();
+    arenaput(regtext(named), named->len);
+    arenaput(regtext(&r), r.len);
+    chunkdrop(r.chunk);
+    r = arenaclose(named->linewise || r.linewise);
   }
+  if (named)
+    regset(named, r);
+  else if (deleted) {
+    regs.ring = (regs.ring + 8) % 9;
+    regset(&regs.deleted[regs.ring], r);
+  } else
+    regset(&regs.yanked, r);
+  regset(&regs.unnamed, r);
+  clipsync(&regs.unnamed);
 }
 
-void yankSelection() {
-  if (clipboard) {
-    free(clipboard);
-    clipboard = NULL;
+// Stores rows from..to as whole rows
+void regrows(int from, int to, bool deleted) {
+  arenaopen();
+  for (int y = from; y <= to && y < E.numrows; y++) {
+    arenaput(E.row[y].line, E.row[y].size);
+    arenaput("\n", 1);
   }
+  regstore(arenaclose(true), deleted);
+}
 
-  int totalSize = 0;
+// Stores the selection, in one pass over its rows
+void selectionstore(bool deleted) {
   int startY = MIN(E.sel_y, E.cy);
   int endY = MAX(E.sel_y, E.cy);
   int startX = (E.sel_y < E.cy) ? E.sel_x : E.cx;
   int endX = (E.sel_y < E.cy) ? E.cx : E.sel_x;
+  arenaopen();
   if (startY == endY) {
+    struct erow *row = &E.row[startY];
     int start = MIN(startX, endX);
-    int end = MAX(startX, endX);
-    totalSize = end - start + 1;
-
-    if (E.yankNewline) {
-      totalSize++;
-    }
+    int end = MIN(MAX(startX, endX) + 1, row->size);
+    if (start < end)
+      arenaput(&row->line[start], end - start);
+    if (E.yankNewline)
+      arenaput("\n", 1);
   } else {
-    // Multi-line
     for (int i = startY; i <= endY; i++) {
       struct erow *row = &E.row[i];
-      if (i == startY) {
-        totalSize += row->size - startX;
-      } else if (i == endY) {
-        totalSize += endX + 1;
-      } else {
-        totalSize += row->size;
-      }
-      totalSize++;
+      int from = i == startY ? MIN(startX, row->size) : 0;
+      int to = i == endY ? MIN(endX + 1, row->size) : row->size;
+      if (from < to)
+        arenaput(&row->line[from], to - from);
+      arenaput("\n", 1);
     }
   }
-  if (totalSize == 0)
-    return;
-  clipboard = malloc(totalSize + 1);
-  if (!clipboard)
-    return;
-  int pos = 0;
-  if (startY == endY) {
-    // Single line
-    int start = MIN(startX, endX);
-    int end = MAX(startX, endX);
-    struct erow *row = &E.row[startY];
-
-    for (int j = start; j <= end; j++) {
-      if (j < row->size) {
-        clipboard[pos++] = row->line[j];
-      }
-    }
-
-    if (E.yankNewline) {
-      clipboard[pos++] = '\n';
-    }
-  } else {
-    // Multi-line
-    for (int i = startY; i <= endY; i++) {
-      struct erow *row = &E.row[i];
-
-      if (i == startY) {
-        for (int j = startX; j < row->size; j++) {
-          clipboard[pos++] = row->line[j];
-        }
-      } else if (i == endY) {
-        for (int j = 0; j <= endX && j < row->size; j++) {
-          clipboard[pos++] = row->line[j];
-        }
-      } else {
-        for (int j = 0; j < row->size; j++) {
-          clipboard[pos++] = row->line[j];
-        }
-      }
+  regstore(arenaclose(E.yankNewline), deleted);
+  E.yankNewline = false;
+}
 
-      clipboard[pos++] = '\n';
+void yankSelection() { selectionstore(false); }
+
+// Splits s into the lines of rows from row at, a newline ending s ending the
+// last one. There is room for one more line
+struct rowsnap *textlines(const char *s, size_t len, int at, int *m) {
+  int n = 0, cap = 16;
+  struct rowsnap *lines = malloc(sizeof(struct rowsnap) * cap);
+  for (size_t i = 0; i < len;) {
+    const char *nl = memchr(&s[i], '\n', len - i);
+    int end = nl ? nl - &s[i] : (int)(len - i);
+    int size = end;
+    if (size > 0 && s[i + size - 1] == '\r')
+      size--;
+    if (n + 1 == cap) {
+      cap *= 2;
+      lines = realloc(lines, sizeof(struct rowsnap) * cap);
     }
+    char *line = malloc(size + 1);
+    memcpy(line, &s[i], size);
+    line[size] = '\0';
+    lines[n] = (struct rowsnap){at + n, line, size};
+    n++;
+    i += end + 1;
   }
+  *m = n;
+  return lines;
+}
 
-  clipboard[pos] = '\0';
-  E.yankNewline = false;
+// Puts text at the cursor, the cursor's row split around it
+void putchars(const char *s, size_t len) {
+  int m;
+  struct rowsnap *lines = textlines(s, len, E.cy, &m);
+  if (!len || s[len - 1] == '\n') {
+    lines[m] = (struct rowsnap){E.cy + m, strdup(""), 0};
+    m++;
+  }
+  // The cursor may sit on the line past the last row, which has no text
+  int n = E.cy < E.numrows;
+  const char *line = n ? E.row[E.cy].line : "";
+  int size = n ? E.row[E.cy].size : 0;
+  int cx = MIN(E.cx, size);
+  int after = size - cx;
+  struct rowsnap *first = &lines[0], *last = &lines[m - 1];
+  first->line = realloc(first->line, first->size + cx + 1);
+  memmove(&first->line[cx], first->line, first->size + 1);
+  memcpy(first->line, line, cx);
+  first->size += cx;
+  int endcx = last->size;
+  last->line = realloc(last->line, last->size + after + 1);
+  memcpy(&last->line[last->size], &line[cx], after + 1);
+  last->size += after;
+  int y = E.cy;
+  exreplace(y, n, lines, m);
+  free(lines);
+  E.cy = y + m - 1;
+  E.cx = endcx;
 }
 
 void pasteClipboard() {
-  if (!clipboard)
-    return;
-
-  char *clipboardCopy = strdup(clipboard);
-  if (!clipboardCopy)
+  int name = regs.pending;
+  regs.pending = 0;
+  struct reg *r = regget(name);
+  if (!r->chunk) {
+    setstatus("Register %c is empty", name ? name : '"');
     return;
-
-  char *saveptr;
-  char *line = strtok_r(clipboardCopy, "\n", &saveptr);
-  bool firstLine = true;
-
-  while (line) {
-    if (!firstLine) {
-      insertnewline();
-    }
-
-    for (int i = 0; line[i]; i++) {
-      insertchar(line[i]);
-    }
-
-    firstLine = false;
-    line = strtok_r(NULL, "\n", &saveptr);
   }
-
-  // If clipboard ends with newline, add final newline
-  if (clipboard[strlen(clipboard) - 1] == '\n') {
-    insertnewline();
+  if (!r->linewise) {
+    putchars(regtext(r), r->len);
+    return;
   }
-
-  free(clipboardCopy);
+  // The cursor may sit on the line past the last row
+  int at = MIN(E.cy + 1, E.numrows);
+  int m;
+  struct rowsnap *lines = textlines(regtext(r), r->len, at, &m);
+  if (!m)
+    lines[m++] = (struct rowsnap){at, strdup(""), 0};
+  exreplace(at, 0, lines, m);
+  free(lines);
 }
 
 void deleteSelection() {
-  yankSelection();
+  selectionstore(true);
   for (int i = MIN(E.sel_y, E.cy); i <= MAX(E.cy, E.sel_y); i++)
     pushUndo(EDITDELETE, i, -1);
 
@@ -2112,118 +7425,106 @@ void deleteSelection() {
   E.mode = 'n';
 }
 
-bool openParen(char match, int x, int y, int *outx, int *outy) {
-  char end = '\0';
-  switch (match) {
-  case '(':
-    end = ')';
-    break;
-  case '{':
-    end = '}';
-    break;
-  case '[':
-    end = ']';
-    break;
-  case '<':
-    end = '>';
-    break;
-  }
-  int depth = 0;
-  while (true) {
-    char c = E.row[y].line[x];
-    if (c == end)
-      depth++;
-    else if (c == match) {
-      if (depth == 0) {
-        *outx = x;
-        *outy = y;
-        return true;
-      } else {
-        depth--;
-      }
-    }
+// Block selection
+// Rows from sel_y to the cursor, render columns from sel_x to the cursor's.
+// Deleting splices the block out of every row in one pass of mcedit, and
+// inserting puts a cursor on every row, so a block edit is one undo step
 
-    if (--x < 0) {
-      if (--y < 0)
-        return false;
-      x = strlen(E.row[y].line) - 1;
-    }
+void blockbounds(int *top, int *bottom, int *left, int *right) {
+  *top = MIN(E.sel_y, E.cy);
+  *bottom = MAX(E.sel_y, E.cy);
+  *left = MIN(E.sel_x, E.rx);
+  *right = MAX(E.sel_x, E.rx);
+}
+
+void blockyank(bool deleted) {
+  int top, bottom, left, right;
+  blockbounds(&top, &bottom, &left, &right);
+  arenaopen();
+  for (int y = top; y <= bottom; y++) {
+    struct erow *row = &E.row[y];
+    int to, from = spanblock(row, rxtocx(row, left), &to);
+    arenaput(&row->line[from], to - from);
+    if (y < bottom)
+      arenaput("\n", 1);
   }
+  regstore(arenaclose(false), deleted);
 }
 
-bool matchingParen(char match, int x, int y, int *outx, int *outy) {
-  char end = '\0';
-  switch (match) {
-  case '(':
-    end = ')';
-    break;
-  case '{':
-    end = '}';
-    break;
-  case '[':
-    end = ']';
-    break;
-  case '<':
-    end = '>';
-    break;
+// Yanks (y), deletes (d, x), changes (c) or inserts before (I) or after (A)
+// the block, returns false for other keys
+bool blockkey(int c) {
+  if (c != 'y' && c != 'd' && c != 'x' && c != 'c' && c != 'I' && c != 'A')
+    return false;
+  input.change = c != 'y';
+  int top, bottom, left, right;
+  blockbounds(&top, &bottom, &left, &right);
+  E.mode = 'n';
+  E.block = false;
+  E.multi.right = right;
+  if (c == 'y') {
+    blockyank(false);
+    E.cy = top;
+    E.cx = rxtocx(&E.row[top], left);
+    return true;
   }
-  int depth = 0;
-  int len;
-  while (true) {
-    char c = E.row[y].line[x];
-    if (c == match)
-      depth++;
-    else if (c == end) {
-      depth--;
-      if (depth == 0) {
-        *outx = x;
-        *outy = y;
-        return true;
-      }
-    }
+  mcclear();
+  for (int y = top; y <= bottom; y++) {
+    struct erow *row = &E.row[y];
+    if (c == 'A') {
+      int i = mcadd(0, y);
+      spanblock(row, 0, &E.multi.at[i].x);
+    } else if (row->width > left)
+      mcadd(rxtocx(row, left), y);
+  }
+  if (!E.multi.n) {
+    E.cy = top;
+    return true;
+  }
+  E.multi.main = 0;
+  E.multi.block = true;
+  coalesce_state.active = false;
+  if (c == 'd' || c == 'x' || c == 'c') {
+    blockyank(true);
+    mcedit("", 0, spanblock);
+  }
+  if (c == 'd' || c == 'x')
+    mcclear();
+  else
+    E.mode = 'i';
+  if (E.multi.n)
+    mcmerge();
+  return true;
+}
+
+// Open bracket of kind `match` around line offset x of row y, or the one
+// paired with a close bracket at x
+bool openParen(char match, int x, int y, int *outx, int *outy) {
+  bool open;
+  int k = bracketkind(match, &open);
+  if (k < 0 || y < 0 || y >= E.numrows)
+    return false;
+  struct erow *row = &E.row[y];
+  int t = bracketat(row, x + 1) - 1;
+  bool onclose = t >= 0 && row->brk[t] == x &&
+                 bracketkind(row->line[x], &open) == k && !open;
+  return bracketbackward(k, y, t, onclose ? 0 : 1, outx, outy);
+}
 
-    x++;
-    len = strlen(E.row[y].line);
-    if (x >= len) {
-      x = 0;
-      if (++y >= E.numrows)
-        return false;
-    }
-  }
+// Close bracket paired with the open bracket `match` at line offset x
+bool matchingParen(char match, int x, int y, int *outx, int *outy) {
+  if (y < 0 || y >= E.numrows || x < 0 || x >= E.row[y].size ||
+      E.row[y].line[x] != match)
+    return false;
+  return bracketmatch(x, y, outx, outy);
 }
 
 bool insideParens(char match, int x, int y) {
-  char end = '\0';
-  switch (match) {
-  case '(':
-    end = ')';
-    break;
-  case '{':
-    end = '}';
-    break;
-  case '[':
-    end = ']';
-    break;
-  case '<':
-    end = '>';
-    break;
-  }
-  int tempx = x, tempy = y;
-  while (tempx >= 0) {
-    if (E.row[tempy].line[tempx] == end)
-      return false;
-    if (E.row[tempy].line[tempx] == match) {
-      int matchx, matchy;
-      if (matchingParen(match, tempx, tempy, &matchx, &matchy)) {
-        if ((matchy > y) || (matchy == y && matchx >= x))
-          return true;
-        else
-          return false;
-      }
-    }
-    tempx--;
-  }
-  return false;
+  int openx, openy, closex, closey;
+  if (!openParen(match, x, y, &openx, &openy) ||
+      !matchingParen(match, openx, openy, &closex, &closey))
+    return false;
+  return closey > y || (closey == y && closex >= x);
 }
 
 void processSelection() {
@@ -2231,6 +7532,8 @@ void processSelection() {
     return;
 
   int c = readkey();
+  if (E.block && blockkey(c))
+    return;
   switch (c) {
   case CTRL_KEY('q'):
     if (E.dirty) {
@@ -2244,9 +7547,7 @@ void processSelection() {
         break;
       }
     }
-    write(STDOUT_FILENO, "\x1b[2j", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
+    editorquit();
 
     break;
   case CTRL_KEY('s'):
@@ -2260,12 +7561,27 @@ void processSelection() {
     break;
     return;
 
+  case CTRL_KEY('v'):
+    E.block = !E.block;
+    break;
+
+  case CTRL_KEY('n'):
+    mcselection();
+    break;
+
   case CTRL_KEY('c'):
   case 'y':
     yankSelection();
     E.mode = 'n';
     break;
 
+  case '"': {
+    int k = readkey();
+    if (isalnum(k) || k == '"')
+      regs.pending = k;
+    break;
+  }
+
   case '\x1b':
     E.mode = 'n';
     break;
@@ -2278,12 +7594,24 @@ void processSelection() {
     break;
 
   case 'd':
+    input.change = true;
     deleteSelection();
     break;
   case 'c':
+    input.change = true;
     deleteSelection();
     E.mode = 'i';
     break;
+  case 'z':
+    // zf folds the selected rows
+    if (readkey() == 'f' && E.sel_y != E.cy) {
+      if (!foldcreate(MIN(E.sel_y, E.cy), MAX(E.sel_y, E.cy)))
+        setstatus("Folds must nest inside each other");
+      E.cy = MIN(E.sel_y, E.cy);
+      wrapInvalidate();
+    }
+    E.mode = 'n';
+    break;
   case 'i': {
     int k = readkey();
     switch (k) {
@@ -2325,7 +7653,7 @@ void processSelection() {
 
       int len = strlen(E.row[y].line);
       for (int i = x; i < len; i++) {
-        if (E.row[y].line[i] == '(') {
+        if (E.row[y].line[i] == k) {
           int close_x, close_y;
           if (!matchingParen(k, i, y, &close_x, &close_y))
             return;
@@ -2347,14 +7675,171 @@ void processSelection() {
   }
 }
 
+// Whether the IndentStart/IndentEnd token tok sits at line offset i outside
+// strings and comments
+bool foldtoken(struct erow *row, int i, const char *tok) {
+  int len = strlen(tok);
+  if (i + len > row->size || strncmp(&row->line[i], tok, len))
+    return false;
+  if (row->windowed || !row->highlight)
+    return true;
+  int hl = row->highlight[cxtorb(row, i)];
+  return hl != STRING && hl != COMMENT && hl != MULTICOMMENT;
+}
+
+// Leading whitespace in columns, -1 for a blank row
+int foldindent(struct erow *row) {
+  int col = 0;
+  for (int i = 0; i < row->size; i++) {
+    if (row->line[i] == ' ')
+      col++;
+    else if (row->line[i] == '\t')
+      col += TAB_LENGTH - col % TAB_LENGTH;
+    else
+      return col;
+  }
+  return -1;
+}
+
+// Row closing the first block opened on row lo, -1 if every block opened on
+// it also closes on it
+int foldbraceend(int lo, const char *open, const char *close) {
+  int depth = 0;
+  for (int r = lo; r < E.numrows; r++) {
+    struct erow *row = &E.row[r];
+    for (int i = 0; i < row->size; i++) {
+      if (foldtoken(row, i, open))
+        depth++;
+      else if (foldtoken(row, i, close) && depth > 0 && --depth == 0 && r > lo)
+        return r;
+    }
+    if (r == lo && depth == 0)
+      return -1;
+  }
+  return E.numrows - 1;
+}
+
+// Last row indented deeper than row lo, -1 if the next one is not
+int foldindentend(int lo) {
+  int base = foldindent(&E.row[lo]);
+  int end = -1;
+  for (int r = lo + 1; r < E.numrows; r++) {
+    int ind = foldindent(&E.row[r]);
+    if (ind < 0)
+      continue;
+    if (ind <= base)
+      break;
+    end = r;
+  }
+  return end;
+}
+
+// Block on or around row r: the brace pair opened on or enclosing it, or the
+// rows indented deeper than it when the syntax has no IndentEnd
+bool foldregion(int r, int *lo, int *hi) {
+  char *open = E.syntax ? E.syntax->IndentStart : NULL;
+  char *close = E.syntax ? E.syntax->IndentEnd : NULL;
+  if (open && close) {
+    int end = foldbraceend(r, open, close);
+    int depth = 0;
+    // Walk back to the opener enclosing r
+    for (int y = r - 1; end < 0 && y >= 0; y--) {
+      struct erow *row = &E.row[y];
+      for (int i = row->size - 1; i >= 0; i--) {
+        if (foldtoken(row, i, close))
+          depth++;
+        else if (foldtoken(row, i, open) && depth-- == 0) {
+          r = y;
+          end = foldbraceend(y, open, close);
+          break;
+        }
+      }
+    }
+    *lo = r;
+    *hi = end;
+    return end > r;
+  }
+
+  int end = foldindentend(r);
+  int base = foldindent(&E.row[r]);
+  for (int y = r - 1; end < 0 && y >= 0; y--) {
+    int ind = foldindent(&E.row[y]);
+    if (ind >= 0 && (base < 0 || ind < base)) {
+      r = y;
+      end = foldindentend(y);
+    }
+  }
+  *lo = r;
+  *hi = end;
+  return end > r;
+}
+
+// zf, zo, zc, za, zd, zE, zR and zM
+void foldcommand(int c) {
+  if (E.cy >= E.numrows)
+    return;
+  int lo, hi;
+  struct fold *f = foldfirstclosed(E.cy);
+  bool onclosed = f && f->lo <= E.cy;
+  switch (c) {
+  case 'f':
+    if (!foldregion(E.cy, &lo, &hi)) {
+      setstatus("No fold found");
+      return;
+    }
+    if (!foldcreate(lo, hi)) {
+      setstatus("Folds must nest inside each other");
+      return;
+    }
+    E.cy = lo;
+    break;
+  case 'o':
+    if (onclosed)
+      foldset(f->lo, f->hi, false);
+    break;
+  case 'a':
+    if (onclosed) {
+      foldset(f->lo, f->hi, false);
+      break;
+    }
+    // fall through
+  case 'c':
+    if (foldinner(E.cy, true, &lo, &hi))
+      foldset(lo, hi, true);
+    else if (!onclosed)
+      setstatus("No fold found");
+    break;
+  case 'd':
+    if (foldinner(E.cy, false, &lo, &hi))
+      foldset(lo, hi, -1);
+    else
+      setstatus("No fold found");
+    break;
+  case 'E':
+    foldfree(E.folds);
+    E.folds = NULL;
+    break;
+  case 'R':
+  case 'M':
+    foldclose(E.folds, c == 'M');
+    break;
+  }
+  wrapInvalidate();
+}
+
 void Normalgomove() {
   int c = readkey();
   switch (c) {
   case 'g':
+    jumppush(E.cy, E.cx);
     E.cy = 0;
     if (E.cx >= E.row[0].size)
       E.cx = E.row[0].size - 1;
     break;
+  case ';':
+  case ',':
+    changego(c == ';' ? -1 : 1);
+    break;
   default:
     processmotion(c);
     break;
@@ -2362,96 +7847,82 @@ void Normalgomove() {
   return;
 }
 
-void NormalDelete(char lmao) {
+// d{motion}, count times, 0 if none was typed. Rows and spans of a row are
+// cut in one edit
+void NormalDelete(int count, char lmao) {
   int c;
   if (lmao != '\0')
     c = lmao;
   else
     c = readkey();
-  int count = 1;
-  int motion = c;
+  int motion = c, typed = count;
+  count = MAX(count, 1);
   if (isdigit(c) && c != '0') {
-    count = c - '0';
+    int n = c - '0';
     while (1) {
       int k = readkey();
       if (isdigit(k)) {
-        count = count * 10 + (k - '0');
+        n = n * 10 + (k - '0');
       } else {
         motion = k;
         break;
       }
     }
+    typed = count *= n;
   }
+  if (E.cy >= E.numrows)
+    return;
+  struct erow *row = &E.row[E.cy];
   switch (motion) {
   case 'd':
-    editorDelRow(E.cy);
+    exdelete(E.cy, MIN(E.cy + count - 1, E.numrows - 1));
     break;
-  case '0': {
-    int idx = E.cx;
-    for (int i = 0; i < idx; i++)
-      deletechar();
+  case '0':
+    rowsplice(0, E.cx, "", 0);
     break;
-  }
-  case '$': {
-    int times = E.row[E.cy].size - E.cx;
-    for (int i = 0; i < times; i++) {
-      movecursor(ARROW_RIGHT);
-      deletechar();
-    }
+  case '$':
+    rowsplice(E.cx, row->size, "", 0);
     break;
-  }
-  case 'h':
-    for (int i = 0; i < count; i++)
-      deletechar();
+  case 'h': {
+    int from = E.cx;
+    for (int i = 0; i < count && from > 0; i++)
+      from = prevcell(row, from);
+    rowsplice(from, E.cx, "", 0);
     break;
-  case 'l':
-    for (int i = 0; i < count; i++) {
-      movecursor(ARROW_RIGHT);
-      deletechar();
-    }
+  }
+  case 'l': {
+    int to = E.cx;
+    for (int i = 0; i < count && to < row->size; i++)
+      to = nextcell(row, to);
+    rowsplice(E.cx, to, "", 0);
     break;
+  }
   case 'j':
-    for (int i = 0; i <= count; i++)
-      editorDelRow(E.cy);
+    exdelete(E.cy, MIN(E.cy + count, E.numrows - 1));
     break;
   case 'k':
-    for (int i = 0; i <= count; i++) {
-      editorDelRow(E.cy);
-      movecursor(ARROW_UP);
-    }
+    exdelete(MAX(E.cy - count, 0), E.cy);
     break;
   case 'W':
   case 'w': {
-    int (*fptr)(int) = ((motion == 'w') ? &isSepator : &isWhitespace);
-    for (int i = 0; i < count; i++) {
-      if (isWhitespace(E.row[E.cy].line[E.cx])) {
-        while (isWhitespace(E.row[E.cy].line[E.cx])) {
-          movecursor(ARROW_RIGHT);
-          deletechar();
-        }
+    // Up to the next word, and at most to the end of the row
+    int mask = motion == 'w' ? CC_SEP : CC_BLANK;
+    int to = E.cx;
+    for (int i = 0; i < count && to < row->size; i++) {
+      if (CHARIS(row->line[to], CC_BLANK)) {
+        while (to < row->size && CHARIS(row->line[to], CC_BLANK))
+          to++;
         continue;
-      } else if (fptr(E.row[E.cy].line[E.cx])) {
-        movecursor(ARROW_RIGHT);
-        deletechar();
+      } else if (CHARIS(row->line[to], mask)) {
+        to++;
         continue;
       }
-
-      while (1) {
-        if (!(E.cy < E.numrows && E.cy >= 0 && E.cx < E.row[E.cy].size &&
-              E.cx >= 0))
-          break;
-        if (!fptr(E.row[E.cy].line[E.cx])) {
-          movecursor(ARROW_RIGHT);
-          deletechar();
-        } else
-          break;
-      }
-      while (isWhitespace(E.row[E.cy].line[E.cx])) {
-        movecursor(ARROW_RIGHT);
-        deletechar();
-      }
-      continue;
+      while (to < row->size && !CHARIS(row->line[to], mask))
+        to++;
+      while (to < row->size && CHARIS(row->line[to], CC_BLANK))
+        to++;
     }
+    rowsplice(E.cx, to, "", 0);
     break;
   }
 
@@ -2522,63 +7993,52 @@ void NormalDelete(char lmao) {
     break;
   }
   case 't': {
-    int k = readkey();
-    int found = -1;
-    for (int i = E.cx; i < E.row[E.cy].size; i++) {
-      if (E.row[E.cy].line[i] == k) {
-        found = i;
-        break;
-      }
-    }
-    if (found + 1) {
-      for (int i = E.cx; i < found; i++) {
-        movecursor(ARROW_RIGHT);
-        deletechar();
-      }
-    }
+    int found = rowfind(readkey(), count);
+    if (found != -1)
+      rowsplice(E.cx, found, "", 0);
     break;
   }
   default:
     E.sel_x = E.cx;
     E.sel_y = E.cy;
-    for (int i = 0; i < count; i++)
-      processmotion(c);
-    deleteSelection();
+    countedmotion(motion, typed);
+    // Nothing for a motion that went nowhere, as f without a match
+    if (E.cx != E.sel_x || E.cy != E.sel_y)
+      deleteSelection();
     break;
   }
 }
 
-void NormalYank(char lmao) {
+// y{motion}, count times, 0 if none was typed. Rows are yanked without
+// moving the cursor
+void NormalYank(int count, char lmao) {
   int c;
   if (lmao != '\0')
     c = lmao;
   else
     c = readkey();
-  int count = 1;
-  int motion = c;
+  int motion = c, typed = count;
+  count = MAX(count, 1);
   if (isdigit(c) && c != '0') {
-    count = c - '0';
+    int n = c - '0';
     while (1) {
       int k = readkey();
       if (isdigit(k)) {
-        count = count * 10 + (k - '0');
+        n = n * 10 + (k - '0');
       } else {
         motion = k;
         break;
       }
     }
+    typed = count *= n;
   }
+  if (E.cy >= E.numrows)
+    return;
+  struct erow *row = &E.row[E.cy];
   switch (motion) {
-  case 'y': {
-    int tempx = E.cx;
-    E.sel_y = E.cy;
-    E.sel_x = 0;
-    E.cx = E.row[E.cy].size - 1;
-    E.yankNewline = true;
-    yankSelection();
-    E.cx = tempx;
+  case 'y':
+    regrows(E.cy, E.cy + count - 1, false);
     break;
-  }
   case '0': {
     E.sel_y = E.cy;
     E.sel_x = 0;
@@ -2591,32 +8051,38 @@ void NormalYank(char lmao) {
     yankSelection();
     break;
   }
-  case 'h':
-  case 'l':
+  case 'h': {
+    int cx = E.cx, from = E.cx;
+    for (int i = 0; i < count && from > 0; i++)
+      from = prevcell(row, from);
+    if (from == cx)
+      break;
     E.sel_y = E.cy;
-    E.sel_x = E.cx;
-    for (int i = 0; i < count; i++)
-      movecursor(motion);
+    E.sel_x = from;
+    E.cx = cx - 1;
     yankSelection();
+    E.cx = from;
     break;
-  case 'j':
-    E.sel_x = 0;
+  }
+  case 'l': {
+    int cx = E.cx, to = E.cx;
+    for (int i = 0; i < count && to < row->size; i++)
+      to = nextcell(row, to);
+    if (to == cx)
+      break;
     E.sel_y = E.cy;
-    for (int i = 0; i < count; i++) {
-      movecursor(ARROW_DOWN);
-    }
-    E.cx = E.row[E.cy].size - 1;
-    E.yankNewline = true;
+    E.sel_x = cx;
+    E.cx = to - 1;
     yankSelection();
+    E.cx = cx;
+    break;
+  }
+  case 'j':
+    regrows(E.cy, MIN(E.cy + count, E.numrows - 1), false);
     break;
   case 'k':
-    E.sel_x = E.row[E.cy].size - 1;
-    E.sel_y = E.cy;
-    for (int i = 0; i < count; i++)
-      movecursor(ARROW_UP);
-    E.cx = 0;
-    E.yankNewline = true;
-    yankSelection();
+    regrows(MAX(E.cy - count, 0), E.cy, false);
+    cursorrow(MAX(E.cy - count, 0));
     break;
 
   case 'W':
@@ -2683,123 +8149,846 @@ void NormalYank(char lmao) {
         return;
       }
 
-      int len = strlen(E.row[y].line);
-      for (int i = x; i < len; i++) {
-        if (E.row[y].line[i] == k) {
-          int close_x, close_y;
-          if (!matchingParen(k, i, y, &close_x, &close_y))
-            return;
-          E.sel_x = i + 1;
-          E.sel_y = y;
-          E.cx = close_x - 1;
-          E.cy = close_y;
-          yankSelection();
-          E.cx = E.sel_x;
-          E.cy = E.sel_y;
-          return;
-        }
-      }
+      int len = strlen(E.row[y].line);
+      for (int i = x; i < len; i++) {
+        if (E.row[y].line[i] == k) {
+          int close_x, close_y;
+          if (!matchingParen(k, i, y, &close_x, &close_y))
+            return;
+          E.sel_x = i + 1;
+          E.sel_y = y;
+          E.cx = close_x - 1;
+          E.cy = close_y;
+          yankSelection();
+          E.cx = E.sel_x;
+          E.cy = E.sel_y;
+          return;
+        }
+      }
+      break;
+    }
+    }
+    break;
+  }
+  case 't': {
+    int found = rowfind(readkey(), count);
+    if (found > E.cx + 1) {
+      int cx = E.cx;
+      E.sel_x = cx;
+      E.sel_y = E.cy;
+      E.cx = found - 1;
+      yankSelection();
+      E.cx = cx;
+    }
+    break;
+  }
+  default:
+    E.sel_x = E.cx;
+    E.sel_y = E.cy;
+    countedmotion(motion, typed);
+    if (E.cx != E.sel_x || E.cy != E.sel_y)
+      yankSelection();
+    break;
+  }
+}
+
+// Swaps case of ASCII, Latin-1, Greek and Cyrillic letters
+int swapcase(int cp) {
+  if ((cp >= 'a' && cp <= 'z') || (cp >= 0xE0 && cp <= 0xFE && cp != 0xF7) ||
+      (cp >= 0x3B1 && cp <= 0x3C9 && cp != 0x3C2) ||
+      (cp >= 0x430 && cp <= 0x44F))
+    return cp - 32;
+  if ((cp >= 'A' && cp <= 'Z') || (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) ||
+      (cp >= 0x391 && cp <= 0x3A9) || (cp >= 0x410 && cp <= 0x42F))
+    return cp + 32;
+  if (cp >= 0x450 && cp <= 0x45F)
+    return cp - 80;
+  if (cp >= 0x400 && cp <= 0x40F)
+    return cp + 80;
+  return cp;
+}
+
+// ~ swaps the case of count cells from the cursor on, as one edit, and
+// moves past them
+void toggleCase(int count) {
+  if (E.cy >= E.numrows)
+    return;
+  struct erow *row = &E.row[E.cy];
+  int from = E.cx, to = E.cx;
+  for (int i = 0; i < count && to < row->size; i++)
+    to = nextcell(row, to);
+  char *buf = malloc(MAX(to - from, 1));
+  memcpy(buf, &row->line[from], to - from);
+  bool changed = false;
+  for (int i = 0; i < to - from;) {
+    int cp;
+    int len = utf8decode(&buf[i], to - from - i, &cp);
+    if (len > 0 && swapcase(cp) != cp) {
+      // Every pair above encodes to the same number of bytes
+      utf8encode(swapcase(cp), &buf[i]);
+      changed = true;
+    }
+    i += MAX(len, 1);
+  }
+  if (changed)
+    rowsplice(from, to, buf, to - from);
+  free(buf);
+  row = &E.row[E.cy];
+  E.cx = MIN(to, cellstart(row, MAX(row->size - 1, 0)));
+}
+
+// Ctrl-a and Ctrl-x add delta to the number under the cursor or the first
+// one after it on the row
+void incrementOrDecrement(long long delta) {
+  if (E.cy >= E.numrows)
+    return;
+  struct erow *row = &E.row[E.cy];
+  int from = MIN(E.cx, row->size);
+  while (from > 0 && CHARIS(row->line[from - 1], CC_DIGIT))
+    from--;
+  while (from < row->size && !CHARIS(row->line[from], CC_DIGIT))
+    from++;
+  if (from == row->size)
+    return;
+  int to = from;
+  while (to < row->size && CHARIS(row->line[to], CC_DIGIT))
+    to++;
+  if (from > 0 && row->line[from - 1] == '-')
+    from--;
+  char num[32];
+  int len = snprintf(num, sizeof(num), "%lld",
+                     strtoll(&row->line[from], NULL, 10) + delta);
+  rowsplice(from, to, num, len);
+  E.cx = from + len - 1;
+}
+
+// Ex commands
+// ':' reads a command line run by excommand. Commands taking rows start with
+// a range, one or two addresses split by a comma or % for every row. An
+// address is a row number, . for the cursor's row or $ for the last one,
+// followed by any +n or -n:
+//   [range]d               delete, the cursor's row without a range
+//   [range]s/pat/rep/[g]   substitute, & and \1..\9 in rep stand for the match
+//   [range]g/pat/d         delete the rows matching pat, v for the others
+//   [range]g/pat/s/...     substitute on the rows matching pat
+//   [range]sort [u]        sort the rows, every row without a range, u
+//                          dropping repeated ones
+//   range!cmd              filter the rows through a shell command
+//   [range]                move to the last row of the range
+//   w [file], wq, x, q[!], e[!] file, set key[=value], set [no]key
+// Each command changes the rows in one go and is one undo step, so :%s or
+// :g on a large file does not move the rows below once per edited row.
+
+void editorquit() {
+  swapdiscard();
+  clipdone(true); // the helper gets the whole of a yank still being sent
+  write(STDOUT_FILENO, "\x1b[2j", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
+
+// Frees the file being edited, for another one to be opened
+void editorClose() {
+  struct decoder *d = &E.decode;
+  decodewait();
+  if (d->codec != CODEC_NONE) {
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->more);
+    free(d->buf);
+  }
+  E.decode = (struct decoder){.fd = -1};
+  swapdiscard();
+  mcclear();
+  for (int i = 0; i < E.numrows; i++)
+    editorFreeRow(&E.row[i]);
+  E.numrows = 0;
+  historyfree();
+  foldfree(E.folds);
+  E.folds = NULL;
+  markfree(E.marks.root);
+  E.marks = (struct marks){0};
+  E.large.on = false;
+  E.large.nshown = 0;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  E.dirty = false;
+  wrapInvalidate();
+  E.brackets.valid = false;
+}
+
+// Replaces rows [at, at + n) with m lines as one undo step
+void exreplace(int at, int n, struct rowsnap *lines, int m) {
+  struct rowsnap *old = malloc(sizeof(struct rowsnap) * MAX(n, 1));
+  rowsreplace(at, n, lines, m, old);
+  pushrows((struct action){
+      .type = EDITSPAN, .at = at, .rows = old, .nrows = n, .span = m});
+  E.cy = MIN(at, E.numrows - 1);
+  E.cx = 0;
+}
+
+// Replaces [from, to) of the cursor's row with len bytes of s as one edit,
+// leaving the cursor on from
+void rowsplice(int from, int to, const char *s, int len) {
+  struct erow *row = &E.row[E.cy];
+  if (from >= to && len == 0)
+    return;
+  int size = row->size - (to - from) + len;
+  struct rowsnap line = {E.cy, malloc(size + 1), size};
+  memcpy(line.line, row->line, from);
+  memcpy(&line.line[from], s, len);
+  memcpy(&line.line[from + len], &row->line[to], row->size - to + 1);
+  int y = E.cy;
+  exreplace(y, 1, &line, 1);
+  E.cy = y;
+  E.cx = MIN(from, MAX(E.row[y].size - 1, 0));
+}
+
+// Sorting
+// :sort orders the rows themselves, so no line is copied. Each row is keyed
+// by its first 8 bytes after the ones all rows share, which decide most
+// comparisons without reading the line, and the key points at the line so
+// the rows are not read either. Past SORT_PARALLEL rows, slices are sorted on
+// their own threads and merged pairwise, again on threads
+
+#define SORT_PARALLEL (1 << 16)
+#define SORT_THREADS 8
+
+struct sortkey {
+  uint64_t prefix; // big endian, so it orders as the bytes do
+  const char *line;
+  int size;
+  int row;
+};
+
+struct sortjob {
+  struct sortkey *keys, *tmp;
+  int lo, mid, hi;
+};
+
+int linecmp(const char *a, int na, const char *b, int nb) {
+  int c = memcmp(a, b, MIN(na, nb));
+  return c ? c : (na > nb) - (na < nb);
+}
+
+// Rows that compare equal keep their order
+int sortkeycmp(const void *x, const void *y) {
+  const struct sortkey *a = x, *b = y;
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  // Equal prefixes of lines this long are equal first 8 bytes
+  int skip = a->size >= 8 && b->size >= 8 ? 8 : 0;
+  int c = linecmp(a->line + skip, a->size - skip, b->line + skip,
+                  b->size - skip);
+  return c ? c : a->row - b->row;
+}
+
+void *sortslice(void *arg) {
+  struct sortjob *j = arg;
+  qsort(&j->keys[j->lo], j->hi - j->lo, sizeof(struct sortkey), sortkeycmp);
+  return NULL;
+}
+
+void *mergeslices(void *arg) {
+  struct sortjob *j = arg;
+  int a = j->lo, b = j->mid, k = j->lo;
+  while (a < j->mid && b < j->hi)
+    j->tmp[k++] = sortkeycmp(&j->keys[b], &j->keys[a]) < 0 ? j->keys[b++]
+                                                           : j->keys[a++];
+  while (a < j->mid)
+    j->tmp[k++] = j->keys[a++];
+  while (b < j->hi)
+    j->tmp[k++] = j->keys[b++];
+  memcpy(&j->keys[j->lo], &j->tmp[j->lo],
+         sizeof(struct sortkey) * (j->hi - j->lo));
+  return NULL;
+}
+
+// Runs fn on every job, each on a thread of its own but the first
+void runjobs(void *(*fn)(void *), struct sortjob *jobs, int n) {
+  pthread_t threads[SORT_THREADS];
+  bool started[SORT_THREADS] = {false};
+  for (int i = 1; i < n; i++)
+    started[i] = pthread_create(&threads[i], NULL, fn, &jobs[i]) == 0;
+  fn(&jobs[0]);
+  for (int i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      fn(&jobs[i]);
+  }
+}
+
+void sortkeys(struct sortkey *keys, int n) {
+  int t = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  while (n >= SORT_PARALLEL && t * 2 <= MIN(cpus, SORT_THREADS))
+    t *= 2;
+  struct sortkey *tmp = t > 1 ? malloc(sizeof(struct sortkey) * n) : NULL;
+  struct sortjob jobs[SORT_THREADS];
+  int bound[SORT_THREADS + 1];
+  for (int i = 0; i <= t; i++)
+    bound[i] = (long long)n * i / t;
+  for (int i = 0; i < t; i++)
+    jobs[i] = (struct sortjob){keys, tmp, bound[i], 0, bound[i + 1]};
+  runjobs(sortslice, jobs, t);
+  for (int w = 1; w < t; w *= 2) {
+    int m = 0;
+    for (int i = 0; i + w < t; i += 2 * w)
+      jobs[m++] = (struct sortjob){keys, tmp, bound[i], bound[i + w],
+                                   bound[MIN(i + 2 * w, t)]};
+    runjobs(mergeslices, jobs, m);
+  }
+  free(tmp);
+}
+
+// Sorts rows from..to, keeping only the first of equal rows with unique
+void exsort(int from, int to, bool unique) {
+  int n = to - from + 1;
+  // Bytes every row starts with say nothing, the keys start after them
+  struct erow *first = &E.row[from];
+  int common = first->size;
+  for (int i = 1; i < n && common; i++) {
+    struct erow *row = &E.row[from + i];
+    int c = 0;
+    while (c < common && c < row->size && row->line[c] == first->line[c])
+      c++;
+    common = c;
+  }
+  struct sortkey *keys = malloc(sizeof(struct sortkey) * n);
+  for (int i = 0; i < n; i++) {
+    struct erow *row = &E.row[from + i];
+    const char *line = &row->line[common];
+    int size = row->size - common;
+    uint64_t prefix = 0;
+    for (int b = 0; b < 8; b++)
+      prefix = prefix << 8 | (b < size ? (unsigned char)line[b] : 0);
+    keys[i] = (struct sortkey){prefix, line, size, from + i};
+  }
+  sortkeys(keys, n);
+
+  int *perm = malloc(sizeof(int) * n);
+  int m = 0;
+  bool moved = false;
+  for (int i = 0; i < n; i++) {
+    struct sortkey *k = &keys[i];
+    if (unique && i && k->prefix == k[-1].prefix &&
+        linecmp(k->line, k->size, k[-1].line, k[-1].size) == 0)
+      continue;
+    perm[m] = k->row - from;
+    moved |= perm[m] != m;
+    m++;
+  }
+  free(keys);
+  if (!moved && m == n) {
+    free(perm);
+    setstatus("Already sorted");
+    return;
+  }
+  struct action a = {.type = EDITSORT, .at = from, .span = n, .perm = perm,
+                     .nperm = m, .sorted = true};
+  a.nrows = n - m;
+  a.rows = malloc(sizeof(struct rowsnap) * MAX(a.nrows, 1));
+  rowspermute(from, n, perm, m, a.rows);
+  pushrows(a);
+  E.cy = from;
+  E.cx = 0;
+  mcclear();
+  if (unique)
+    setstatus("%d rows sorted, %d duplicates removed", m, n - m);
+}
+
+// Filtering
+// :[range]!cmd hands the rows to the shell command on its stdin and replaces
+// them with what it prints. The rows are sent straight from their lines,
+// FILTER_IOV at a time, while the output is read as it comes, so neither
+// side waits on a full pipe. stdin is a socket, for MSG_NOSIGNAL to turn a
+// command that stops reading early into an error rather than a SIGPIPE
+
+#define FILTER_IOV 512
+
+struct filter {
+  int from, to;
+  int y;   // row being sent
+  int off; // bytes of it sent, its newline is at size
+  char *out;
+  size_t len, cap;
+};
+
+// Sends rows until the socket is full, false once they are all sent
+bool filtersend(struct filter *f, int fd) {
+  struct iovec iov[FILTER_IOV * 2];
+  while (f->y <= f->to) {
+    int n = 0;
+    for (int y = f->y; y <= f->to && n < FILTER_IOV * 2 - 1; y++) {
+      struct erow *row = &E.row[y];
+      int off = y == f->y ? f->off : 0;
+      if (off < row->size)
+        iov[n++] = (struct iovec){&row->line[off], row->size - off};
+      iov[n++] = (struct iovec){"\n", 1};
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent == -1)
+      return errno == EAGAIN || errno == EINTR;
+    while (sent > 0) {
+      int left = E.row[f->y].size + 1 - f->off;
+      if (sent < left) {
+        f->off += sent;
+        break;
+      }
+      sent -= left;
+      f->y++;
+      f->off = 0;
+    }
+  }
+  return false;
+}
+
+// Reads what is waiting, false at the end of the output
+bool filterread(struct filter *f, int fd) {
+  if (f->cap - f->len < 65536) {
+    f->cap = MAX(f->cap * 2, f->len + 65536);
+    f->out = realloc(f->out, f->cap);
+  }
+  ssize_t n = read(fd, &f->out[f->len], f->cap - f->len);
+  if (n > 0)
+    f->len += n;
+  return n > 0 || (n == -1 && (errno == EAGAIN || errno == EINTR));
+}
+
+void exfilter(int from, int to, const char *cmd) {
+  int in[2], out[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, in) == -1)
+    goto fail;
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    close(in[0]);
+    close(in[1]);
+    goto fail;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(in[1], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[1]);
+  close(out[1]);
+  if (pid == -1) {
+    close(in[0]);
+    close(out[0]);
+    goto fail;
+  }
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+  struct filter f = {.from = from, .to = to, .y = from};
+  struct pollfd fds[2] = {{.fd = out[0], .events = POLLIN},
+                          {.fd = in[0], .events = POLLOUT}};
+  bool sending = true, reading = true;
+  while (reading) {
+    if (sending && !filtersend(&f, in[0])) {
+      sending = false;
+      shutdown(in[0], SHUT_WR);
+    }
+    if (poll(fds, sending ? 2 : 1, -1) == -1 && errno != EINTR)
       break;
+    if (fds[0].revents)
+      reading = filterread(&f, out[0]);
+  }
+  close(in[0]);
+  close(out[0]);
+  int status = -1;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    free(f.out);
+    setstatus("%s exited with %d, rows left as they were", cmd,
+              WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return;
+  }
+
+  int m;
+  struct rowsnap *lines = textlines(f.out, f.len, from, &m);
+  free(f.out);
+  // The file keeps at least one row
+  if (!m && to - from + 1 == E.numrows)
+    lines[m++] = (struct rowsnap){from, strdup(""), 0};
+  exreplace(from, to - from + 1, lines, m);
+  free(lines);
+  mcclear();
+  setstatus("%d rows filtered into %d", to - from + 1, m);
+  return;
+fail:
+  setstatus("Filter: %s", strerror(errno));
+}
+
+// Reads an address at *s into y
+bool exaddress(char **s, int *y) {
+  char *p = *s;
+  if (isdigit(*p))
+    *y = strtol(p, &p, 10) - 1;
+  else if (*p == '.' || *p == '+' || *p == '-')
+    *y = E.cy;
+  else if (*p == '$')
+    *y = E.numrows - 1;
+  else
+    return false;
+  if (*p == '.' || *p == '$')
+    p++;
+  while (*p == '+' || *p == '-') {
+    int sign = *p++ == '+' ? 1 : -1;
+    *y += sign * (isdigit(*p) ? strtol(p, &p, 10) : 1);
+  }
+  *s = p;
+  return true;
+}
+
+// Splits a /pat/ at *s on its delimiter, unescaping it. Returns the part
+// up to the next delimiter or the end, and moves *s past it
+char *expart(char **s, char delim) {
+  char *p = *s, *out = *s, *start = *s;
+  while (*p && *p != delim) {
+    if (*p == '\\' && p[1] == delim)
+      p++;
+    else if (*p == '\\' && p[1])
+      *out++ = *p++;
+    *out++ = *p++;
+  }
+  *s = *p ? p + 1 : p;
+  *out = '\0';
+  return start;
+}
+
+bool excompile(regex_t *re, const char *pat) {
+  int err = regcomp(re, pat, REG_EXTENDED);
+  if (err) {
+    char msg[80];
+    regerror(err, re, msg, sizeof(msg));
+    setstatus("Bad pattern: %s", msg);
+  }
+  return !err;
+}
+
+void exappend(char **buf, int *len, int *cap, const char *s, int n) {
+  if (*len + n + 1 > *cap) {
+    *cap = MAX(*cap * 2, *len + n + 1);
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(&(*buf)[*len], s, n);
+  *len += n;
+  (*buf)[*len] = '\0';
+}
+
+// The line made of row with the matches of re replaced by rep, NULL when
+// nothing matched
+char *exsubline(struct erow *row, regex_t *re, const char *rep, bool all,
+                int *len) {
+  regmatch_t m[10];
+  char *line = row->line, *buf = NULL;
+  int off = 0, cap = 0;
+  bool after = false; // right after a match that was not empty
+  *len = 0;
+  while (off <= row->size &&
+         regexec(re, &line[off], 10, m, off ? REG_NOTBOL : 0) == 0) {
+    if (after && m[0].rm_eo == 0) {
+      if (off < row->size)
+        exappend(&buf, len, &cap, &line[off], 1);
+      off++;
+      after = false;
+      continue;
     }
+    after = m[0].rm_eo > m[0].rm_so;
+    exappend(&buf, len, &cap, &line[off], m[0].rm_so);
+    for (const char *r = rep; *r; r++) {
+      int g = -1;
+      if (*r == '&')
+        g = 0;
+      else if (*r == '\\' && isdigit(r[1]))
+        g = *++r - '0';
+      else if (*r == '\\' && r[1])
+        r++;
+      if (g < 0)
+        exappend(&buf, len, &cap, r, 1);
+      else if (m[g].rm_so != -1)
+        exappend(&buf, len, &cap, &line[off + m[g].rm_so],
+                 m[g].rm_eo - m[g].rm_so);
     }
-    break;
+    // An empty match moves on by a character so it is not found again
+    if (m[0].rm_eo == m[0].rm_so) {
+      if (off + m[0].rm_eo < row->size)
+        exappend(&buf, len, &cap, &line[off + m[0].rm_eo], 1);
+      off++;
+    }
+    off += m[0].rm_eo;
+    if (!all)
+      break;
   }
-  case 't': {
-    int k = readkey();
-    int found = -1;
-    for (int i = E.cx; i < E.row[E.cy].size; i++) {
-      if (E.row[E.cy].line[i] == k) {
-        found = i;
-        break;
-      }
+  if (buf && off < row->size)
+    exappend(&buf, len, &cap, &line[off], row->size - off);
+  return buf;
+}
+
+// Runs s/pat/rep/flags on rows from..to, only on the ones whose match of
+// only is keep when it is given
+void exsub(int from, int to, char *args, regex_t *only, bool keep) {
+  char delim = *args++;
+  char *pat = expart(&args, delim);
+  char *rep = expart(&args, delim);
+  bool all = strchr(args, 'g');
+  regex_t re;
+  if (!excompile(&re, pat))
+    return;
+  struct action a = {.type = EDITROWS};
+  int cap = 0;
+  for (int y = from; y <= to; y++) {
+    struct erow *row = &E.row[y];
+    if (only && (regexec(only, row->line, 0, NULL, 0) == 0) != keep)
+      continue;
+    int len;
+    char *line = exsubline(row, &re, rep, all, &len);
+    if (!line)
+      continue;
+    if (a.nrows == cap) {
+      cap = MAX(16, cap * 2);
+      a.rows = realloc(a.rows, sizeof(struct rowsnap) * cap);
     }
-    if (found + 1) {
-      E.sel_x = E.cx;
-      E.sel_y = E.cy;
-      for (int i = E.cx; i < found; i++) {
-        movecursor(ARROW_RIGHT);
-      }
-      movecursor(ARROW_LEFT);
-      yankSelection();
+    a.rows[a.nrows++] = (struct rowsnap){y, row->line, row->size};
+    row->line = line;
+    row->size = len;
+    row->editfrom = 0;
+    updaterow(row);
+  }
+  regfree(&re);
+  if (!a.nrows) {
+    setstatus("Pattern not found: %s", pat);
+    return;
+  }
+  pushrows(a);
+  E.cy = a.rows[a.nrows - 1].at;
+  E.cx = 0;
+  E.dirty = true;
+  mcclear();
+  setstatus("%d rows changed", a.nrows);
+}
+
+// Deletes the rows from..to whose match of re is keep, as one replacement of
+// the rows from the first deleted one to the last
+void exglobaldelete(int from, int to, regex_t *re, bool keep) {
+  int first = -1, last = -1, n = 0;
+  for (int y = from; y <= to; y++)
+    if ((regexec(re, E.row[y].line, 0, NULL, 0) == 0) == keep) {
+      if (first == -1)
+        first = y;
+      last = y;
+      n++;
     }
-    break;
+  if (first == -1) {
+    setstatus("Pattern not found");
+    return;
   }
-  default:
-    E.sel_x = E.cx;
-    E.sel_y = E.cy;
-    for (int i = 0; i < count; i++)
-      processmotion(c);
-    yankSelection();
-    break;
+  int span = last - first + 1;
+  int m = span - n;
+  struct rowsnap *lines = malloc(sizeof(struct rowsnap) * MAX(m, 1));
+  int k = 0;
+  for (int y = first; y <= last; y++) {
+    struct erow *row = &E.row[y];
+    if ((regexec(re, row->line, 0, NULL, 0) == 0) == keep)
+      continue;
+    char *line = malloc(row->size + 1);
+    memcpy(line, row->line, row->size + 1);
+    lines[k++] = (struct rowsnap){y, line, row->size};
   }
+  // The file keeps at least one row
+  if (span == E.numrows && !m)
+    lines[m++] = (struct rowsnap){0, strdup(""), 0};
+  exreplace(first, span, lines, m);
+  free(lines);
+  mcclear();
+  setstatus("%d rows deleted", n);
 }
 
-void toggleCase() {
-  char changed;
-  char c = E.row[E.cy].line[E.cx];
-  if (c >= 'a' && c <= 'z')
-    changed = c - ('a' - 'A');
-  else if (c >= 'A' && c <= 'Z')
-    changed = c + ('a' - 'A');
+void exglobal(int from, int to, char *args, bool keep) {
+  char delim = *args++;
+  char *pat = expart(&args, delim);
+  regex_t re;
+  if (!excompile(&re, pat))
+    return;
+  if (strcmp(args, "d") == 0)
+    exglobaldelete(from, to, &re, keep);
+  else if (args[0] == 's' && args[1] && !isalnum(args[1]))
+    exsub(from, to, &args[1], &re, keep);
   else
-    changed = c;
-  rowdeletechar(&E.row[E.cy], E.cx);
-  rowinsertchar(&E.row[E.cy], E.cx, changed);
-  E.cx = MIN(E.cx + 1, E.row[E.cy].size - 1);
+    setstatus("Only d and s run on the rows :g matches");
+  regfree(&re);
+}
+
+void exdelete(int from, int to) {
+  int n = to - from + 1;
+  regrows(from, to, true);
+  struct rowsnap empty = {0, strdup(""), 0};
+  bool all = n == E.numrows;
+  exreplace(from, n, &empty, all);
+  if (!all)
+    free(empty.line);
+  mcclear();
+  if (n > 1)
+    setstatus("%d rows deleted", n);
+}
+
+void exwrite(char *file) {
+  if (*file) {
+    swapdiscard();
+    free(E.filename);
+    E.filename = strdup(file);
+    selectHL();
+  }
+  save();
+  if (*file)
+    watchfile();
 }
 
-// Ctrl-a
-void incrementOrDecrement(char c) {
-  // Detetct the entire word you are in
-  E.sel_x = E.cx;
-  E.sel_y = E.cy;
-  if (isSepator(E.row[E.cy].line[E.cx])) {
+void exedit(char *file, bool force) {
+  if (!*file) {
+    setstatus("Give a file to edit");
     return;
-  } else {
-    while (E.sel_x > 0 && isdigit(E.row[E.sel_y].line[E.sel_x - 1]))
-      E.sel_x--;
-    if (!isdigit(E.row[E.sel_y].line[E.sel_x]))
-      E.sel_x++;
-    if (E.sel_x > 0 && E.row[E.sel_y].line[E.sel_x - 1] == '-')
-      E.sel_x--;
-    while (E.cx < E.row[E.cy].size && isdigit(E.row[E.cy].line[E.cx]))
-      E.cx++;
-    if (E.cx > 0 && !isdigit(E.row[E.cy].line[E.cx]))
-      E.cx--;
   }
-  int len = E.cx - E.sel_x + 1;
-  char *buf = (char *)malloc(len + 1);
-  if (!buf) {
-    kill("Malloc");
+  if (E.follow || E.pager.fd != -1) {
+    setstatus("Not in a read only view");
     return;
   }
-  strncpy(buf, &E.row[E.sel_y].line[E.sel_x], len);
-  buf[len] = '\0';
+  if (E.dirty && !force) {
+    setstatus("No write since last change (add ! to override)");
+    return;
+  }
+  editorClose();
+  editorOpen(file);
+}
 
-  // convert to int
-  char *endptr;
-  int num = (int)strtol(buf, &endptr, 10);
-  free(buf);
+bool setconfig(const char *key, const char *value);
 
-  if (c == 'i')
-    num += 1;
-  else if (c == 'd')
-    num -= 1;
-  else
+void exset(char *args) {
+  char key[64];
+  const char *value = "1";
+  int len = strcspn(args, "=");
+  if (!len || len >= (int)sizeof(key)) {
+    setstatus("Give an option to set");
+    return;
+  }
+  if (args[len] == '=')
+    value = &args[len + 1];
+  else if (strncmp(args, "no", 2) == 0) {
+    value = "0";
+    args += 2;
+    len -= 2;
+  }
+  for (int i = 0; i <= len; i++)
+    key[i] = i < len ? toupper(args[i]) : '\0';
+  int tab = TAB_LENGTH, chunk = LONG_LINE_LENGTH;
+  // The undo stacks are allocated once
+  if (strcmp(key, "UNDO_STACK_SIZE") == 0 || !setconfig(key, value)) {
+    setstatus("Unknown option: %s", key);
     return;
-  char bufn[32];
-  snprintf(bufn, sizeof(bufn), "%d", num);
-  len = strlen(bufn);
-  bufn[len] = '\0';
+  }
+  if (TAB_LENGTH != tab || LONG_LINE_LENGTH != chunk)
+    for (int i = 0; i < E.numrows; i++)
+      updaterow(&E.row[i]);
+  wrapInvalidate();
+}
 
-  // deleteSelection();
-  movecursor(ARROW_RIGHT);
-  for (int i = E.cx; i > E.sel_x; i--)
-    deletechar();
-  for (int i = 0; i < len; i++) {
-    insertchar(bufn[i]);
+// Runs a command line read by ':'
+void excommand(char *cmd) {
+  char *p = cmd;
+  while (*p == ' ' || *p == ':')
+    p++;
+  // The cursor may sit on the row past the end, which has no row to run on
+  int cur = MAX(MIN(E.cy, E.numrows - 1), 0);
+  int from = cur, to = cur;
+  bool ranged = true;
+  if (*p == '%') {
+    from = 0;
+    to = E.numrows - 1;
+    p++;
+  } else if (exaddress(&p, &from)) {
+    to = from;
+    if (*p == ',') {
+      p++;
+      if (!exaddress(&p, &to)) {
+        setstatus("Bad range");
+        return;
+      }
+    }
+  } else
+    ranged = false;
+  if (from > to) {
+    int t = from;
+    from = to;
+    to = t;
+  }
+  if (ranged && (from < 0 || to >= E.numrows)) {
+    setstatus("Range out of the file");
+    return;
+  }
+  while (*p == ' ')
+    p++;
+  char *arg = p + strcspn(p, " ");
+  arg += strspn(arg, " ");
+  // d, s, :g and :sort run on rows, which an empty buffer has none of
+  if (E.numrows == 0 &&
+      (strcmp(p, "d") == 0 || strncmp(p, "sort", 4) == 0 ||
+       (*p && strchr("sgv", *p) && p[1] && !isalnum(p[1])))) {
+    setstatus("No rows");
+    return;
   }
-  E.cx--;
+  if (!*p && ranged) {
+    jumppush(E.cy, E.cx);
+    E.cy = to;
+    E.cx = 0;
+  } else if (strcmp(p, "d") == 0)
+    exdelete(from, to);
+  else if (p[0] == 's' && p[1] && !isalnum(p[1]) && p[1] != ' ')
+    exsub(from, to, &p[1], NULL, true);
+  else if ((p[0] == 'g' || p[0] == 'v') && p[1] && !isalnum(p[1])) {
+    bool keep = p[0] == 'g' && p[1] != '!';
+    p += 1 + (p[1] == '!');
+    if (!ranged) {
+      from = 0;
+      to = E.numrows - 1;
+    }
+    exglobal(from, to, p, keep);
+  } else if (strncmp(p, "sort", 4) == 0 &&
+             strspn(&p[4], " u") == strlen(&p[4])) {
+    if (!ranged) {
+      from = 0;
+      to = E.numrows - 1;
+    }
+    exsort(from, to, strchr(&p[4], 'u'));
+  } else if (p[0] == '!') {
+    if (ranged)
+      exfilter(from, to, &p[1]);
+    else
+      setstatus("Give rows to filter, as in :%%!sort");
+  } else if (ranged)
+    setstatus("Not a command on rows: %s", p);
+  else if (strncmp(p, "w ", 2) == 0 || strcmp(p, "w") == 0)
+    exwrite(arg);
+  else if (strcmp(p, "wq") == 0 || strcmp(p, "x") == 0) {
+    save();
+    if (!E.dirty)
+      editorquit();
+  } else if (strcmp(p, "q") == 0) {
+    if (E.dirty)
+      setstatus("No write since last change (add ! to override)");
+    else
+      editorquit();
+  } else if (strcmp(p, "q!") == 0)
+    editorquit();
+  else if (strncmp(p, "e ", 2) == 0 || strncmp(p, "e! ", 3) == 0 ||
+           strcmp(p, "e") == 0)
+    exedit(arg, p[1] == '!');
+  else if (strncmp(p, "set ", 4) == 0 || strcmp(p, "set") == 0)
+    exset(arg);
+  else
+    setstatus("Not a command: %s", p);
 }
 
 // proecess normal mode keypresses
@@ -2807,6 +8996,17 @@ void processcommands() {
   if (E.mode != 'n')
     return;
   int c = readkey();
+  if (E.hex.on && c != CTRL_KEY('q')) {
+    hexkey(c);
+    return;
+  }
+  if (E.pager.fd != -1 && pagerkey(c))
+    return;
+  if ((E.follow || E.pager.fd != -1) && !viewkey(c))
+    return;
+  if ((c > 0 && c < 128 && strchr("iaIAoOxdDcCsrRp~", c)) ||
+      c == CTRL_KEY('a') || c == CTRL_KEY('x'))
+    input.change = true;
   switch (c) {
   case CTRL_KEY('q'):
     if (E.dirty) {
@@ -2820,10 +9020,7 @@ void processcommands() {
         break;
       }
     }
-    write(STDOUT_FILENO, "\x1b[2j", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
-
+    editorquit();
     break;
   case CTRL_KEY('s'):
     save();
@@ -2832,6 +9029,14 @@ void processcommands() {
     applyUndo();
     break;
 
+  case ':': {
+    char *cmd = editorprompt(":%s", NULL);
+    if (cmd)
+      excommand(cmd);
+    free(cmd);
+    break;
+  }
+
   case ARROW_LEFT:
   case ARROW_DOWN:
   case ARROW_UP:
@@ -2852,7 +9057,7 @@ void processcommands() {
     break;
 
   case 'd':
-    NormalDelete('\0');
+    NormalDelete(0, '\0');
     break;
   case 'D':
     editorDelRow(E.cy);
@@ -2861,34 +9066,39 @@ void processcommands() {
     int k = readkey();
     switch (k) {
     case 'c':
-      E.cx = E.row[E.cy].size;
-      while (E.cx > 0)
-        deletechar();
+      if (E.cy < E.numrows)
+        rowsplice(0, E.row[E.cy].size, "", 0);
       E.mode = 'i';
       break;
     default:
-      NormalDelete(k);
+      NormalDelete(0, k);
       E.mode = 'i';
       break;
     }
     break;
   }
-  case 'C': {
-    int times = E.row[E.cy].size - E.cx;
-    for (int i = 0; i < times; i++) {
-      movecursor(ARROW_RIGHT);
-      deletechar();
+  case 'C':
+    if (E.cy < E.numrows) {
+      rowsplice(E.cx, E.row[E.cy].size, "", 0);
+      E.cx = E.row[E.cy].size;
     }
     E.mode = 'i';
     break;
-  }
 
   case 'y':
-    NormalYank('\0');
+    NormalYank(0, '\0');
     break;
   case 'p':
     pasteClipboard();
     break;
+  case '"': {
+    int k = readkey();
+    if (isalnum(k) || k == '"')
+      regs.pending = k;
+    else
+      setstatus("No register %c", k);
+    break;
+  }
 
   case 'i':
     E.mode = 'i';
@@ -2900,7 +9110,9 @@ void processcommands() {
     E.mode = 'i';
     break;
   case 'a':
-    movecursor(ARROW_RIGHT);
+    // An empty row has nothing to append after, and right would leave it
+    if (E.cy < E.numrows && E.cx < E.row[E.cy].size)
+      movecursor(ARROW_RIGHT);
     E.mode = 'i';
     break;
   case 'A':
@@ -2935,9 +9147,14 @@ void processcommands() {
     break;
 
   case 'v':
+  case CTRL_KEY('v'):
     E.sel_x = E.rx;
     E.sel_y = E.cy;
     E.mode = 'v';
+    E.block = c == CTRL_KEY('v');
+    break;
+  case CTRL_KEY('n'):
+    mcsearch();
     break;
 
   case 'x':
@@ -2948,42 +9165,77 @@ void processcommands() {
     // change cursor to underline
     write(STDOUT_FILENO, "\x1b[4 q", 5);
     int k = readkey();
-    rowdeletechar(&E.row[E.cy], E.cx);
-    rowinsertchar(&E.row[E.cy], E.cx, k);
+    replacecell(k);
     write(STDOUT_FILENO, "\x1b[6 q", 5);
     break;
   case 'R':
     E.mode = 'r';
     break;
   case 's':
-    rowdeletechar(&E.row[E.cy], E.cx);
+    rowdeletebytes(&E.row[E.cy], E.cx, nextcell(&E.row[E.cy], E.cx) - E.cx);
     E.mode = 'i';
     write(STDOUT_FILENO, "\x1b[6 q", 5);
     break;
 
+  case 'z':
+    foldcommand(readkey());
+    break;
+
+  case 'm':
+    markset(readkey());
+    break;
+  case '\'':
+  case '`':
+    markjump(readkey(), c == '`');
+    break;
+  case CTRL_KEY('o'):
+    jumpgo(-1);
+    break;
+  case '\t':
+    jumpgo(1);
+    break;
+
+  case 'q':
+    if (input.recording != -1) {
+      struct keylist *k = &input.reg[input.recording];
+      if (k->n && k->k[k->n - 1] == 'q')
+        k->n--;
+      input.recording = -1;
+    } else {
+      int r = readkey();
+      if (r >= 'a' && r <= 'z') {
+        input.reg[r - 'a'].n = 0;
+        input.recording = r - 'a';
+      }
+    }
+    break;
+
   case 'g':
     Normalgomove();
     break;
   case 'G':
+    jumppush(E.cy, E.cx);
     E.cy = E.numrows - 1;
     if (E.cx > E.row[E.numrows - 1].size)
       E.cx = E.row[E.numrows - 1].size - 1;
     break;
 
   case '~':
-    toggleCase();
+    toggleCase(1);
     break;
 
   case CTRL_KEY('a'):
-    incrementOrDecrement('i');
+    incrementOrDecrement(1);
     break;
   case CTRL_KEY('x'):
-    incrementOrDecrement('d');
+    incrementOrDecrement(-1);
     break;
 
   // Scroll down
   case CTRL_KEY('e'):
-    if (E.rowoff == E.cy) {
+    if (E.folds && !SOFT_WRAP)
+      foldscroll(1);
+    else if (E.rowoff == E.cy) {
       movecursor(ARROW_DOWN);
       E.rowoff++;
     } else
@@ -2992,6 +9244,10 @@ void processcommands() {
 
   // Scroll up
   case CTRL_KEY('y'):
+    if (E.folds && !SOFT_WRAP) {
+      foldscroll(-1);
+      break;
+    }
     if (E.rowoff >= 1)
       E.rowoff--;
     else
@@ -3052,14 +9308,30 @@ void processReplacement() {
     deletechar();
     break;
   default:
-    rowdeletechar(&E.row[E.cy], E.cx);
-    rowinsertchar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    replacecell(c);
+    E.cx = nextcell(&E.row[E.cy], E.cx);
   }
 }
 
 // Process insert mode keypresses
 void processkey() {
+  // Commands start in normal mode, the keys of the last one that changed the
+  // text are kept for .
+  if (E.mode == 'n') {
+    if (input.change) {
+      struct keylist t = input.last;
+      input.last = input.cur;
+      input.cur = t;
+      input.change = false;
+    }
+    input.cur.n = 0;
+  }
+  if (E.multi.n && (E.mode == 'n' || E.mode == 'i')) {
+    int c = readkey();
+    if (multikey(c))
+      return;
+    unreadkey(c);
+  }
   if (E.mode != 'i') {
     if (E.mode == 'n') {
       processcommands();
@@ -3090,9 +9362,7 @@ void processkey() {
         break;
       }
     }
-    write(STDOUT_FILENO, "\x1b[2j", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
+    editorquit();
 
     break;
 
@@ -3121,19 +9391,11 @@ void processkey() {
     break;
 
   case PG_UP:
-  case PG_DN: {
-    if (c == PG_UP)
-      E.cy = E.rowoff;
-    else if (c == PG_DN) {
-      E.cy = E.rowoff + E.rows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
-    }
-
-    int times = E.rows;
-    while (times--)
-      movecursor(c == PG_UP ? ARROW_UP : ARROW_DOWN);
-  } break;
+    cursorrow(foldmove(E.rowoff, -E.rows));
+    break;
+  case PG_DN:
+    cursorrow(foldmove(MIN(E.rowoff + E.rows - 1, E.numrows), E.rows));
+    break;
 
   case HOME:
     E.cx = 0;
@@ -3198,11 +9460,68 @@ void geteditor() {
   E.sel_x = 0;
   E.sel_y = 0;
   E.yankNewline = false;
+  E.folds = NULL;
+  E.swap = (struct swapjournal){.on = true, .fd = -1};
+  E.disk = (struct diskfile){.watch = -1};
+  E.pager = (struct pager){.fd = -1};
+  E.decode = (struct decoder){.fd = -1};
+  E.hex = (struct hexview){.fd = -1};
   if (windowsize(&E.rows, &E.cols) == -1)
-    kill("GetWindowSize");
+    die("GetWindowSize");
   E.rows -= 2;
 }
 
+// The numeric options and the values they accept
+struct option {
+  const char *key;
+  int *var;
+  long long *wide; // set instead of var for sizes in bytes
+  long long min, max;
+};
+
+struct option OPTIONS[] = {
+    {"TAB_LENGTH", &TAB_LENGTH, NULL, 1, 64},
+    {"RELATIVE_LINE_NUMBERS", &RELATIVE_LINE_NUMBERS, NULL, 0, 1},
+    {"UNDO_STACK_SIZE", &UNDO_STACK_SIZE, NULL, 2, 1 << 20},
+    {"DUMB", &DUMB, NULL, 0, 1},
+    {"AUTO_COMPLETION", &AUTO_COMPLETION, NULL, 0, 1},
+    {"SOFT_WRAP", &SOFT_WRAP, NULL, 0, 1},
+    {"LONG_LINE_LENGTH", &LONG_LINE_LENGTH, NULL, LONG_LINE_CHUNK, INT_MAX},
+    {"SWAP_INTERVAL", &SWAP_INTERVAL, NULL, 0, INT_MAX},
+    {"FOLLOW_LINES", &FOLLOW_LINES, NULL, 1, INT_MAX},
+    {"LARGE_FILE_SIZE", NULL, &LARGE_FILE_SIZE, 0, LLONG_MAX},
+    {"LARGE_LINE_LENGTH", &LARGE_LINE_LENGTH, NULL, 0, INT_MAX},
+    {"VIEW_FILE_SIZE", NULL, &VIEW_FILE_SIZE, 0, LLONG_MAX},
+    {"SYSTEM_CLIPBOARD", &SYSTEM_CLIPBOARD, NULL, 0, 2},
+};
+
+// Sets an option from its text, false for an unknown key. A value that is
+// not a number in the option's range is refused and the old one kept
+bool setconfig(const char *key, const char *value) {
+  struct option *o = NULL;
+  for (size_t i = 0; i < sizeof(OPTIONS) / sizeof(OPTIONS[0]); i++)
+    if (strcmp(key, OPTIONS[i].key) == 0)
+      o = &OPTIONS[i];
+  if (!o)
+    return false;
+  char *end;
+  errno = 0;
+  long long n = strtoll(value, &end, 10);
+  // Whatever follows a space is a comment
+  if (end == value || (*end && !isspace((unsigned char)*end)) || errno ||
+      n < o->min || n > o->max) {
+    setstatus("%s takes a number from %lld to %lld", key, o->min, o->max);
+    return true;
+  }
+  if (o->wide)
+    *o->wide = n;
+  else
+    *o->var = n;
+  if (o->var == &DUMB && DUMB)
+    E.mode = 'i';
+  return true;
+}
+
 void getConfig(char *filename) {
   FILE *fp = fopen(filename, "r");
   if (!fp)
@@ -3228,21 +9547,385 @@ void getConfig(char *filename) {
     while (*value == ' ')
       value++;
 
-    if (strcmp(key, "TAB_LENGTH") == 0)
-      TAB_LENGTH = atoi(value);
-    else if (strcmp(key, "RELATIVE_LINE_NUMBERS") == 0)
-      RELATIVE_LINE_NUMBERS = atoi(value);
-    else if (strcmp(key, "UNDO_STACK_SIZE") == 0)
-      UNDO_STACK_SIZE = atoi(value);
-    else if (strcmp(key, "DUMB") == 0) {
-      DUMB = (atoi(value) == 0 ? 0 : 1);
-      if (DUMB == 1)
-        E.mode = 'i';
-    } else if (strcmp(key, "AUTO_COMPLETION") == 0)
-      AUTO_COMPLETION = atoi(value);
+    setconfig(key, value);
+  }
+  free(line);
+  fclose(fp);
+}
+
+// Syntax files
+// Languages beyond HLDB are read from ~/.config/batata/syntax/*.syntax, in
+// the format of .batatarc:
+//   NAME=zig                    defaults to the file name
+//   EXTENSIONS=.zig build.zon   words without a dot match anywhere in a name
+//   COMMENT=//
+//   MULTILINE_COMMENT=/* */
+//   INDENT={ }
+//   KEYWORDS=fn pub const
+//   TYPES=u8 i32 bool
+//   HIGHLIGHT=numbers strings separators
+// The compiled syntaxes are cached in ~/.config/batata/syntax.cache, which is
+// used as long as every file keeps the size and mtime it was compiled from.
+
+#define SYNTAX_CACHE_MAGIC 0x78746e73 // "sntx"
+#define SYNTAX_CACHE_VERSION 1
+
+// The cache is one block, all references in it are offsets from its start
+// and 0 stands for NULL
+struct cachehead {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  uint32_t nfiles;
+  uint32_t files;
+  uint32_t nsyntax;
+  uint32_t syntaxes;
+};
+
+struct cachefile {
+  int64_t sec;
+  int64_t nsec;
+  int64_t size;
+  uint32_t name;
+};
+
+struct cachesyntax {
+  uint32_t ftype, sc, mcs, mce, is, ie;
+  uint32_t flags;
+  uint32_t ext, next; // array of string offsets
+  uint32_t kwmask, kwslot, kwtext, kwtextlen;
+};
+
+// Appends the words of value to a NULL terminated list, each followed by
+// suffix
+void splitwords(char ***list, int *n, const char *value, const char *suffix) {
+  while (*value) {
+    int len = strcspn(value, " \t");
+    if (len) {
+      *list = realloc(*list, sizeof(**list) * (*n + 2));
+      char *w = malloc(len + strlen(suffix) + 1);
+      if (!*list || !w)
+        die("malloc");
+      memcpy(w, value, len);
+      strcpy(&w[len], suffix);
+      (*list)[(*n)++] = w;
+      (*list)[*n] = NULL;
+    }
+    value += len;
+    value += strspn(value, " \t");
+  }
+}
+
+// The first and second word of value
+void wordpair(const char *value, char **first, char **second) {
+  char **words = NULL;
+  int n = 0;
+  splitwords(&words, &n, value, "");
+  *first = n > 0 ? words[0] : NULL;
+  *second = n > 1 ? words[1] : NULL;
+  for (int i = 2; i < n; i++)
+    free(words[i]);
+  free(words);
+}
+
+struct syntax *readsyntax(const char *path, const char *name) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+  struct syntax *s = calloc(1, sizeof(*s));
+  char **ext = NULL, **words = NULL;
+  int next = 0, nwords = 0;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    line[strcspn(line, "\r\n")] = 0;
+    char *eq = strchr(line, '=');
+    if (!eq)
+      continue;
+    *eq = '\0';
+    char *key = line;
+    char *value = eq + 1;
+    while (*key == ' ')
+      key++;
+    while (*value == ' ')
+      value++;
+
+    if (strcmp(key, "NAME") == 0 && !s->ftype)
+      s->ftype = strdup(value);
+    else if (strcmp(key, "EXTENSIONS") == 0)
+      splitwords(&ext, &next, value, "");
+    else if (strcmp(key, "COMMENT") == 0 && !s->singleCommentStart)
+      s->singleCommentStart = *value ? strdup(value) : NULL;
+    else if (strcmp(key, "MULTILINE_COMMENT") == 0 && !s->multicommentstart)
+      wordpair(value, &s->multicommentstart, &s->multicommentend);
+    else if (strcmp(key, "INDENT") == 0 && !s->IndentStart)
+      wordpair(value, &s->IndentStart, &s->IndentEnd);
+    else if (strcmp(key, "KEYWORDS") == 0)
+      splitwords(&words, &nwords, value, "");
+    else if (strcmp(key, "TYPES") == 0)
+      splitwords(&words, &nwords, value, "|");
+    else if (strcmp(key, "HIGHLIGHT") == 0)
+      s->flags = (strstr(value, "numbers") ? HL_NUMBERS : 0) |
+                 (strstr(value, "strings") ? HL_STRINGS : 0) |
+                 (strstr(value, "separators") ? HL_SEPARATORS : 0);
   }
   free(line);
   fclose(fp);
+
+  if (!s->ftype)
+    s->ftype = strndup(name, strlen(name) - strlen(".syntax"));
+  s->fmatch = ext;
+  s->kwtable = kwcompile(words);
+  for (int i = 0; i < nwords; i++)
+    free(words[i]);
+  free(words);
+  return s;
+}
+
+// Appends len bytes at an 8 byte boundary, returns their offset
+uint32_t cacheadd(struct abuf *ab, const void *p, int len) {
+  static const char zero[8];
+  abAdd(ab, zero, -ab->len & 7);
+  uint32_t off = ab->len;
+  abAdd(ab, p, len);
+  return off;
+}
+
+uint32_t cachestr(struct abuf *ab, const char *s) {
+  if (!s)
+    return 0;
+  uint32_t off = ab->len;
+  abAdd(ab, s, strlen(s) + 1);
+  return off;
+}
+
+void writesyntaxcache(const char *path, struct cachefile *files, char **names,
+                      int nfiles, struct syntax **list, int n) {
+  struct abuf ab = ABUF_INIT;
+  struct cachesyntax *cs = calloc(n ? n : 1, sizeof(*cs));
+  struct cachehead head = {SYNTAX_CACHE_MAGIC, SYNTAX_CACHE_VERSION, 0,
+                           nfiles, 0, n, 0};
+  cacheadd(&ab, &head, sizeof(head));
+  head.files = cacheadd(&ab, files, nfiles * sizeof(*files));
+  head.syntaxes = cacheadd(&ab, cs, n * sizeof(*cs));
+
+  for (int i = 0; i < nfiles; i++)
+    files[i].name = cachestr(&ab, names[i]);
+  for (int i = 0; i < n; i++) {
+    struct syntax *s = list[i];
+    struct kwtable *kw = s->kwtable;
+    int next = 0;
+    while (s->fmatch && s->fmatch[next])
+      next++;
+    uint32_t *ext = malloc(sizeof(*ext) * (next ? next : 1));
+    for (int j = 0; j < next; j++)
+      ext[j] = cachestr(&ab, s->fmatch[j]);
+    cs[i] = (struct cachesyntax){
+        cachestr(&ab, s->ftype),
+        cachestr(&ab, s->singleCommentStart),
+        cachestr(&ab, s->multicommentstart),
+        cachestr(&ab, s->multicommentend),
+        cachestr(&ab, s->IndentStart),
+        cachestr(&ab, s->IndentEnd),
+        s->flags,
+        cacheadd(&ab, ext, sizeof(*ext) * next),
+        next,
+        kw->mask,
+        cacheadd(&ab, kw->slot, sizeof(*kw->slot) * (kw->mask + 1)),
+        cacheadd(&ab, kw->text, kw->textlen),
+        kw->textlen,
+    };
+    free(ext);
+  }
+  head.size = ab.len;
+  memcpy(ab.b, &head, sizeof(head));
+  memcpy(ab.b + head.files, files, nfiles * sizeof(*files));
+  memcpy(ab.b + head.syntaxes, cs, n * sizeof(*cs));
+  free(cs);
+
+  // Written aside and renamed over, so a reader never sees half a cache
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  if (fp) {
+    bool ok = fwrite(ab.b, 1, ab.len, fp) == (size_t)ab.len;
+    if (fclose(fp) == 0 && ok)
+      rename(tmp, path);
+    else
+      unlink(tmp);
+  }
+  abFree(&ab);
+}
+
+// Whether n items of size bytes at off lie inside a cache of len bytes,
+// aligned as cacheadd leaves them
+bool cachefits(uint32_t off, uint64_t n, size_t size, uint32_t len) {
+  return off % 8 == 0 && off <= len && n * size <= len - off;
+}
+
+// Whether every offset of a cached syntax stays inside the cache. Strings
+// need no end check, the cache is checked to end in a NUL
+bool cachesyntaxok(const char *buf, uint32_t len, struct cachesyntax *c) {
+  uint32_t str[] = {c->ftype, c->sc, c->mcs, c->mce, c->is, c->ie};
+  for (size_t i = 0; i < sizeof(str) / sizeof(str[0]); i++)
+    if (str[i] >= len)
+      return false;
+  if (!c->ftype || !cachefits(c->ext, c->next, sizeof(uint32_t), len) ||
+      (c->kwmask & (c->kwmask + 1)) ||
+      !cachefits(c->kwslot, (uint64_t)c->kwmask + 1, sizeof(struct kwslot),
+                 len) ||
+      !c->kwtextlen || c->kwtext >= len || c->kwtextlen > len - c->kwtext)
+    return false;
+  const uint32_t *ext = (const uint32_t *)(buf + c->ext);
+  for (uint32_t j = 0; j < c->next; j++)
+    if (!ext[j] || ext[j] >= len)
+      return false;
+  // kwlookup stops at an empty slot, so there must be one
+  const struct kwslot *slot = (const struct kwslot *)(buf + c->kwslot);
+  bool empty = false;
+  for (uint64_t j = 0; j <= c->kwmask; j++) {
+    const struct kwslot *k = &slot[j];
+    if (!k->off)
+      empty = true;
+    else if (k->off >= c->kwtextlen || k->len > c->kwtextlen - k->off ||
+             (k->hl != KEY1 && k->hl != KEY2))
+      return false;
+  }
+  return empty;
+}
+
+// Registers the cached syntaxes if the cache was compiled from exactly these
+// files. Any offset out of place means the cache is damaged and the syntax
+// files are read instead
+bool readsyntaxcache(const char *path, struct cachefile *files, char **names,
+                     int nfiles) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return false;
+  struct cachehead head;
+  char *buf = NULL;
+  bool ok = fread(&head, sizeof(head), 1, fp) == 1 &&
+            head.magic == SYNTAX_CACHE_MAGIC &&
+            head.version == SYNTAX_CACHE_VERSION &&
+            head.nfiles == (uint32_t)nfiles && head.size >= sizeof(head);
+  if (ok) {
+    buf = malloc(head.size);
+    rewind(fp);
+    ok = buf && fread(buf, 1, head.size, fp) == head.size &&
+         fgetc(fp) == EOF && buf[head.size - 1] == '\0';
+  }
+  fclose(fp);
+  ok = ok &&
+       cachefits(head.files, nfiles, sizeof(struct cachefile), head.size) &&
+       cachefits(head.syntaxes, head.nsyntax, sizeof(struct cachesyntax),
+                 head.size);
+  struct cachefile *cf = ok ? (struct cachefile *)(buf + head.files) : NULL;
+  struct cachesyntax *cs =
+      ok ? (struct cachesyntax *)(buf + head.syntaxes) : NULL;
+  for (int i = 0; ok && i < nfiles; i++)
+    ok = cf[i].sec == files[i].sec && cf[i].nsec == files[i].nsec &&
+         cf[i].size == files[i].size && cf[i].name < head.size &&
+         !strcmp(buf + cf[i].name, names[i]);
+  for (uint32_t i = 0; ok && i < head.nsyntax; i++)
+    ok = cachesyntaxok(buf, head.size, &cs[i]);
+  if (!ok) {
+    free(buf);
+    return false;
+  }
+
+  // The syntaxes point into buf, which stays around for as long as they do
+  struct syntax *list = calloc(head.nsyntax, sizeof(*list));
+  struct kwtable *kw = calloc(head.nsyntax, sizeof(*kw));
+  if (head.nsyntax && (!list || !kw))
+    die("calloc");
+  for (uint32_t i = 0; i < head.nsyntax; i++) {
+    struct syntax *s = &list[i];
+#define CACHESTR(off) ((off) ? buf + (off) : NULL)
+    s->ftype = CACHESTR(cs[i].ftype);
+    s->singleCommentStart = CACHESTR(cs[i].sc);
+    s->multicommentstart = CACHESTR(cs[i].mcs);
+    s->multicommentend = CACHESTR(cs[i].mce);
+    s->IndentStart = CACHESTR(cs[i].is);
+    s->IndentEnd = CACHESTR(cs[i].ie);
+    s->flags = cs[i].flags;
+    s->fmatch = malloc(sizeof(*s->fmatch) * (cs[i].next + 1));
+    if (!s->fmatch)
+      die("malloc");
+    uint32_t *ext = (uint32_t *)(buf + cs[i].ext);
+    for (uint32_t j = 0; j < cs[i].next; j++)
+      s->fmatch[j] = buf + ext[j];
+    s->fmatch[cs[i].next] = NULL;
+#undef CACHESTR
+    kw[i] = (struct kwtable){cs[i].kwmask,
+                             (struct kwslot *)(buf + cs[i].kwslot),
+                             buf + cs[i].kwtext, cs[i].kwtextlen};
+    s->kwtable = &kw[i];
+    addsyntax(s);
+  }
+  return true;
+}
+
+int namecmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void loadsyntaxes(const char *home) {
+  for (int j = 0; (unsigned long int)j < HLDB_SIZE; j++)
+    addsyntax(&HLDB[j]);
+  char dir[PATH_MAX], cache[PATH_MAX], path[PATH_MAX + NAME_MAX + 1];
+  snprintf(dir, sizeof(dir), "%s/.config/batata/syntax", home);
+  snprintf(cache, sizeof(cache), "%s/.config/batata/syntax.cache", home);
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  char **names = NULL;
+  int n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    int len = strlen(ent->d_name);
+    if (ent->d_name[0] == '.' || len <= 7 ||
+        strcmp(&ent->d_name[len - 7], ".syntax"))
+      continue;
+    names = realloc(names, sizeof(*names) * (n + 1));
+    names[n++] = strdup(ent->d_name);
+  }
+  closedir(d);
+  qsort(names, n, sizeof(*names), namecmp);
+
+  struct cachefile *files = calloc(n ? n : 1, sizeof(*files));
+  int nfiles = 0;
+  for (int i = 0; i < n; i++) {
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    if (stat(path, &st) == -1) {
+      free(names[i]);
+      continue;
+    }
+    files[nfiles] = (struct cachefile){st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                                       st.st_size, 0};
+    names[nfiles++] = names[i];
+  }
+
+  if (nfiles && !readsyntaxcache(cache, files, names, nfiles)) {
+    struct syntax **list = malloc(sizeof(*list) * nfiles);
+    int nlist = 0;
+    for (int i = 0; i < nfiles; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+      struct syntax *s = readsyntax(path, names[i]);
+      if (s) {
+        list[nlist++] = s;
+        addsyntax(s);
+      }
+    }
+    writesyntaxcache(cache, files, names, nfiles, list, nlist);
+    free(list);
+  }
+  for (int i = 0; i < nfiles; i++)
+    free(names[i]);
+  free(names);
+  free(files);
 }
 
 int main(int argc, char *argv[]) {
@@ -3254,9 +9937,18 @@ int main(int argc, char *argv[]) {
            getenv("HOME"));
   if (getenv("HOME") != NULL)
     getConfig(configPath);
+  if (getenv("HOME") != NULL)
+    loadsyntaxes(getenv("HOME"));
   char *filename = NULL;
+  bool view = false, hex = false;
   for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-dumb") == 0 || strcmp(argv[i], "-d") == 0) {
+    if (strcmp(argv[i], "-f") == 0) {
+      E.follow = true;
+    } else if (strcmp(argv[i], "-R") == 0) {
+      view = true;
+    } else if (strcmp(argv[i], "-x") == 0) {
+      hex = true;
+    } else if (strcmp(argv[i], "-dumb") == 0 || strcmp(argv[i], "-d") == 0) {
       DUMB = 1;
       E.mode = 'i';
     } else if (!filename) {
@@ -3264,11 +9956,18 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (filename) {
+  if (E.follow && filename) {
+    followopen(filename);
+  } else if (hex && filename) {
+    hexopen(filename);
+  } else if (view && filename) {
+    pageropen(filename);
+  } else if (filename) {
     editorOpen(filename);
   }
 
-  setstatus("TIP: Ctrl-S to save | Ctrl-Q to quit | Ctrl-F to find");
+  if (E.status[0] == '\0')
+    setstatus("TIP: Ctrl-S to save | Ctrl-Q to quit | Ctrl-F to find");
 
   while (1) {
     clearscreen();